@@ -0,0 +1,225 @@
+#!/usr/bin/python3
+
+"""
+chat.py
+Griffin Melnick, melnig@rpi.edu
+
+    Side-by-side benchmark of the homework4 chat server's epoll and io_uring
+    backends. Builds hw4/homework4.c and the load generator hw4/loadgen.c, then
+    for each run starts the server with each backend in turn and drives it with
+    loadgen, and writes one CSV row per backend, run and command. The program
+    is run by calling
+
+        bash$ python3 chat.py <csv-output-file> [<connections> [<seconds> [<runs>]]]
+
+    where <csv-output-file> is the file to which to write results, the optional
+    <connections> is the number of TCP clients (10000 by default), the optional
+    <seconds> is how long loadgen runs, and the optional <runs> is the number of
+    repetitions of each backend.
+
+    The default mix is mostly SEND, with some LOGOUT/LOGIN churn and rare WHO,
+    so that the server's time goes to accepting, reading and writing sockets
+    rather than to building large WHO or BROADCAST replies. Each row records
+    loadgen's throughput and p50/p99/p999 latency for the command, and the
+    server's CPU time per reply and context switches for the whole run.
+    Throughput is over loadgen's measured window, from the start of load to
+    the last reply, which is recorded as window_s; the wait for stragglers
+    after it is left out. On a host with few cores loadgen competes with the
+    server, so CPU per reply is the fairer comparison. The backend column is the one the server reports
+    running, which is epoll if the kernel lacks io_uring support.
+"""
+
+import csv
+import os
+import re
+import shutil
+import signal
+import subprocess
+import sys
+import tempfile
+import time
+
+ROOT = os.path.dirname( os.path.dirname(os.path.abspath(__file__)) )
+CFLAGS = [ "-std=gnu99", "-O2", "-pthread" ]
+BACKENDS = [ "epoll", "uring" ]
+CONNECTIONS = 10000
+MIX = "1,90,0,0,9"                              # WHO,SEND,BROADCAST,SHARE,LOGOUT #
+SECONDS = 10
+RUNS = 3
+UDP = 16
+STARTUP = 10                                    # seconds for the server to listen #
+
+FIELDS = [ "backend", "connections", "run", "status", "command", "count",
+           "errors", "timeouts", "ops_s", "mean_us", "p50_us", "p99_us",
+           "p999_us", "max_us", "window_s", "replies_s", "server_cpu_ms",
+           "cpu_us_per_reply",
+           "vol_ctx", "invol_ctx" ]
+
+LISTENING = re.compile( r"^MAIN: Listening for (TCP|UDP) \w+ on port: (\d+)" )
+RUNNING = re.compile( r"^MAIN: Running \d+ (\S+) reactor" )
+TOTAL = re.compile( r"^MAIN: (\d+) replies in ([\d.]+) s \(([\d.]+)/s\)" )
+COMMAND = re.compile( r"^MAIN: ([A-Z]+)\s+(\d+)\s+(\d+)\s+(\d+)\s+([\d.]+)\s+" + \
+        r"([\d.]+)\s+([\d.]+)\s+([\d.]+)\s+([\d.]+)\s+([\d.]+)$" )
+
+# ---------------------------------------------------------------------------- #
+
+"""
+Builds one of the hw4 programs.
+:param:     src, source file relative to the repository root.
+            out, path of the binary to build.
+:return:    True if the build succeeded.
+"""
+def build( src, out ):
+    rc = subprocess.call( ["gcc"] + CFLAGS + ["-o", out, os.path.join(ROOT, src)],
+            stdout = subprocess.DEVNULL, stderr = subprocess.DEVNULL )
+    return ( rc == 0 )
+
+
+"""
+Starts the server on ports of the kernel's choosing. Its log goes to a file,
+which is read only until the ports and backend are known; a pipe would fill
+and stall it.
+:param:     server, path of the server binary.
+            backend, "epoll" or "uring".
+            log, open file for the server's output.
+:return:    three-tuple of process, ports (TCP, UDP) and backend running, or
+            None for the last two if the server did not start.
+"""
+def start( server, backend, log ):
+    proc = subprocess.Popen( [server, "0", "0", "--io", backend], stdout = log,
+            stderr = subprocess.DEVNULL, start_new_session = True )
+    ports, running = {}, None
+    began = time.monotonic()
+    while ( (running is None) and (proc.poll() is None) and
+            ((time.monotonic() - began) < STARTUP) ):
+        time.sleep( 0.05 )
+        log.seek( 0 )
+        for line in log.read().splitlines():
+            match = LISTENING.match( line )
+            if ( match ):
+                ports[ match.group(1) ] = match.group( 2 )
+            match = RUNNING.match( line )
+            if ( match ):
+                running = match.group( 1 )
+
+    if ( running is None ):
+        return ( proc, None, None )
+    return ( proc, (ports["TCP"], ports["UDP"]), running )
+
+
+"""
+Stops the server and collects its resource usage.
+:param:     proc, server process.
+:return:    rusage of the server.
+"""
+def stop( proc ):
+    try:
+        os.killpg( proc.pid, signal.SIGKILL )
+    except ProcessLookupError:
+        pass
+    _, _, usage = os.wait4( proc.pid, 0 )
+    proc.returncode = 0
+    return usage
+
+
+"""
+Runs loadgen against a server.
+:param:     loadgen, path of the loadgen binary.
+            ports, the server's (TCP, UDP) ports.
+            connections, number of TCP clients.
+            seconds, length of the run.
+            seed, seed for the workload.
+:return:    two-tuple of status and loadgen's output lines.
+"""
+def load( loadgen, ports, connections, seconds, seed ):
+    args = [ loadgen, ports[0], ports[1], "--tcp", str(connections), "--udp",
+             str(UDP), "--seconds", str(seconds), "--seed", str(seed), "--mix",
+             MIX, "--files", os.path.join(ROOT, "hw4", "test-files") ]
+    try:
+        done = subprocess.run( args, stdout = subprocess.PIPE, stderr =
+                subprocess.DEVNULL, timeout = seconds + 60,
+                universal_newlines = True )
+    except subprocess.TimeoutExpired:
+        return ( "timeout", [] )
+
+    status = "ok" if ( done.returncode == 0 ) else "exit {}".format( done.returncode )
+    return ( status, done.stdout.splitlines() )
+
+# ---------------------------------------------------------------------------- #
+
+if ( __name__ == "__main__" ):
+    if ( (len(sys.argv) < 2) or (len(sys.argv) > 5) ):
+        sys.exit( "ERROR: Invalid arguments\nUSAGE: ./chat.py <csv-output-file> " + \
+                "[<connections> [<seconds> [<runs>]]]" )
+
+    try:
+        connections = int( sys.argv[2] ) if ( len(sys.argv) > 2 ) else CONNECTIONS
+        seconds = int( sys.argv[3] ) if ( len(sys.argv) > 3 ) else SECONDS
+        runs = int( sys.argv[4] ) if ( len(sys.argv) > 4 ) else RUNS
+        if ( (connections <= 0) or (seconds <= 0) or (runs <= 0) ):
+            raise ValueError
+    except ValueError:
+        sys.exit( "ERROR: Invalid arguments\nUSAGE: ./chat.py <csv-output-file> " + \
+                "[<connections> [<seconds> [<runs>]]]" )
+
+    try:
+        f_out = open( sys.argv[1], 'w', newline = '' )
+    except:
+        sys.exit( "ERROR: Invalid output file" )
+
+    writer = csv.DictWriter( f_out, fieldnames = FIELDS )
+    writer.writeheader()
+
+    build_dir = tempfile.mkdtemp( prefix = "chat-" )
+    server = os.path.join( build_dir, "homework4" )
+    loadgen = os.path.join( build_dir, "loadgen" )
+    try:
+        if ( (not build("hw4/homework4.c", server)) or
+                (not build("hw4/loadgen.c", loadgen)) ):
+            sys.exit( "ERROR: build failed" )
+
+        # Backends take turns within each run, so drift hits both alike. #
+        for r in range( runs ):
+            for backend in BACKENDS:
+                with tempfile.TemporaryFile( 'w+' ) as log:
+                    proc, ports, running = start( server, backend, log )
+                    status, lines = ( "no-server", [] )
+                    if ( ports ):
+                        status, lines = load( loadgen, ports, connections,
+                                seconds, r + 1 )
+                    usage = stop( proc )
+
+                total = [ TOTAL.match(l) for l in lines if TOTAL.match(l) ]
+                replies = int( total[0].group(1) ) if ( total ) else 0
+                cpu_ms = ( usage.ru_utime + usage.ru_stime ) * 1000
+                common = { "backend" : (running or backend),
+                           "connections" : connections, "run" : r,
+                           "status" : status,
+                           "window_s" : (total[0].group(2) if total else ""),
+                           "replies_s" : ("{0:.1f}".format(replies / float(
+                                total[0].group(2))) if (total and
+                                float(total[0].group(2))) else ""),
+                           "server_cpu_ms" : "{0:.1f}".format(cpu_ms),
+                           "cpu_us_per_reply" : ("{0:.2f}".format(cpu_ms * 1000
+                                / replies) if replies else ""),
+                           "vol_ctx" : usage.ru_nvcsw,
+                           "invol_ctx" : usage.ru_nivcsw }
+
+                rows = [ COMMAND.match(l) for l in lines if COMMAND.match(l) ]
+                for match in rows:
+                    row = dict( common )
+                    row.update( zip(["command", "count", "errors", "timeouts",
+                            "ops_s", "mean_us", "p50_us", "p99_us", "p999_us",
+                            "max_us"], match.groups()) )
+                    writer.writerow( row )
+                if ( not rows ):
+                    writer.writerow( common )
+                f_out.flush()
+                print( "{} run {}: {} {} replies/s, {} us CPU per reply".format(
+                        common["backend"], r, status, common["replies_s"],
+                        common["cpu_us_per_reply"]) )
+    finally:
+        shutil.rmtree( build_dir, ignore_errors = True )
+        f_out.close()
+
+    sys.exit()
@@ -0,0 +1,274 @@
+#!/usr/bin/python3
+
+"""
+knights.py
+Griffin Melnick, melnig@rpi.edu
+
+    Benchmark harness for the knight's tour engines. Builds the fork engines in
+    hw2 (homework2.c, homework2-redo.c, homework2-edit.c) and the pthread engine
+    in hw3 (homework3.c) with BENCH_MODE defined, runs each across a matrix of
+    board sizes and worker counts, and writes one CSV row per run. The program
+    is run by calling
+
+        bash$ python3 knights.py <csv-output-file> [<sizes> [<workers> [<runs>]]]
+
+    where <csv-output-file> is the file to which to write results, the optional
+    <sizes> is a comma-separated list of boards such as "3x3,3x4,4x4", the
+    optional <workers> is a comma-separated list of CPU counts to which each run
+    is pinned, and the optional <runs> is the number of repetitions of each
+    configuration.
+
+    Each row records wall time, nodes explored and peak RSS (both reported by
+    the engines under BENCH_MODE), forks/threads created, and voluntary and
+    involuntary context switches. Results are checked against the samples in hw2/output and
+    hw3/output for the same board: the best solution and the multiset of dead
+    end depths must match, since line order varies from run to run.
+"""
+
+from collections import Counter
+import csv
+import os
+import re
+import shutil
+import signal
+import subprocess
+import sys
+import tempfile
+import time
+
+ROOT = os.path.dirname( os.path.dirname(os.path.abspath(__file__)) )
+CFLAGS = [ "-std=gnu99", "-O2", "-pthread", "-DBENCH_MODE" ]
+SIZES = "3x3,3x4,4x3,3x5,3x6,4x4"
+TIMEOUT = 30                                    # seconds per run #
+WORKERS = "1,2,4"
+RUNS = 3
+
+# ( name, source, sample directory, whether children are threads ) #
+ENGINES = [ ("hw2",      "hw2/homework2.c",      "hw2/output", False),
+            ("hw2-redo", "hw2/homework2-redo.c", "hw2/output", False),
+            ("hw2-edit", "hw2/homework2-edit.c", "hw2/output", False),
+            ("hw3",      "hw3/homework3.c",      "hw3/output", True) ]
+
+FIELDS = [ "engine", "m", "n", "workers", "run", "status", "wall_ms", "nodes",
+           "best", "peak_rss_kb", "forks", "threads", "vol_ctx", "invol_ctx",
+           "check" ]
+
+SOLVING = re.compile( r"^(?:PID|THREAD) (\d+): Solving the knight's tour " + \
+        r"problem for a (\d+)x(\d+)" )
+BRANCH = re.compile( r"^(?:PID|THREAD) (\d+): (\d+) moves possible after move" )
+DEAD = re.compile( r"^(?:PID|THREAD) \d+: Dead end after move #(\d+)" )
+BEST = re.compile( r"^(?:PID|THREAD) (\d+): Best solution found visits (\d+)" )
+COUNTER = re.compile( r"^BENCH: (\w+) (\d+)" )
+
+# ---------------------------------------------------------------------------- #
+
+"""
+Summarizes engine output. Only the top-level process or thread, the one
+announcing the board, may report the best solution.
+:param:     lines, list of output lines.
+:return:    three-tuple of best solution (or None), Counter of dead end depths,
+            and count of children created.
+"""
+def summarize( lines ):
+    best, dead, children, root = None, Counter(), 0, None
+    for line in lines:
+        match = SOLVING.match( line )
+        if ( match ):
+            root = match.group( 1 )
+            continue
+
+        match = BRANCH.match( line )
+        if ( match ):
+            children += int( match.group(2) )
+            continue
+
+        match = DEAD.match( line )
+        if ( match ):
+            dead[ int(match.group(1)) ] += 1
+            continue
+
+        match = BEST.match( line )
+        if ( (match) and (match.group(1) == root) ):
+            best = int( match.group(2) )
+
+    return ( best, dead, children )
+
+
+"""
+Loads sample outputs for a set of engines.
+:param:     directory, sample directory relative to the repository root.
+:return:    dict mapping (m, n) to list of (best, dead end Counter) pairs.
+"""
+def load_samples( directory ):
+    samples = {}
+    path = os.path.join( ROOT, directory )
+    for name in sorted( os.listdir(path) ):
+        if ( name.startswith("sorted-") ):
+            continue
+
+        with open( os.path.join(path, name), 'r' ) as f:
+            lines = f.read().splitlines()
+
+        match = SOLVING.match( lines[0] ) if ( lines ) else None
+        if ( match ):
+            best, dead, _ = summarize( lines )
+            key = ( int(match.group(2)), int(match.group(3)) )
+            samples.setdefault( key, [] ).append( (best, dead) )
+
+    return samples
+
+
+"""
+Builds an engine with BENCH_MODE defined.
+:param:     src, source file relative to the repository root.
+            out, path of the binary to build.
+:return:    True if the build succeeded.
+"""
+def build( src, out ):
+    rc = subprocess.call( ["gcc"] + CFLAGS + ["-o", out, os.path.join(ROOT, src)],
+            stdout = subprocess.DEVNULL, stderr = subprocess.DEVNULL )
+    return ( rc == 0 )
+
+
+"""
+Runs one engine on one board, pinned to the given number of CPUs. The engine
+gets its own session so that a timeout, or a child left behind, takes down the
+whole process tree.
+:param:     binary, path of engine to run.
+            m, n, board dimensions.
+            workers, number of CPUs the run may use.
+:return:    five-tuple of status, wall time in ms, rusage (or None), stdout
+            lines, and stderr lines.
+"""
+def run( binary, m, n, workers ):
+    allowed = os.sched_getaffinity( 0 )
+    with tempfile.TemporaryFile( 'w+' ) as out, tempfile.TemporaryFile( 'w+' ) as err:
+        # Affinity is inherited, so pin ourselves just long enough to spawn. #
+        os.sched_setaffinity( 0, sorted(allowed)[ :workers ] )
+        start = time.monotonic()
+        try:
+            pid = os.posix_spawn( binary, [binary, str(m), str(n)], os.environ,
+                    file_actions = [ (os.POSIX_SPAWN_DUP2, out.fileno(), 1),
+                                     (os.POSIX_SPAWN_DUP2, err.fileno(), 2) ],
+                    setsid = True )
+        finally:
+            os.sched_setaffinity( 0, allowed )
+
+        status, usage = "ok", None
+        while 1:
+            done, rc, usage = os.wait4( pid, os.WNOHANG )
+            if ( done != 0 ):
+                break
+
+            if ( (time.monotonic() - start) > TIMEOUT ):
+                os.killpg( pid, signal.SIGKILL )
+                _, rc, usage = os.wait4( pid, 0 )
+                status = "timeout"
+                break
+
+            time.sleep( 0.001 )
+
+        wall = ( time.monotonic() - start ) * 1000
+        try:
+            os.killpg( pid, signal.SIGKILL )
+        except ProcessLookupError:
+            pass
+
+        if ( (status == "ok") and (rc != 0) ):
+            status = "exit {}".format( os.waitstatus_to_exitcode(rc) )
+
+        out.seek( 0 )
+        err.seek( 0 )
+        return ( status, wall, usage, out.read().splitlines(),
+                err.read().splitlines() )
+
+
+"""
+Checks a run against the samples for the same board.
+:param:     samples, dict returned by load_samples.
+            m, n, board dimensions.
+            best, dead, summary of the run.
+:return:    "ok", "mismatch", or "no-sample".
+"""
+def check( samples, m, n, best, dead ):
+    if ( (m, n) not in samples ):
+        return "no-sample"
+
+    for sample_best, sample_dead in samples[ (m, n) ]:
+        if ( (best == sample_best) and (dead == sample_dead) ):
+            return "ok"
+
+    return "mismatch"
+
+# ---------------------------------------------------------------------------- #
+
+if ( __name__ == "__main__" ):
+    if ( (len(sys.argv) < 2) or (len(sys.argv) > 5) ):
+        sys.exit( "ERROR: Invalid arguments\nUSAGE: ./knights.py <csv-output-file> " + \
+                "[<sizes> [<workers> [<runs>]]]" )
+
+    try:
+        sizes = [ tuple( int(d) for d in s.split('x') ) for s in \
+                (sys.argv[2] if (len(sys.argv) > 2) else SIZES).split(',') ]
+        workers = [ int(w) for w in \
+                (sys.argv[3] if (len(sys.argv) > 3) else WORKERS).split(',') ]
+        runs = int( sys.argv[4] ) if ( len(sys.argv) > 4 ) else RUNS
+        if ( [ s for s in sizes if ((len(s) != 2) or (min(s) <= 2)) ] or \
+                [ w for w in workers if w <= 0 ] or (runs <= 0) ):
+            raise ValueError
+    except ValueError:
+        sys.exit( "ERROR: Invalid arguments\nUSAGE: ./knights.py <csv-output-file> " + \
+                "[<sizes> [<workers> [<runs>]]]" )
+
+    # Workers beyond the CPUs available would only repeat the largest count. #
+    available = len( os.sched_getaffinity(0) )
+    workers = sorted( set( min(w, available) for w in workers ) )
+
+    try:
+        f_out = open( sys.argv[1], 'w', newline = '' )
+    except:
+        sys.exit( "ERROR: Invalid output file" )
+
+    writer = csv.DictWriter( f_out, fieldnames = FIELDS )
+    writer.writeheader()
+
+    build_dir = tempfile.mkdtemp( prefix = "knights-" )
+    samples = {}
+    try:
+        for name, src, sample_dir, threaded in ENGINES:
+            binary = os.path.join( build_dir, name )
+            if ( not build(src, binary) ):
+                print( "{}: build failed; skipping".format(name), file = sys.stderr )
+                continue
+
+            if ( sample_dir not in samples ):
+                samples[ sample_dir ] = load_samples( sample_dir )
+
+            for m, n in sizes:
+                for w in workers:
+                    for r in range( runs ):
+                        status, wall, usage, out, err = run( binary, m, n, w )
+                        best, dead, children = summarize( out )
+                        counters = dict( COUNTER.match(l).groups() for l in err \
+                                if COUNTER.match(l) )
+
+                        row = { "engine" : name, "m" : m, "n" : n, "workers" : w,
+                                "run" : r, "status" : status,
+                                "wall_ms" : "{0:.3f}".format(wall),
+                                "nodes" : counters.get("nodes", ""),
+                                "best" : ("" if best is None else best),
+                                "peak_rss_kb" : counters.get("peak_rss_kb", ""),
+                                "forks" : (0 if threaded else children),
+                                "threads" : (children if threaded else 0),
+                                "vol_ctx" : (usage.ru_nvcsw if usage else ""),
+                                "invol_ctx" : (usage.ru_nivcsw if usage else ""),
+                                "check" : check(samples[sample_dir], m, n, best, dead) }
+                        writer.writerow( row )
+                        f_out.flush()
+                        print( "{} {}x{} w={} run {}: {} {}ms {}".format(name, m,
+                                n, w, r, status, row["wall_ms"], row["check"]) )
+    finally:
+        shutil.rmtree( build_dir, ignore_errors = True )
+        f_out.close()
+
+    sys.exit()
@@ -0,0 +1,315 @@
+#!/usr/bin/python3
+
+"""
+sched.py
+Griffin Melnick, melnig@rpi.edu
+
+    Synthetic workloads and a scaling benchmark for the p1 scheduling
+    simulator. A workload is generated by calling
+
+        bash$ python3 sched.py --gen <input-file> <procs> [<spec> [<seed>]]
+
+    which writes <procs> processes to <input-file> in p1's input format. The
+    benchmark is run by calling
+
+        bash$ python3 sched.py <csv-output-file> [<sizes> [<algorithms> \
+                [<spec> [<seed>]]]]
+
+    where <sizes> is a comma-separated list of process counts (by default up to
+    100000), <algorithms> a comma-separated list of FCFS, SRT, RR and CFS, and
+    <spec> the workload distributions, a comma-separated list of
+
+        arrival=exp:<mean>          Poisson arrivals, mean gap in ms
+        burst=exp:<mean>            exponential CPU bursts, or
+        burst=bimodal:<short>:<long>:<p-long>
+                                    exponential bursts of either mean, the
+                                    long one with probability <p-long>
+        bursts=<lo>:<hi>            bursts per process, uniform
+        io=exp:<mean>               exponential I/O time, or io=<ms> fixed
+        nice=<lo>:<hi>              CFS nice level, uniform
+
+    Any field left out keeps its default in SPEC. The same <seed> gives the same
+    workload, and every size is drawn from its own generator seeded alike.
+
+    Each simulation runs in a fresh interpreter with p1's output off, so that
+    its peak RSS is its own. Events are the lines the simulator reports, each
+    an arrival, I/O completion, burst start or end, preemption or slice expiry,
+    and throughput is events per second of simulation. Each row also records
+    the RSS after the workload is read and the simulator's summary stats.
+"""
+
+import csv
+import os
+import random
+import resource
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+ROOT = os.path.dirname( os.path.dirname(os.path.abspath(__file__)) )
+SIZES = "100,1000,10000,100000"
+ALGORITHMS = "FCFS,SRT,RR,CFS"
+SPEC = "arrival=exp:250,burst=exp:40,bursts=1:8,io=exp:200,nice=0:0"
+SEED = 1
+TIMEOUT = 3600                                  # seconds per simulation #
+
+FIELDS = [ "procs", "algorithm", "status", "events", "sim_s", "events_s",
+           "base_rss_kb", "peak_rss_kb", "end_ms", "avg_burst_ms",
+           "avg_wait_ms", "avg_turnaround_ms", "context_switches", "preemptions" ]
+
+# ---------------------------------------------------------------------------- #
+
+"""
+Parses a workload spec over the defaults in SPEC.
+:param:     text, comma-separated list of field=value.
+:return:    dict mapping field to list of its ':'-separated parts, numbers
+            after the first for arrival, burst and io.
+:raises:    ValueError if text is malformed.
+"""
+def parse_spec( text ):
+    spec = {}
+    for part in ( SPEC + ',' + text ).split( ',' ):
+        if ( not part ):
+            continue
+
+        field, value = part.split( '=' )
+        parts = value.split( ':' )
+        if ( field in ("arrival", "burst", "io") ):
+            if ( (field == "io") and (len(parts) == 1) ):
+                parts = [ "fixed", float(parts[0]) ]
+            else:
+                parts = [ parts[0] ] + [ float(p) for p in parts[1:] ]
+            if ( (parts[0], len(parts)) not in (("exp", 2), ("fixed", 2),
+                    ("bimodal", 4)) ) or ( min(parts[1:]) < 0 ) or \
+                    ( (field == "arrival") and (parts[0] != "exp") ):
+                raise ValueError
+
+        elif ( field in ("bursts", "nice") ):
+            parts = [ int(p) for p in parts ]
+            if ( (len(parts) != 2) or (parts[0] > parts[1]) ):
+                raise ValueError
+
+        else:
+            raise ValueError
+
+        spec[ field ] = parts
+
+    if ( (spec["bursts"][0] < 1) or (spec["nice"][0] < -20) or
+            (spec["nice"][1] > 19) ):
+        raise ValueError
+
+    return spec
+
+
+"""
+Draws from a distribution in a spec.
+:param:     rng, random.Random to draw from.
+            dist, list from parse_spec for arrival, burst or io.
+:return:    value drawn, a float.
+"""
+def draw( rng, dist ):
+    if ( dist[0] == "fixed" ):
+        return dist[1]
+
+    if ( dist[0] == "bimodal" ):
+        mean = ( dist[2] if (rng.random() < dist[3]) else dist[1] )
+        return rng.expovariate( 1 / mean ) if ( mean ) else 0.0
+
+    return rng.expovariate( 1 / dist[1] ) if ( dist[1] ) else 0.0
+
+
+"""
+Generates a workload.
+:param:     path, input file to write.
+            procs, number of processes.
+            spec, dict from parse_spec.
+            seed, seed for the workload.
+"""
+def generate( path, procs, spec, seed ):
+    rng = random.Random( seed )
+    width = len( str(procs - 1) )
+    arrival = 0.0
+    with open( path, 'w' ) as f_out:
+        f_out.write( "# {} processes, seed {}\n#\n".format(procs, seed) )
+        f_out.write( "# <proc-id>|<initial-arrival-time>|<cpu-burst-time>|" + \
+                "<num-bursts>|<io-time>|<nice>\n" )
+        for i in range( procs ):
+            arrival += draw( rng, spec["arrival"] )
+            burst = max( 1, int(round(draw(rng, spec["burst"]))) )
+            num = rng.randint( *spec["bursts"] )
+            io = ( int(round(draw(rng, spec["io"]))) if (num > 1) else 0 )
+            nice = rng.randint( *spec["nice"] )
+            f_out.write( "P{}|{}|{}|{}|{}|{}\n".format(str(i).zfill(width),
+                    int(arrival), burst, num, io, nice) )
+
+
+"""
+Output sink for a simulation; counts event lines and keeps the last.
+"""
+class EventSink:
+
+    """
+    Default constructor.
+    """
+    def __init__( self ):
+        self._lines = 0
+        self._last = ""
+
+
+    """
+    Takes output.
+    :param:     text, output written.
+    """
+    def write( self, text ):
+        if ( text.strip() ):
+            self._lines += 1
+            self._last = text
+
+
+    """
+    Flushes output; nothing is buffered.
+    """
+    def flush( self ):
+        pass
+
+
+"""
+Runs one simulation in this interpreter and prints its result line.
+:param:     path, input file.
+            algo, "FCFS", "SRT", "RR" or "CFS".
+"""
+def simulate( path, algo ):
+    sys.path.insert( 0, os.path.join(ROOT, "p1") )
+    import project1
+
+    procs = project1.read_procs( path )
+    if ( procs is None ):
+        sys.exit( "ERROR: Invalid input file format" )
+    project1.n = len( procs )
+    project1.quiet = 1
+    base = resource.getrusage( resource.RUSAGE_SELF ).ru_maxrss
+
+    run = { "FCFS" : project1.run_fcfs, "SRT" : project1.run_srt,
+            "RR" : project1.run_rr, "CFS" : project1.run_cfs }[ algo ]
+    sink, out = EventSink(), sys.stdout
+    sys.stdout = sink
+    start = time.perf_counter()
+    try:
+        res = run( procs )
+    finally:
+        sys.stdout = out
+    secs = ( time.perf_counter() - start )
+
+    # Lines but the first and last, "time <end>ms: Simulator ended ...". #
+    end = sink._last.split()[1][ :-3 ]
+    print( "RESULT", sink._lines - 2, secs, base,
+            resource.getrusage(resource.RUSAGE_SELF).ru_maxrss, end,
+            "{0:.2f} {1:.2f} {2:.2f}".format(res[0], res[1], res[2]), res[3],
+            res[4] )
+
+
+"""
+Runs one simulation in a fresh interpreter.
+:param:     path, input file.
+            algo, "FCFS", "SRT", "RR" or "CFS".
+:return:    dict of CSV fields for the simulation.
+"""
+def measure( path, algo ):
+    try:
+        done = subprocess.run( [sys.executable, os.path.abspath(__file__), "--run",
+                path, algo], stdout = subprocess.PIPE, stderr = subprocess.PIPE,
+                timeout = TIMEOUT, universal_newlines = True )
+    except subprocess.TimeoutExpired:
+        return { "status" : "timeout" }
+
+    lines = [ l for l in done.stdout.splitlines() if l.startswith("RESULT ") ]
+    if ( (done.returncode != 0) or (not lines) ):
+        err = done.stderr.strip().splitlines()
+        return { "status" : (err[-1] if err else "exit {}".format(done.returncode)) }
+
+    values = lines[0].split()[ 1: ]
+    row = dict( zip(["events", "sim_s", "base_rss_kb", "peak_rss_kb", "end_ms",
+            "avg_burst_ms", "avg_wait_ms", "avg_turnaround_ms",
+            "context_switches", "preemptions"], values) )
+    secs = float( row["sim_s"] )
+    row.update( { "status" : "ok", "sim_s" : "{0:.3f}".format(secs),
+                  "events_s" : ("{0:.0f}".format(int(row["events"]) / secs)
+                        if secs else "") } )
+    return row
+
+# ---------------------------------------------------------------------------- #
+
+if ( __name__ == "__main__" ):
+    if ( (len(sys.argv) == 4) and (sys.argv[1] == "--run") ):
+        simulate( sys.argv[2], sys.argv[3] )
+        sys.exit()
+
+    elif ( (len(sys.argv) > 1) and (sys.argv[1] == "--gen") ):
+        try:
+            if ( (len(sys.argv) < 4) or (len(sys.argv) > 6) ):
+                raise ValueError
+
+            procs = int( sys.argv[3] )
+            spec = parse_spec( sys.argv[4] if (len(sys.argv) > 4) else "" )
+            seed = int( sys.argv[5] ) if ( len(sys.argv) > 5 ) else SEED
+            if ( procs <= 0 ):
+                raise ValueError
+        except ( ValueError, KeyError ):
+            sys.exit( "ERROR: Invalid arguments\nUSAGE: ./sched.py --gen " + \
+                    "<input-file> <procs> [<spec> [<seed>]]" )
+
+        try:
+            generate( sys.argv[2], procs, spec, seed )
+        except OSError:
+            sys.exit( "ERROR: Invalid output file" )
+        sys.exit()
+
+    if ( (len(sys.argv) < 2) or (len(sys.argv) > 6) or
+            sys.argv[1].startswith("--") ):
+        sys.exit( "ERROR: Invalid arguments\nUSAGE: ./sched.py <csv-output-file> " + \
+                "[<sizes> [<algorithms> [<spec> [<seed>]]]]\n       ./sched.py " + \
+                "--gen <input-file> <procs> [<spec> [<seed>]]" )
+
+    try:
+        sizes = [ int(s) for s in \
+                (sys.argv[2] if (len(sys.argv) > 2) else SIZES).split(',') ]
+        algos = (sys.argv[3] if (len(sys.argv) > 3) else ALGORITHMS).split( ',' )
+        spec = parse_spec( sys.argv[4] if (len(sys.argv) > 4) else "" )
+        seed = int( sys.argv[5] ) if ( len(sys.argv) > 5 ) else SEED
+        if ( [ s for s in sizes if s <= 0 ] or [ a for a in algos if a not in \
+                ALGORITHMS.split(',') ] ):
+            raise ValueError
+    except ( ValueError, KeyError ):
+        sys.exit( "ERROR: Invalid arguments\nUSAGE: ./sched.py <csv-output-file> " + \
+                "[<sizes> [<algorithms> [<spec> [<seed>]]]]\n       ./sched.py " + \
+                "--gen <input-file> <procs> [<spec> [<seed>]]" )
+
+    try:
+        f_out = open( sys.argv[1], 'w', newline = '' )
+    except:
+        sys.exit( "ERROR: Invalid output file" )
+
+    writer = csv.DictWriter( f_out, fieldnames = FIELDS )
+    writer.writeheader()
+
+    work_dir = tempfile.mkdtemp( prefix = "sched-" )
+    try:
+        for size in sizes:
+            path = os.path.join( work_dir, "input-{}.txt".format(size) )
+            generate( path, size, spec, seed )
+            for algo in algos:
+                row = measure( path, algo )
+                row.update( { "procs" : size, "algorithm" : algo } )
+                writer.writerow( row )
+                f_out.flush()
+                print( "{} x{}: {} {} events/s, peak {} KB".format(algo, size,
+                        row["status"], row.get("events_s", ""),
+                        row.get("peak_rss_kb", "")) )
+            os.remove( path )
+    finally:
+        shutil.rmtree( work_dir, ignore_errors = True )
+        f_out.close()
+
+    sys.exit()
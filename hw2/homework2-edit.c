@@ -7,6 +7,9 @@
 #include <stdlib.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#ifdef BENCH_MODE
+#include "../bench/bench.h"
+#endif
 
 typedef struct {
     int _x, _y;
@@ -132,6 +135,9 @@ void step( Board * bd, Coord to ) {
  * @effects     stores best possible solution.
  */
 void tour( Board bd, int * bestSol, int from, int to ) {
+#ifdef BENCH_MODE
+    benchNode();
+#endif
     Coord moves[8];
     int poss = findPoss( bd, moves ), sol = 0;
 
@@ -316,6 +322,11 @@ int main( int argc, char * argv[] ) {
             /* Knight's tour simulation. */
             int sol = 0;
             PAR_PID = getpid();
+#ifdef BENCH_MODE
+            if ( benchInit() != 0 ) {
+                return EXIT_FAILURE;
+            }
+#endif
             printf( "PID %d: Solving the knight's tour problem for a %dx%d board\n",
                     PAR_PID, bd._cols, bd._rows );
             fflush( stdout );
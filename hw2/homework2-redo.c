@@ -16,6 +16,9 @@
 #include <stdlib.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#ifdef BENCH_MODE
+#include "../bench/bench.h"
+#endif
 
 #define VISITED 'k'
 #define UNVISITED '.'
@@ -30,6 +33,7 @@ typedef struct {
     char ** _grid;
 } Board;
 
+
 #define COORD_SIZE sizeof( Coord )
 #define BOARD_SIZE sizeof( Board )
 
@@ -138,6 +142,10 @@ Board step( Board bd, Coord to ) {
  *              maxTourPtr, pointer to value of longest tour.
  */
 void tour( Board bd, int * maxTourPtr, int r, int w ) {
+#ifdef BENCH_MODE
+    benchNode();
+#endif
+
     /* Find possible moves. */
     Coord moves[8];
     int poss = findPoss( bd, moves );
@@ -282,6 +290,12 @@ int main ( int argc, char * argv[] ) {
                     "board\n", getpid(), tourBd._rows, tourBd._cols );
             fflush( stdout );
 
+#ifdef BENCH_MODE
+            if ( benchInit() != 0 ) {
+                return EXIT_FAILURE;
+            }
+#endif
+
             /* Tour. */
             tour( tourBd, &maxTour, 0, 0 );
             if ( maxTour != EXIT_FAILURE ) {
@@ -8,6 +8,9 @@
 #include <stdlib.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#ifdef BENCH_MODE
+#include "../bench/bench.h"
+#endif
 
 typedef struct {
     int _x, _y;
@@ -99,6 +102,9 @@ void step( Board * bd, Coord to ) {
 
 
 void tour( Board bd, int * bestSol, int from, int to ) {
+#ifdef BENCH_MODE
+    benchNode();
+#endif
     Coord moves[8];
     int poss = findPoss( bd, moves ), sol = 0;
 
@@ -235,6 +241,11 @@ int main( int argc, char * argv[] ) {
         int m = strtol( argv[1], &tmp, 10 ), n = strtol( argv[2], &tmp, 10 );
         if ( ( m > 2 ) && ( n > 2 ) ) {
             PAR_PID = getpid();
+#ifdef BENCH_MODE
+            if ( benchInit() != 0 ) {
+                return EXIT_FAILURE;
+            }
+#endif
 
             /* Board initialization. */
             /** Static assignments. */
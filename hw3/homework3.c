@@ -4,11 +4,22 @@
  * This program simulates a solution to the knight's tour problem using 
  * multithreading via the 'pthread' library. The program is called using
  *
- *   bash$ a.out <m> <n> [<k>]
+ *   bash$ a.out <m> <n> [<k>] [--deadline <ms>] [--target <squares>]
+ *               [--warnsdorff [--backtrack <b>] [--restarts <r>]]
  *
  * where <m> is the width, number of columns, of the board; <n> is the height,
  * number of rows, of the board; and the optional <k> is the fewest number of
- * squares allowed on dead end boards printed out.
+ * squares allowed on dead end boards printed out. The search stops early once
+ * --deadline milliseconds have passed or a dead end visiting at least --target
+ * squares is found (pass m * n to stop at the first full tour); the results
+ * printed are then those found so far and are marked as partial.
+ *
+ * Exhaustive search is hopeless past small boards, so --warnsdorff instead
+ * runs one worker per core, each following Warnsdorff's rule (fewest onward
+ * moves first) from randomized tie-breaks. A worker may undo up to <b> moves
+ * per attempt before restarting, and makes up to <r> attempts; the first full
+ * tour found stops all workers. The longest tour found is printed as a board;
+ * it is marked as partial only if no full tour was found before a stop.
  */
 
 #include <limits.h>
@@ -17,10 +28,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#ifdef BENCH_MODE
+#include "../bench/bench.h"
+#endif
 
 #define VISITED 'k'
 #define UNVISITED '.'
+#define USAGE "USAGE: a.out <m> <n> [<k>] [--deadline <ms>] [--target <squares>]" \
+              " [--warnsdorff [--backtrack <b>] [--restarts <r>]]\n"
 
 typedef struct {
     int _x, _y;
@@ -51,13 +68,31 @@ int maxTour = 0, ended = 0;
 
 pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/* Early stopping; 'cancelled' is checked by every thread at each node, so it
+ * is only touched atomically. 'finished' is guarded by mutex. */
+int cancelled = 0, finished = 0;
+const char * cancelReason = NULL;
+int target = -1;
+long deadline = -1;
+
+pthread_cond_t timerCond = PTHREAD_COND_INITIALIZER;
+
+/* Warnsdorff search; squares are numbered ( row * cols + col ). */
+int heurRows = 0, heurCols = 0, backtrack = 0, restarts = 16, bestLen = 0;
+int * bestPath;
+
 /* -------------------------------------------------------------------------- */
 
 int findPoss( Board bd, Coord moves[] );
 void freeBoard( Board * bdPtr );
+void cancel( const char * reason );
 void printBoard( Board bd, bool debug );
 Board step( Board bd, Coord to );
+void * timer( void * ptr );
 void * tour( void * ptr );
+int onward( const char * seen, int sq, int out[] );
+int orderMoves( const char * seen, int sq, int out[], unsigned int * seed );
+void * warnsdorff( void * ptr );
 
 /* -------------------------------------------------------------------------- */
 
@@ -100,6 +135,18 @@ void freeBoard( Board * bdPtr ) {
 }
 
 
+/* Cancellation helper; the first reason given is the one reported.
+ * @param       reason, description of why the search stopped.
+ * @modifies    cancelled, cancelReason
+ * @effects     signals all threads to stop at their next node.
+ */
+void cancel( const char * reason ) {
+    if ( __sync_bool_compare_and_swap( &cancelReason, NULL, reason ) ) {
+        __atomic_store_n( &cancelled, 1, __ATOMIC_RELEASE );
+    }
+}
+
+
 /* Board printing helper.
  * @param       bd, Board to print.
  *              debug, whether to include tid or not.
@@ -127,12 +174,48 @@ Board step( Board bd, Coord to ) {
 }
 
 
-/* Touring simulation.
+/* Deadline watchdog; sleeps until the deadline or until the search finishes.
+ * @param       ptr, unused.
+ */
+void * timer( void * ptr ) {
+    (void)ptr;
+    struct timespec until;
+    clock_gettime( CLOCK_REALTIME, &until );
+    until.tv_sec += ( deadline / 1000 );
+    until.tv_nsec += ( (deadline % 1000) * 1000000 );
+    if ( until.tv_nsec >= 1000000000 ) {
+        ++until.tv_sec;                         until.tv_nsec -= 1000000000;
+    }
+
+    int rc = 0, done;
+    pthread_mutex_lock( &mutex );
+        while ( !finished && (rc == 0) ) {
+            rc = pthread_cond_timedwait( &timerCond, &mutex, &until );
+        }
+        done = finished;
+    pthread_mutex_unlock( &mutex );
+
+    if ( !done ) { cancel( "deadline reached" ); }
+    return NULL;
+}
+
+
+/* Touring simulation. Each call owns its Board's grid: a single move passes it
+ * on, a dead end keeps it in endBds, and otherwise it is freed here.
  * @param       ptr, pointer to Board to tour.
  */
 void * tour( void * ptr ) {
     Board bd = *(Board*)ptr;
     free( ptr );                                ptr = NULL;
+#ifdef BENCH_MODE
+    benchNode();
+#endif
+
+    /* Stop at node boundary once cancelled. */
+    if ( __atomic_load_n( &cancelled, __ATOMIC_ACQUIRE ) ) {
+        freeBoard( &bd );
+        return NULL;
+    }
 
     /* Find possible moves. */
     Coord moves[8];
@@ -146,10 +229,11 @@ void * tour( void * ptr ) {
             fflush( stdout );
 
             pthread_t tids[poss];
-            int i = 0, rc = 0;
+            int i = 0, rc = 0, created = 0;
 
             /* Create child threads. */
-            for ( i = 0; i < poss; ++i ) {
+            for ( i = 0; (i < poss) && !__atomic_load_n( &cancelled,
+                    __ATOMIC_ACQUIRE ); ++i ) {
                 Board * bdPtr = malloc( BOARD_SIZE );
                 (*bdPtr) = (Board){ ._cols = bd._cols, ._rows = bd._rows, 
                                     ._moves = bd._moves, ._k = bd._k, 
@@ -160,14 +244,17 @@ void * tour( void * ptr ) {
                 }
 
                 *bdPtr = step( *bdPtr, moves[i] );
-                rc = pthread_create( &tids[i], NULL, tour, bdPtr );
+                rc = pthread_create( &tids[created], NULL, tour, bdPtr );
                 if ( rc != 0 ) {
                     fprintf( stderr, "ERROR: Could not create thread (%d)\n", rc );
+                } else {
+                    /* rc == 0 :: thread running */
+                    ++created;
                 }
             }
 
             /* Wait for child threads to complete. */
-            for ( i = 0; i < poss; ++i ) {
+            for ( i = 0; i < created; ++i ) {
                 unsigned int * u_intPtr;
                 rc = pthread_join( tids[i], (void **)&u_intPtr );
 
@@ -176,6 +263,9 @@ void * tour( void * ptr ) {
                 }
                 free( u_intPtr );               u_intPtr = NULL;
             }
+
+            /* Children toured copies; this grid is done with. */
+            freeBoard( &bd );
         } else {
             /* poss == 1 :: don't create new thread */
             Board * bdPtr = malloc( BOARD_SIZE );
@@ -198,6 +288,10 @@ void * tour( void * ptr ) {
             maxTour = ( (bd._moves > maxTour) ? bd._moves : maxTour );
         pthread_mutex_unlock( &mutex );
 
+        if ( (target > 0) && (bd._moves >= target) ) {
+            cancel( "target reached" );
+        }
+
         /* Exit thread. */
         unsigned int * u_intPtr = malloc( sizeof(unsigned int) );
         *u_intPtr = (unsigned int)pthread_self();
@@ -207,24 +301,178 @@ void * tour( void * ptr ) {
     return NULL;
 }
 
+/* Helper to find unvisited squares one knight's move away.
+ * @param       seen, visited flags for every square.
+ *              sq, square from which to move.
+ *              out, array in which to store squares found (may be NULL).
+ * @return      count of unvisited squares found.
+ */
+int onward( const char * seen, int sq, int out[] ) {
+    const int y = ( sq / heurCols ), x = ( sq % heurCols );
+    int poss = 0;
+    for ( int i = 0; i < 8; ++i ) {
+        const int toX = ( x + all[i]._x ), toY = ( y + all[i]._y );
+        if ( ( (0 <= toX) && (toX < heurCols) ) &&
+                ( (0 <= toY) && (toY < heurRows) ) &&
+                !seen[ (toY * heurCols) + toX ] ) {
+            if ( out ) { out[poss] = ( (toY * heurCols) + toX ); }
+            ++poss;
+        }
+    }
+    return poss;
+}
+
+
+/* Helper to order moves by Warnsdorff's rule. Ties on onward degree are broken
+ * by the total degree of the squares beyond, then at random.
+ * @param       seen, visited flags for every square.
+ *              sq, square from which to move.
+ *              out, array in which to store ordered moves.
+ *              seed, state for rand_r().
+ * @return      count of moves stored.
+ */
+int orderMoves( const char * seen, int sq, int out[], unsigned int * seed ) {
+    int poss = onward( seen, sq, out ), key[8], beyond[8];
+    for ( int i = 0; i < poss; ++i ) {
+        const int deg = onward( seen, out[i], beyond );
+        int sum = 0;
+        for ( int j = 0; j < deg; ++j ) { sum += onward( seen, beyond[j], NULL ); }
+        key[i] = ( (deg << 16) | (sum << 6) | (rand_r( seed ) & 0x3f) );
+    }
+
+    /* Insertion sort; there are never more than eight moves. */
+    for ( int i = 1; i < poss; ++i ) {
+        const int k = key[i], to = out[i];
+        int j = i - 1;
+        for ( ; (j >= 0) && (key[j] > k); --j ) {
+            key[j + 1] = key[j];                out[j + 1] = out[j];
+        }
+        key[j + 1] = k;                         out[j + 1] = to;
+    }
+    return poss;
+}
+
+
+/* Warnsdorff worker; searches from the corner until a full tour is found, its
+ * attempts run out, or the search is cancelled.
+ * @param       ptr, pointer to the worker's rand_r() seed.
+ */
+void * warnsdorff( void * ptr ) {
+    unsigned int seed = *(unsigned int*)ptr;
+    const int squares = ( heurRows * heurCols );
+
+    char * seen = calloc( squares, sizeof(char) );
+    int * path = calloc( squares, sizeof(int) ), * local = calloc( squares,
+            sizeof(int) ), ( * cand )[8] = calloc( squares, sizeof(int[8]) );
+    int * nCand = calloc( squares, sizeof(int) ), * next = calloc( squares,
+            sizeof(int) );
+    if ( !seen || !path || !local || !cand || !nCand || !next ) {
+        fprintf( stderr, "ERROR: Could not allocate memory for search\n" );
+        cancel( "out of memory" );
+    }
+
+    for ( int attempt = 0; (attempt < restarts) && !__atomic_load_n(
+            &cancelled, __ATOMIC_ACQUIRE ); ++attempt ) {
+        memset( seen, 0, squares );
+        int depth = 0, undone = 0, localLen = 1;
+        path[0] = 0;                            seen[0] = 1;
+        nCand[0] = orderMoves( seen, 0, cand[0], &seed );
+        next[0] = 0;
+        local[0] = 0;
+
+        while ( ((depth + 1) < squares) && !__atomic_load_n( &cancelled,
+                __ATOMIC_ACQUIRE ) ) {
+            if ( next[depth] < nCand[depth] ) {
+                /* Take the next best move. */
+                const int to = cand[depth][ next[depth]++ ];
+                path[ ++depth ] = to;           seen[to] = 1;
+                nCand[depth] = orderMoves( seen, to, cand[depth], &seed );
+                next[depth] = 0;
+            } else {
+                /* next[depth] >= nCand[depth] :: dead end, keep longest */
+                if ( (depth + 1) > localLen ) {
+                    localLen = ( depth + 1 );
+                    memcpy( local, path, (localLen * sizeof(int)) );
+                }
+
+                if ( (depth == 0) || (undone >= backtrack) ) { break; }
+                seen[ path[depth--] ] = 0;
+                ++undone;
+            }
+        }
+
+        if ( (depth + 1) > localLen ) {
+            localLen = ( depth + 1 );
+            memcpy( local, path, (localLen * sizeof(int)) );
+        }
+
+        pthread_mutex_lock( &mutex );
+            if ( localLen > bestLen ) {
+                bestLen = localLen;
+                memcpy( bestPath, local, (localLen * sizeof(int)) );
+            }
+        pthread_mutex_unlock( &mutex );
+
+        if ( localLen >= squares ) {
+            cancel( "full tour found" );
+        } else if ( (target > 0) && (localLen >= target) ) {
+            cancel( "target reached" );
+        }
+    }
+
+    free( seen );                               seen = NULL;
+    free( path );                               path = NULL;
+    free( local );                              local = NULL;
+    free( cand );                               cand = NULL;
+    free( nCand );                              nCand = NULL;
+    free( next );                               next = NULL;
+    return NULL;
+}
+
 /* -------------------------------------------------------------------------- */
 
 int main( int argc, char * argv[] ) {
-    if ( (argc == 3) || (argc == 4) ) {
+    /* Separate options from positional arguments. */
+    char * pos[3], * tmp;
+    int npos = 0;
+    bool heuristic = false;
+    for ( int i = 1; i < argc; ++i ) {
+        if ( (strcmp( argv[i], "--deadline" ) == 0) && ((i + 1) < argc) ) {
+            deadline = strtol( argv[++i], &tmp, 10 );
+            if ( (*tmp != '\0') || (deadline < 0) ) { npos = -1; break; }
+        } else if ( (strcmp( argv[i], "--target" ) == 0) && ((i + 1) < argc) ) {
+            target = strtol( argv[++i], &tmp, 10 );
+            if ( (*tmp != '\0') || (target <= 0) ) { npos = -1; break; }
+        } else if ( strcmp( argv[i], "--warnsdorff" ) == 0 ) {
+            heuristic = true;
+        } else if ( (strcmp( argv[i], "--backtrack" ) == 0) && ((i + 1) < argc) ) {
+            backtrack = strtol( argv[++i], &tmp, 10 );
+            if ( (*tmp != '\0') || (backtrack < 0) ) { npos = -1; break; }
+        } else if ( (strcmp( argv[i], "--restarts" ) == 0) && ((i + 1) < argc) ) {
+            restarts = strtol( argv[++i], &tmp, 10 );
+            if ( (*tmp != '\0') || (restarts <= 0) ) { npos = -1; break; }
+        } else if ( npos < 3 ) {
+            pos[ npos++ ] = argv[i];
+        } else {
+            /* npos >= 3 :: too many positional arguments */
+            npos = -1;                          break;
+        }
+    }
+
+    if ( (npos == 2) || (npos == 3) ) {
         /* Check that 'm' and 'n' are greater than two. */
-        char * tmp;
-        const int m = strtol( argv[1], &tmp, 10 ), n = strtol( argv[2], &tmp, 10 );
+        const int m = strtol( pos[0], &tmp, 10 ), n = strtol( pos[1], &tmp, 10 );
         int k = -1;
-        if ( argc == 4 ) {
-            k = strtol( argv[3], &tmp, 10 );
+        if ( npos == 3 ) {
+            k = strtol( pos[2], &tmp, 10 );
             if ( (k <= 0) || ( k > (m * n) ) ) {
                 fprintf( stderr, "ERROR: Invalid argument(s)\n" );
-                fprintf( stderr, "USAGE: a.out <m> <n> [<k>]\n" );
+                fprintf( stderr, USAGE );
                 return EXIT_FAILURE;
             }
         }
 
-        if ( (m > 2) && (n > 2) ) {
+        if ( (m > 2) && (n > 2) && (target <= (m * n)) ) {
             /* Board initialization. */
             /** Static assignments. **/
             Board tourBd = (Board){ ._cols = n, ._rows = m, ._moves = 1, ._k = k,
@@ -269,22 +517,114 @@ int main( int argc, char * argv[] ) {
 #endif
 
             maxTour = 1;
+#ifdef BENCH_MODE
+            if ( benchInit() != 0 ) {
+                return EXIT_FAILURE;
+            }
+#endif
             printf( "THREAD %u: Solving the knight's tour problem for a %dx%d "
                     "board\n", (unsigned int)pthread_self(), tourBd._rows,
                     tourBd._cols );
             fflush( stdout );
 
-            /* Tour. */
-            Board * bdPtr = malloc( BOARD_SIZE );
-            *bdPtr = tourBd;
-            tour( bdPtr );
+            pthread_t timerTid;
+            if ( deadline >= 0 ) {
+                int rc = pthread_create( &timerTid, NULL, timer, NULL );
+                if ( rc != 0 ) {
+                    fprintf( stderr, "ERROR: Could not create thread (%d)\n", rc );
+                    deadline = -1;
+                }
+            }
+
+            if ( heuristic ) {
+                /* Warnsdorff search, one worker per core. */
+                const long cores = sysconf( _SC_NPROCESSORS_ONLN );
+                const int workers = ( (cores > 0) ? (int)cores : 1 );
+                pthread_t tids[workers];
+                unsigned int seeds[workers];
+                int started = 0;
+
+                heurRows = tourBd._rows;        heurCols = tourBd._cols;
+                bestPath = calloc( (heurRows * heurCols), sizeof(int) );
+                if ( !bestPath ) {
+                    fprintf( stderr, "ERROR: Could not allocate memory for "
+                            "search\n" );
+                    return EXIT_FAILURE;
+                }
+
+                printf( "THREAD %u: Searching by Warnsdorff's rule with %d "
+                        "thread%s\n", (unsigned int)pthread_self(), workers,
+                        ( (workers != 1) ? "s" : "" ) );
+                fflush( stdout );
+
+                for ( int i = 0; i < workers; ++i ) {
+                    seeds[i] = (unsigned int)( i + 1 );
+                    int rc = pthread_create( &tids[started], NULL, warnsdorff,
+                            &seeds[i] );
+                    if ( rc != 0 ) {
+                        fprintf( stderr, "ERROR: Could not create thread (%d)\n",
+                                rc );
+                    } else {
+                        /* rc == 0 :: thread running */
+                        ++started;
+                    }
+                }
+
+                for ( int i = 0; i < started; ++i ) {
+                    int rc = pthread_join( tids[i], NULL );
+                    if ( rc != 0 ) {
+                        fprintf( stderr, "ERROR: Could not join thread (%d)\n", rc );
+                    }
+                }
+
+                for ( int i = 0; i < bestLen; ++i ) {
+                    tourBd._grid[ bestPath[i] / heurCols ][ bestPath[i] % heurCols ]
+                            = VISITED;
+                }
+                maxTour = ( (bestLen > maxTour) ? bestLen : maxTour );
+                free( bestPath );               bestPath = NULL;
+            } else {
+                /* !heuristic :: exhaustive tour of a copy, which tour() owns */
+                Board * bdPtr = malloc( BOARD_SIZE );
+                *bdPtr = tourBd;
+                (*bdPtr)._grid = calloc( tourBd._rows, sizeof( char* ) );
+                for ( int j = 0; j < tourBd._rows; ++j ) {
+                    (*bdPtr)._grid[j] = strdup( tourBd._grid[j] );
+                }
+                tour( bdPtr );
+            }
+
+            /* Stop the deadline watchdog. */
+            if ( deadline >= 0 ) {
+                pthread_mutex_lock( &mutex );
+                    finished = 1;
+                    pthread_cond_signal( &timerCond );
+                pthread_mutex_unlock( &mutex );
+                pthread_join( timerTid, NULL );
+            }
 
-            printf( "THREAD %u: Best solution found visits %d square%s (out "
-                    "of %d)\n", (unsigned int)pthread_self(), maxTour,
-                    ( (maxTour != 1) ? "s" : "" ), (tourBd._rows * tourBd._cols) );
+            /* An exhaustive search cut short is partial even if it found a full
+             * tour, since its dead end list is incomplete; a Warnsdorff search
+             * that found one has nothing left to report. */
+            if ( __atomic_load_n( &cancelled, __ATOMIC_ACQUIRE ) && !(
+                    heuristic && (maxTour == (tourBd._rows * tourBd._cols)) ) ) {
+                printf( "THREAD %u: Search stopped early (%s); results are "
+                        "partial\n", (unsigned int)pthread_self(), cancelReason );
+                printf( "THREAD %u: Best solution found so far visits %d "
+                        "square%s (out of %d)\n", (unsigned int)pthread_self(),
+                        maxTour, ( (maxTour != 1) ? "s" : "" ),
+                        (tourBd._rows * tourBd._cols) );
+            } else {
+                /* !cancelled :: search was exhaustive */
+                printf( "THREAD %u: Best solution found visits %d square%s (out "
+                        "of %d)\n", (unsigned int)pthread_self(), maxTour,
+                        ( (maxTour != 1) ? "s" : "" ), (tourBd._rows * tourBd._cols) );
+            }
             fflush( stdout );
 
-            if ( argc == 4 ) {
+            if ( heuristic ) {
+                printBoard( tourBd, 0 );
+            } else if ( npos == 3 ) {
                 for ( int i = 0; i < ended; ++i ) {
                     if ( endBds[i]._moves >= k ) {
                         printBoard( endBds[i], 0 );
@@ -292,7 +632,7 @@ int main( int argc, char * argv[] ) {
                     }
                 }
             } else {
-                /* argc != 4 :: print all dead end boards */
+                /* npos != 3 :: print all dead end boards */
                 for ( int i = 0; i < ended; ++i ) {
                     printBoard( endBds[i], 0 );
                     freeBoard( &endBds[i] );
@@ -304,14 +644,14 @@ int main( int argc, char * argv[] ) {
 
             return EXIT_SUCCESS;
         } else {
-            /* (m <= 2) || (n <= 2) :: invalid arguments */
+            /* (m <= 2) || (n <= 2) || (target > m * n) :: invalid arguments */
             fprintf( stderr, "ERROR: Invalid argument(s)\n" );
-            fprintf( stderr, "USAGE: a.out <m> <n> [<k>]\n" );
+            fprintf( stderr, USAGE );
         }
     } else {
-        /* (argc != 3) && (argc != 4) :: incorrect number of arguments */
+        /* (npos != 2) && (npos != 3) :: incorrect number of arguments */
         fprintf( stderr, "ERROR: Invalid argument(s)\n" );
-        fprintf( stderr, "USAGE: a.out <m> <n> [<k>]\n" );
+        fprintf( stderr, USAGE );
     }
 
     return EXIT_FAILURE;
@@ -1,185 +1,4311 @@
 /* homework4.c
  * Griffin Melnick, melnig@rpi.edu
+ *
+ * Chat server for TCP and UDP clients. The program is called using
+ *
+ *   bash$ a.out <tcp-port> <udp-port> [<reactors>] [--slow <policy>]
+ *               [--capture <trace-file>] [--io <backend>]
+ *               [--timeouts <idle>,<udp>,<share>] [--stats <dump-file>]
+ *               [--store <directory>]
+ *
+ * where <tcp-port> is the port on which to accept TCP connections and
+ * <udp-port> is the port on which to receive UDP datagrams; the two may be the
+ * same. The optional <reactors> is the number of reactor threads, one per
+ * online core by default. The optional <policy> is what to do with a TCP
+ * client whose output queue reaches OUT_MAX bytes: "drop" further messages,
+ * "disconnect" it, or "spill" them to a file of up to SPILL_MAX bytes (the
+ * default), disconnecting it past that. With --capture, every byte each
+ * client sends or is sent is logged to <trace-file>, for replay.c. The
+ * optional <backend> is "epoll" (the default) or "uring". The optional
+ * --timeouts are, in seconds, how long a TCP client may send nothing, how
+ * long a UDP login lasts without a request, and how long a SHARE may stall
+ * before the client is dropped; 0 turns one off, and each has a TIMEOUT_
+ * default. With --stats, what STATS reports, and full latency histograms,
+ * are written to <dump-file> every METRICS_SECS seconds. With --store, a SEND
+ * to a valid userid that is not logged in is kept in <directory> and
+ * delivered at that user's next LOGIN, across restarts.
+ *
+ * Each reactor is a shard: it owns SO_REUSEPORT TCP and UDP sockets bound to
+ * the shared ports, so the kernel spreads connections and datagrams across
+ * shards, and one edge-triggered epoll set holding those sockets, every TCP
+ * client it accepted, and an eventfd. All sockets are non-blocking. The user
+ * directory is shared by all shards under a read-write lock; users are found
+ * through hash indexes by userid and by sender, and a sorted view is kept up
+ * to date for WHO. A message for a TCP client owned by another shard is
+ * pushed onto that shard's MPSC inbox and the eventfd is written to wake it,
+ * so a socket is only ever written by the thread that owns it. Output a TCP
+ * client cannot take yet waits in its queue for EPOLLOUT; queued messages
+ * share refcounted payloads, so a BROADCAST holds one copy of its body. A
+ * SHARE is spliced from the sender's socket into an unlinked spool file and
+ * sent on with sendfile() as it arrives, so it never passes through user
+ * space or sits in memory. A client whose output queue passes OUT_HIGH is
+ * not read from again until the queue falls to OUT_LOW.
+ *
+ * Message headers, payloads of up to PAYLOAD_SIZE bytes and TCP read buffers
+ * come from fixed-size slab pools. Each thread keeps a cache per pool and
+ * trades POOL_BATCH objects at a time with the pool's global free list, so
+ * steady-state traffic never calls malloc(). Sending SIGUSR1 to the server
+ * logs how full each pool is.
+ *
+ * With --io uring, each reactor waits on an io_uring instead of epoll. Every
+ * client is read by one multishot recv that picks buffers from a ring of
+ * RING_BUFS provided buffers, the listener by one multishot accept, and the
+ * UDP socket and eventfd by multishot polls, all through registered files.
+ * Output queued for any client during a wakeup goes out as IORING_OP_SENDMSG
+ * requests submitted together with the next wait, so one io_uring_enter()
+ * carries every send and reap of the loop. A kernel without the operations
+ * needed leaves the server on epoll.
+ *
+ * Timeouts run on a hashed timing wheel per shard, WHEEL_SLOTS lists of
+ * timers driven by one timerfd ticking every TICK_MS, so arming or cancelling
+ * a timer is a list splice. Traffic only stamps the time it was seen; a timer
+ * that expires early re-arms itself from that stamp, so a busy client never
+ * touches the wheel. A UDP login's timer belongs to the shard that took the
+ * LOGIN and dies quietly if the user has since left.
+ *
+ * Each shard counts commands, errors, bytes and queued output in a Metrics
+ * block of its own, cache-line aligned and written only by its thread, and
+ * times every command handler into a histogram of log-spaced buckets. The
+ * blocks are summed only when STATS or the dump reads them, so counting
+ * takes no locks or atomic read-modify-writes.
+ *
+ * The offline store is an append-only log of segment files, each reserved
+ * at STORE_SEG bytes and mapped whole. A SEND appends its record with a
+ * memcpy(), and its OK is parked: a store thread makes everything appended
+ * durable every STORE_SYNC_MS, so many messages share one flush, and only
+ * then wakes the shards to send the OKs it covers. A TCP client's OK waits
+ * in its output queue, so nothing sent to it later can pass. Each
+ * recipient's undelivered messages are listed in a mailbox, so LOGIN
+ * delivers them in one pass and logs that it did. At startup every segment
+ * is mapped and scanned to rebuild the mailboxes. Once the oldest segment
+ * holds no undelivered messages it is deleted, and one holding only a few
+ * has them copied forward first.
  */
 
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/io_uring.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 /* Macro defintions. */
 #define BUFFER_MAX 994
+#define CONN_MAX 1048576                        /* cap on descriptors in use */
+#define EVENTS_MAX 256
+#define FLUSH_MAX 64                            /* messages per sendmsg() */
+#define HEAD_MAX ( ID_MAX + 24 )
+#define HIST_BUCKETS 128                        /* two per power of 2 */
+#define IN_MAX ( 2 * BUFFER_MAX )               /* TCP read buffer */
 #define ID_MIN 3
 #define ID_MAX 20
+#define METRICS_SECS 10                         /* --stats dump interval */
+#define MSG_MAX 990
+#define OUT_HIGH ( 256 * 1024 )                 /* stop reading the client */
+#define OUT_LOW ( 64 * 1024 )                   /* read it again */
+#define OUT_MAX ( 1024 * 1024 )                 /* apply slowPolicy */
+#define PAYLOAD_SIZE 1024                       /* largest pooled Payload */
+#define POOL_BATCH 32                           /* objects per refill */
+#define POOL_CONN 0                             /* TCP read buffers */
+#define POOL_COUNT 4
+#define POOL_MSG 1                              /* Msg, spooled Payload */
+#define POOL_PAYLOAD 2                          /* Payload with its body */
+#define POOL_SEND 3                             /* sendmsg() through io_uring */
+#define POOL_SLAB 64                            /* objects per slab */
+#define RING_BUFS 1024                          /* provided recv buffers */
+#define RING_BUF_SIZE 4096
+#define RING_SQ 4096                            /* submission queue entries */
+#define SHARE_CHUNK 65536                       /* bytes per splice() */
+#define SLOW_DROP 0
+#define SLOW_DISCONNECT 1
+#define SLOW_SPILL 2
+#define SPILL_MAX ( 64 * 1024 * 1024 )
+#define STORE_BOX_MAX 4096                      /* messages held per userid */
+#define STORE_BOXES_MAX 65536                   /* userids with messages held */
+#define STORE_MAGIC "H4STORE1"
+#define STORE_SEG ( 4 * 1024 * 1024 )           /* bytes per log segment */
+#define STORE_SYNC_MS 10                        /* group commit interval */
 #define TCP "tcp"
+#define TICK_MS 100                             /* timing wheel resolution */
+#define TIMEOUT_IDLE 300                        /* seconds, see --timeouts */
+#define TIMEOUT_SHARE 30
+#define TIMEOUT_UDP 120
+#define TRACE_BUF 65536                         /* per-shard capture buffer */
+#define TRACE_MAGIC "H4TRACE1"
 #define UDP "udp"
+#define UDP_BATCH 64                            /* datagrams per syscall */
+#define UDP_SLOT ( BUFFER_MAX + HEAD_MAX )
 #define USER_INC 32
+#define WHEEL_SLOTS 1024                        /* power of 2 */
 
 typedef struct {
-    char * _id, _connection;
+    char * _id;
+    const char * _connection;                   /* TCP or UDP */
+    int _sd;                                    /* client socket, or UDP socket */
+    int _shard;                                 /* shard owning a TCP client */
+    unsigned long _conn;                        /* connection number for TCP,
+                                                   login number for UDP */
+    unsigned long _key;                         /* sender key, see senderKey() */
+    unsigned long _seen;                        /* tick of its last request */
+    struct sockaddr_in _addr;                   /* client address for UDP */
 } User;
 
 #define USER_SIZE sizeof( User )
 
-unsigned int numUsers = 0;
-User * users;
-int tcpSd = -1, udpSd = -1, tcpServerLen = -1, udpServerLen = -1;
-struct sockaddr_in tcpServer, udpServer;
+/* Open-addressing hash index into users, with linear probing. Entries are
+ * slot + 1 so that zero marks an empty bucket; the load is kept under half. */
+typedef struct {
+    int * _buckets;
+    unsigned int _cap, _count;
+} Index;
+
+/* Unlinked temporary file holding a SHARE in transit. */
+typedef struct {
+    int _refs, _fd;
+} Spool;
+
+/* Message body shared by every recipient, freed with its last reference.
+ * The body is either _data or, for a SHARE, _len bytes of a spool at _off. */
+typedef struct {
+    int _refs, _len;
+    Spool * _spool;
+    off_t _off;
+    char _data[];
+} Payload;
+
+/* Message bound for one TCP client: a small header of its own, such as
+ * "FROM <id> <len> ", followed by an optional shared payload. */
+typedef struct Msg {
+    struct Msg * _next;
+    unsigned long _conn;                        /* recipient connection */
+    int _sd, _headLen, _off;                    /* _off bytes already sent */
+    int _cost;                                  /* bytes charged to _outBytes */
+    uint64_t _commit;                           /* store _seq to await, or 0 */
+    Payload * _payload;
+    char _head[ HEAD_MAX ];
+} Msg;
+
+/* OK for a stored SEND, parked on its shard until the record is durable. */
+typedef struct {
+    uint64_t _seq;                              /* StoreRec _seq */
+    int _sd;                                    /* TCP client, or UDP socket */
+    int _udp;                                   /* nonzero if _addr is set */
+    unsigned long _conn;                        /* TCP client's Conn _id */
+    struct sockaddr_in _addr;                   /* UDP client address */
+} Ack;
+
+/* SHARE being received from a TCP client. */
+typedef struct {
+    User _to;                                   /* copy of recipient, no _id */
+    Spool * _spool;
+    int _pipe[2];
+    long _left;                                 /* bytes still to receive */
+    off_t _len;                                 /* bytes spooled so far */
+    int _headLen;                               /* 0 once the header is sent */
+    char _head[ HEAD_MAX ];
+} Share;
+
+/* Command line parsed by handle(), kept while its body is still arriving. */
+typedef struct {
+    const struct Command * _cmd;                /* NULL between commands */
+    char _id[ ID_MAX + 2 ];
+    long _len;                                  /* msglen or filelen */
+} Frame;
+
+/* Incremental parser state; one per TCP client, or per UDP datagram. */
+typedef struct {
+    char * _buf;                                /* IN_MAX bytes, for TCP */
+    int _len;                                   /* bytes held in _buf */
+    int _scan;                                  /* bytes known to have no '\n' */
+    long _skip;                                 /* body bytes to discard */
+    int _drop;                                  /* discard through next '\n' */
+    Frame _frame;
+} Parser;
+
+/* sendmsg() handed to io_uring. It holds the first _count messages of the
+ * client's queue until it completes; if the client leaves first, they are
+ * moved to _msgs and _conn is zeroed. */
+typedef struct {
+    unsigned long _conn;                        /* sending connection, or 0 */
+    int _sd, _count;
+    Msg * _msgs;                                /* orphaned messages */
+    struct msghdr _hdr;
+    struct iovec _iov[ 2 * FLUSH_MAX ];
+} Send;
+
+/* Timer on a shard's wheel, listed in slot _due % WHEEL_SLOTS; _next is
+ * NULL while it is not armed. A TCP client's is part of its Conn; a UDP
+ * login's is allocated for it and freed when it fires for the last time. */
+typedef struct Timer {
+    struct Timer * _next, * _prev;
+    unsigned long _due;                         /* tick at which it fires */
+    int _sd;                                    /* TCP client, or a TIMER_ */
+    unsigned long _key, _login;                 /* UDP user's _key and _conn */
+} Timer;
+
+#define TIMER_UDP -1                            /* UDP login */
+#define TIMER_METRICS -2                        /* --stats dump */
+
+/* Accepted TCP connection, indexed by descriptor in conns. */
+typedef struct {
+    unsigned long _id;                          /* unique per accept, 0 if free */
+    int _sd, _shard;
+    Timer _timer;                               /* idle or SHARE timeout */
+    unsigned long _seen;                        /* tick of its last input */
+    Msg * _outHead, * _outTail;                 /* output queue */
+    Send * _send;                               /* io_uring send, or NULL */
+    int _armed;                                 /* io_uring recv: 1 on, 2 ending */
+    int _held, _heldTail, _heldOff;             /* io_uring buffers not parsed */
+    int _pollOut;                               /* io_uring POLLOUT outstanding */
+    int _dirty, _nextDirty;                     /* on the shard's dirty list */
+    long _outBytes;                             /* queued bytes in memory */
+    Spool * _spill;                             /* overflow under SLOW_SPILL */
+    off_t _spillLen;                            /* end of _spill */
+    long _spillBytes;                           /* queued bytes in _spill */
+    int _paused;                                /* not reading, queue too long */
+    int _over;                                  /* 1 past OUT_MAX, 2 cut off */
+    Share * _share;                             /* SHARE in progress, or NULL */
+    Parser _in;
+} Conn;
+
+/* Intrusive multi-producer, single-consumer queue (Vyukov). Producers swap
+ * themselves in at _head; the owning shard alone pops from _tail. */
+typedef struct {
+    Msg * _head;
+    Msg * _tail;
+    Msg _stub;
+} Inbox;
+
+/* Ring of preallocated datagram slots for recvmmsg() and sendmmsg(). */
+typedef struct {
+    int _count;                                 /* slots filled */
+    struct mmsghdr _msgs[ UDP_BATCH ];
+    struct iovec _iov[ UDP_BATCH ];
+    struct sockaddr_in _addr[ UDP_BATCH ];
+    char _data[ UDP_BATCH ][ UDP_SLOT + 1 ];
+} Batch;
+
+/* One shard's counters, see METRIC_ADD(). Gauges such as METRIC_QUEUED go
+ * up on one shard and down on another, so only their sum means anything. */
+#define METRIC_ACCEPTED 0                       /* TCP clients accepted */
+#define METRIC_CLOSED 1                         /* TCP clients disconnected */
+#define METRIC_TCP_IN 2                         /* bytes */
+#define METRIC_TCP_OUT 3
+#define METRIC_UDP_IN 4                         /* datagrams */
+#define METRIC_UDP_IN_BYTES 5
+#define METRIC_UDP_OUT 6
+#define METRIC_UDP_OUT_BYTES 7
+#define METRIC_CROSS 8                          /* messages for other shards */
+#define METRIC_INBOX 9                          /* gauge: in shard inboxes */
+#define METRIC_QUEUED 10                        /* gauge: bytes in out queues */
+#define METRIC_SPILLED 11                       /* gauge: bytes in spill files */
+#define METRIC_DROPPED 12                       /* messages lost to slowPolicy */
+#define METRIC_TIMEOUTS 13                      /* idle, SHARE and UDP login */
+#define METRIC_ERRORS 14                        /* errors outside any command */
+#define METRIC_WAKEUPS 15                       /* reactor loop passes */
+#define METRIC_STORED 16                        /* messages kept for LOGIN */
+#define METRIC_STORE_OUT 17                     /* ... and delivered */
+#define METRIC_COUNT 18
+
+typedef struct {
+    unsigned long _count[ METRIC_COUNT ];
+    unsigned long _calls[16], _errors[16];      /* by CMD_SLOT() */
+    unsigned long _hist[16][ HIST_BUCKETS ];    /* handler time, metricBucket() */
+} __attribute__(( aligned( 64 ) )) Metrics;
+
+/* Counter update; only the shard's own thread writes its counters, so a
+ * relaxed load and store, as cheap as a plain add, keeps readers safe. */
+#define METRIC_ADD( sh, k, n ) __atomic_store_n( &(sh)->_metrics->_count[k], \
+        (sh)->_metrics->_count[k] + (unsigned long)(n), __ATOMIC_RELAXED )
+
+/* Offline store record, 8-byte aligned, followed by the recipient's and the
+ * sender's userids and the body. _sum, see storeSum(), finds a record torn
+ * by a crash. A STORE_DONE record says its recipient has had every message
+ * up to _seq. replay after a restart depends on the layout. */
+#define STORE_MSG 1
+#define STORE_DONE 2
+
+typedef struct {
+    uint32_t _len, _sum;                        /* _len includes the padding */
+    uint64_t _seq;
+    uint16_t _type, _bodyLen;
+    uint8_t _toLen, _fromLen, _pad[2];
+} StoreRec;
+
+/* Log segment file, numbered in the order written; the last is the one
+ * appended to. */
+typedef struct {
+    unsigned int _num;
+    int _fd;
+    char * _map;                                /* all STORE_SEG bytes */
+    unsigned int _tail, _synced;                    /* bytes written, made durable */
+    unsigned int _live, _liveBytes;                 /* records not yet delivered */
+} Segment;
+
+/* Undelivered message, by segment number and offset of its record. */
+typedef struct {
+    unsigned int _seg, _off;
+} StoreRef;
+
+/* One userid's undelivered messages, in the order they were sent. */
+typedef struct {
+    char _id[ ID_MAX + 1 ];
+    StoreRef * _refs;
+    unsigned int _count, _cap;
+} Mailbox;
+
+/* Capture record, followed by _len bytes of data. _conn is the connection
+ * number of a TCP client, or the senderKey() of a UDP one. replay.c reads
+ * these, so the layout must not change. */
+#define TRACE_OPEN 1                            /* TCP client connected */
+#define TRACE_CLOSE 2                           /* TCP client disconnected */
+#define TRACE_IN 3                              /* bytes from a TCP client */
+#define TRACE_OUT 4                             /* bytes to a TCP client */
+#define TRACE_UDP_IN 5                          /* datagram from a UDP client */
+#define TRACE_UDP_OUT 6                         /* datagram to a UDP client */
+
+typedef struct {
+    uint64_t _ns;                               /* since the capture began */
+    uint64_t _conn;
+    uint32_t _len;
+    uint16_t _type, _shard;
+} TraceRec;
+
+/* Fixed-size object allocator. Slabs of POOL_SLAB objects are carved on
+ * demand and never returned; free objects are linked through their first
+ * word. */
+typedef struct {
+    const char * _name;
+    size_t _size;                               /* multiple of 16 */
+    pthread_mutex_t _lock;
+    void * _free;                               /* global free list */
+    unsigned int _numFree, _numSlabs;
+} Pool;
+
+/* One thread's free objects for one pool; only that thread touches it. */
+typedef struct {
+    void * _free;
+    unsigned int _count;
+} PoolCache;
+
+/* One shard's io_uring, mapped by hand. Requests are tagged with RING_UD()
+ * so that completions for a client that has since left can be told apart;
+ * a send is tagged with its Send instead. */
+#define RING_ACCEPT 1
+#define RING_RECV 2
+#define RING_SEND 3
+#define RING_POLLOUT 4
+#define RING_UDP 5
+#define RING_EVENT 6
+#define RING_STATS 7
+#define RING_CANCEL 8
+#define RING_TICK 9
+#define RING_UD( conn, sd, op ) ( ((uint64_t)(conn) << 24) | \
+                                  ((uint64_t)(sd) << 4) | (op) )
+
+typedef struct {
+    int _fd;
+    unsigned _entries;
+    unsigned _sqLocal;                          /* tail not yet published */
+    unsigned _queued;                           /* SQEs not yet submitted */
+    unsigned * _sqHead, * _sqTail, * _sqMask, * _sqArray;
+    unsigned * _cqHead, * _cqTail, * _cqMask;
+    struct io_uring_sqe * _sqes;
+    struct io_uring_cqe * _cqes;
+    struct io_uring_buf_ring * _bufRing;        /* provided buffers, group 0 */
+    char * _bufs;
+    unsigned short _bufTail;
+    unsigned _bufFree;                          /* buffers the kernel holds */
+    unsigned short _heldNext[ RING_BUFS ];      /* per buffer, see Conn._held */
+    unsigned short _heldLen[ RING_BUFS ];
+} Ring;
+
+typedef struct {
+    int _index;
+    int _tcpSd, _udpSd, _epollSd, _eventSd, _timerSd;
+    Timer * _wheel;                             /* WHEEL_SLOTS list heads */
+    unsigned long _tick;                        /* last tick run */
+    Ring * _ring;                               /* NULL under epoll */
+    int _dirty;                                 /* client with output, or -1 */
+    Metrics * _metrics;
+    int _running;                               /* CMD_SLOT() in handle(), or -1 */
+    Batch * _rx, * _tx;                         /* UDP datagrams in and out */
+    PoolCache * _caches;                        /* reactor thread's caches */
+    pthread_t _tid;
+    Inbox _inbox;
+    int _signalled;                             /* eventfd written, not read */
+    Ack * _acks;                                /* parked OKs, oldest first */
+    int _numAcks, _maxAcks;
+    uint64_t _ackWant;                          /* last _seq parked; storeLock */
+    char * _trace;                              /* capture records not written */
+    int _traceLen;
+} Shard;
+
+/* Chat command. _run is handed the bytes after the command line and returns
+ * how many of them it used. */
+#define ARG_ID 1                                /* <userid> */
+#define ARG_LEN 2                               /* <msglen> or <filelen> */
+#define ARG_BODY 4                              /* msglen bytes must follow */
+
+typedef struct Command {
+    const char * _name;
+    int _nameLen, _args;
+    int (*_run)( Shard * sh, int sd, struct sockaddr_in * client, Parser * p,
+            char * body, int bodyLen );
+} Command;
+
+/* Perfect hash of a command name, by last letter and length. */
+#define CMD_SLOT( c, len ) ( ((c) + 2 * (len)) & 15 )
+
+/* Serialized WHO reply, "OK\n" then one userid per line in ascending order.
+ * Shared read-only by every WHO in flight; a LOGIN or LOGOUT edits it in
+ * place only while the directory holds the sole reference. */
+typedef struct {
+    int _refs, _len, _cap;
+    unsigned long _version;                     /* bumped on every edit */
+    char _data[];
+} Who;
+
+unsigned int numUsers = 0, maxUsers = 0, topUsers = 0, numFree = 0,
+        numShards = 0;
+User * users;                                   /* slots; _id is NULL if free */
+int * freeUsers;                                /* stack of free slots */
+int * sortedUsers;                              /* logged in slots by userid */
+Index byId, byKey;
+Who * who;                                      /* NULL until the next WHO */
+unsigned long whoVersion = 0;
+pthread_rwlock_t usersLock = PTHREAD_RWLOCK_INITIALIZER;
+
+Pool pools[ POOL_COUNT ] = {
+    [ POOL_CONN ] = { "conn", ( (IN_MAX + 1 + 15) & ~15 ),
+            PTHREAD_MUTEX_INITIALIZER },
+    [ POOL_MSG ] = { "msg", ( (sizeof( Msg ) + 15) & ~15 ),
+            PTHREAD_MUTEX_INITIALIZER },
+    [ POOL_PAYLOAD ] = { "payload", PAYLOAD_SIZE, PTHREAD_MUTEX_INITIALIZER },
+    [ POOL_SEND ] = { "send", ( (sizeof( Send ) + 15) & ~15 ),
+            PTHREAD_MUTEX_INITIALIZER } };
+__thread PoolCache poolCache[ POOL_COUNT ];
+int statsSd = -1;                               /* signalfd for SIGUSR1 */
+int captureFd = -1;                             /* trace file, or -1 */
+struct timespec captureStart;
+
+Conn * conns;
+int slowPolicy = SLOW_SPILL;
+const char * slowNames[] = { "drop", "disconnect", "spill" };
+int useRing = 0;                                /* --io uring */
+unsigned long idleTicks = TIMEOUT_IDLE * 1000 / TICK_MS,
+        udpTicks = TIMEOUT_UDP * 1000 / TICK_MS,
+        shareTicks = TIMEOUT_SHARE * 1000 / TICK_MS;  /* 0 if off */
+unsigned long nextConn = 1;
+const char * metricNames[ METRIC_COUNT ] = { "tcp_accepted", "tcp_closed",
+        "tcp_bytes_in", "tcp_bytes_out", "udp_datagrams_in", "udp_bytes_in",
+        "udp_datagrams_out", "udp_bytes_out", "cross_shard_msgs", "inbox_msgs",
+        "queued_bytes", "spilled_bytes", "dropped_msgs", "timeouts",
+        "other_errors", "wakeups", "stored_msgs", "store_delivered" };
+const char * metricsFile = NULL;                /* --stats, or NULL */
+Timer metricsTimer = { ._next = NULL, ._prev = NULL, ._due = 0, ._sd =
+        TIMER_METRICS, ._key = 0, ._login = 0 };
+struct timespec metricsStart;                   /* for uptime */
+uint64_t metricsStartClock;                     /* metricClock() then */
+
+const char * storeDir = NULL;                   /* --store, or NULL */
+pthread_mutex_t storeLock = PTHREAD_MUTEX_INITIALIZER;
+Segment * segs;                                 /* by _num, oldest first */
+unsigned int numSegs = 0, maxSegs = 0;
+Mailbox * boxes;                                /* dropped once emptied */
+unsigned int numBoxes = 0, maxBoxes = 0;
+Index byBox;
+uint64_t storeSeq = 1;                          /* next message's _seq */
+uint64_t storeSynced = 0;                       /* last _seq durable */
+
+Shard * shards;
+unsigned short tcpPort = 0, udpPort = 0;
 
 /* Method declarations. ----------------------------------------------------- */
 
+int accepted( Shard * sh, int sd, struct sockaddr_in * client );
+unsigned long boxHashOf( int slot );
+int cmdBroadcast( Shard * sh, int sd, struct sockaddr_in * client, Parser * p,
+        char * body, int bodyLen );
+int cmdLogin( Shard * sh, int sd, struct sockaddr_in * client, Parser * p,
+        char * body, int bodyLen );
+int cmdLogout( Shard * sh, int sd, struct sockaddr_in * client, Parser * p,
+        char * body, int bodyLen );
+int cmdSend( Shard * sh, int sd, struct sockaddr_in * client, Parser * p,
+        char * body, int bodyLen );
+int cmdShare( Shard * sh, int sd, struct sockaddr_in * client, Parser * p,
+        char * body, int bodyLen );
+int cmdStats( Shard * sh, int sd, struct sockaddr_in * client, Parser * p,
+        char * body, int bodyLen );
+int cmdWho( Shard * sh, int sd, struct sockaddr_in * client, Parser * p,
+        char * body, int bodyLen );
+void consume( Shard * sh, int sd );
+void cutOff( Conn * c );
+void deliver( Shard * sh, User * to, const char * head, int headLen,
+        Payload * payload );
+void disconnect( Shard * sh, int sd );
+void enqueue( Shard * sh, Msg * m );
+int findSender( int sd, struct sockaddr_in * client );
+int findSorted( const char * id );
+int findUser( const char * id );
+void flush( Shard * sh, int sd );
+int handle( Shard * sh, int sd, struct sockaddr_in * client, Parser * p,
+        char * buf, int len );
+unsigned long hashId( const char * id );
+unsigned long hashKey( unsigned long key );
+unsigned long idHashOf( int slot );
+int indexFind( Index * ix, unsigned long h, int (*match)( int, const void * ),
+        const void * key );
+int indexInsert( Index * ix, int slot, unsigned long (*hashOf)( int ) );
+void indexRemove( Index * ix, int slot, unsigned long (*hashOf)( int ) );
+unsigned long keyHashOf( int slot );
+void login( Shard * sh, int sd, struct sockaddr_in * client, char * id );
+void logout( int i );
+int matchBox( int slot, const void * id );
+int matchId( int slot, const void * id );
+int matchKey( int slot, const void * key );
+int metricBucket( uint64_t t );
+uint64_t metricClock( void );
+void metricsDump( void );
+int metricsFormat( char * buf, int cap, int full );
+Msg * msgNew( unsigned long conn, int sd, const char * head, int headLen,
+        Payload * payload );
+void msgFree( Msg * m );
+void msgRetire( Conn * c );
+int openSocket( int type, unsigned short port );
+int overflow( Shard * sh, Conn * c, Msg * m );
+Payload * payloadNew( const char * data, int len, const char * tail );
+void payloadRelease( Payload * p );
+Payload * payloadSpooled( Spool * spool, off_t off, int len );
+void * poolAlloc( int k );
+void poolFree( int k, void * obj );
+void poolStats( void );
+Msg * pop( Inbox * q );
+void push( Inbox * q, Msg * m );
+void * reactor( void * ptr );
+int received( Shard * sh, int sd, const char * data, int len );
+void reply( Shard * sh, int sd, struct sockaddr_in * client, const char * msg,
+        int len );
+void ringArm( Shard * sh, int op );
+void ringBuf( Ring * r, int bid );
+void ringComplete( Shard * sh, uint64_t ud, int res, unsigned flags );
+void ringDirty( Shard * sh, int sd );
+Ring * ringInit( Shard * sh );
+void ringPollOut( Shard * sh, int sd );
+int ringProbe( void );
+void ringReactor( Shard * sh );
+void ringRead( Shard * sh, int sd );
+void ringRecv( Shard * sh, int sd );
+void ringSend( Shard * sh, int sd, const struct iovec * iov, int n, int k );
+void ringSent( Shard * sh, Send * s, int res );
+struct io_uring_sqe * ringSqe( Shard * sh );
+int ringSubmit( Ring * r, int wait );
+unsigned long senderKey( int sd, struct sockaddr_in * client );
+void serveInbox( Shard * sh );
+void serveTcp( Shard * sh, int sd );
+void serveUdp( Shard * sh );
+int share( Shard * sh, int sd, const char * data, int len );
+void shareEnd( Conn * c );
+Spool * spoolNew( void );
+void spoolRelease( Spool * spool );
+void storeAck( Shard * sh, int sd, struct sockaddr_in * client, uint64_t seq );
+void storeAcks( Shard * sh );
+int storeAppend( int type, uint64_t seq, const char * to, const char * from,
+        const char * body, int bodyLen, StoreRef * at );
+int storeBox( const char * id, int create );
+void storeDeliver( Shard * sh, int slot );
+void storeDrop( int b );
+int storeOpen( void );
+int storePut( Shard * sh, const char * from, const char * to,
+        const char * body, int bodyLen, uint64_t * seq );
+int storeRoom( int b );
+void storeScan( Segment * seg );
+Segment * storeSeg( unsigned int num );
+Segment * storeSegment( unsigned int num, int create );
+uint32_t storeSum( const StoreRec * r );
+void storeSync( void );
+void * storeThread( void * ptr );
+unsigned long tickNow( void );
+void timerArm( Shard * sh, Timer * t, unsigned long due );
+void timerCancel( Timer * t );
+void timerExpire( Shard * sh, Timer * t );
+void timerTick( Shard * sh );
+void trace( Shard * sh, int type, unsigned long conn, const struct iovec * iov,
+        int n, size_t len );
+void traceFlush( Shard * sh );
+void traceSpool( Shard * sh, int type, unsigned long conn, int fd, off_t off,
+        size_t len );
+void udpFlush( Shard * sh );
+void udpSend( Shard * sh, struct sockaddr_in * to, const struct iovec * iov,
+        int n );
+int validId( const char * id );
+void watch( Shard * sh, int sd, uint32_t events );
+Who * whoGet( void );
+void whoRelease( Who * w );
+void whoUpdate( int pos, const char * id, int insert );
 
+/* Command table, indexed by CMD_SLOT(). */
+const Command commands[16] = {
+    [ CMD_SLOT( 'T', 9 ) ] = { "BROADCAST", 9, ARG_LEN | ARG_BODY, cmdBroadcast },
+    [ CMD_SLOT( 'N', 5 ) ] = { "LOGIN", 5, ARG_ID, cmdLogin },
+    [ CMD_SLOT( 'T', 6 ) ] = { "LOGOUT", 6, 0, cmdLogout },
+    [ CMD_SLOT( 'D', 4 ) ] = { "SEND", 4, ARG_ID | ARG_LEN | ARG_BODY, cmdSend },
+    [ CMD_SLOT( 'E', 5 ) ] = { "SHARE", 5, ARG_ID | ARG_LEN, cmdShare },
+    [ CMD_SLOT( 'S', 5 ) ] = { "STATS", 5, 0, cmdStats },
+    [ CMD_SLOT( 'O', 3 ) ] = { "WHO", 3, 0, cmdWho } };
 
 /* Method definitions. ------------------------------------------------------ */
 
+/* Rehash callback for byBox; storeLock must be held.
+ * @param       slot, index into boxes.
+ * @return      hash of the mailbox's userid.
+ */
+unsigned long boxHashOf( int slot ) {
+    return hashId( boxes[slot]._id );
+}
 
 
-/* Main. -------------------------------------------------------------------- */
+/* Accepted TCP client setup, shared by both backends.
+ * @param       sh, shard that accepted the client.
+ *              sd, client socket.
+ *              client, client address, or NULL to look it up.
+ * @return      0, or -1 if the client was turned away and its socket closed.
+ * @modifies    conns
+ */
+int accepted( Shard * sh, int sd, struct sockaddr_in * client ) {
+    if ( sd >= CONN_MAX ) {
+        fprintf( stderr, "SHARD %d: ERROR too many clients\n", sh->_index );
+        close( sd );
+        return -1;
+    }
+    Conn * c = &conns[sd];
+    c->_in = (Parser){ ._buf = poolAlloc( POOL_CONN ) };
+    if ( c->_in._buf == NULL ) {
+        fprintf( stderr, "SHARD %d: ERROR malloc() failed\n", sh->_index );
+        close( sd );
+        return -1;
+    }
+    c->_sd = sd;                                c->_shard = sh->_index;
+    c->_outHead = c->_outTail = NULL;
+    c->_outBytes = c->_spillBytes = 0;
+    c->_spill = NULL;                           c->_spillLen = 0;
+    c->_paused = c->_over = 0;
+    c->_share = NULL;                           c->_send = NULL;
+    c->_armed = c->_pollOut = 0;                /* _dirty may still be listed */
+    c->_held = c->_heldTail = -1;               c->_heldOff = 0;
+    c->_timer._sd = sd;                         c->_seen = sh->_tick;
+    if ( idleTicks ) { timerArm( sh, &c->_timer, sh->_tick + idleTicks ); }
+    __atomic_store_n( &c->_id, __atomic_fetch_add( &nextConn, 1,
+            __ATOMIC_RELAXED ), __ATOMIC_RELEASE );
 
-int main( int argc, char * argv[] ) {
-    if ( argc == 3 ) {
-        char * tmp;
-        const unsigned short tcpPort = strtol( argv[1], &tmp, 10 ),
-                udpPort = strtol( argv[2], &tmp, 10 );
+    struct sockaddr_in peer = { 0 };
+    socklen_t peerLen = sizeof( peer );
+    if ( client == NULL ) {
+        getpeername( sd, (struct sockaddr *)&peer, &peerLen );
+        client = &peer;
+    }
+    char addr[ INET_ADDRSTRLEN ];
+    printf( "SHARD %d: Rcvd incoming TCP connection from: %s\n", sh->_index,
+            inet_ntop( AF_INET, &client->sin_addr, addr, sizeof( addr ) ) );
+    METRIC_ADD( sh, METRIC_ACCEPTED, 1 );
+    if ( captureFd >= 0 ) { trace( sh, TRACE_OPEN, c->_id, NULL, 0, 0 ); }
+    return 0;
+}
 
-#ifdef DEBUG_MODE
-        printf( "tcp %u --- udp %u\n", tcpPort, udpPort );
-#endif
 
-        /* Initialize TCP socket. */
-        if ( ( tcpSd = socket(PF_INET, SOCK_STREAM, 0) ) < 0 ) {
-            fprintf( stderr, "MAIN: ERROR TCP socket() failed\n" );
-            return EXIT_FAILURE;
+/* BROADCAST handler; sends the body to every logged in user. Every handler
+ * has this signature, and marks with (void) what it does not use.
+ * @param       sh, shard on which the request arrived.
+ *              sd, socket on which the request arrived.
+ *              client, UDP client address, or NULL for TCP.
+ *              p, parser holding the command line.
+ *              body, msglen bytes of message.
+ *              bodyLen, bytes available at body.
+ * @return      msglen.
+ */
+int cmdBroadcast( Shard * sh, int sd, struct sockaddr_in * client, Parser * p,
+        char * body, int bodyLen ) {
+    (void)bodyLen;
+    const int msgLen = p->_frame._len;
+    printf( "SHARD %d: Rcvd BROADCAST request\n", sh->_index );
+    pthread_rwlock_rdlock( &usersLock );
+        int from = findSender( sd, client );
+        if ( from < 0 ) {
+            reply( sh, sd, client, "ERROR Not logged in\n", 20 );
+        } else {
+            /* valid :: one payload, referenced by every recipient */
+            __atomic_store_n( &users[from]._seen, sh->_tick, __ATOMIC_RELAXED );
+            char head[ HEAD_MAX ];
+            int headLen = snprintf( head, sizeof( head ), "FROM %s %d ",
+                    users[from]._id, msgLen );
+            Payload * pl = payloadNew( body, msgLen, "\n" );
+            if ( pl ) {
+                reply( sh, sd, client, "OK\n", 3 );
+                for ( unsigned int i = 0; i < numUsers; ++i ) {
+                    deliver( sh, &users[ sortedUsers[i] ], head, headLen, pl );
+                }
+                payloadRelease( pl );
+            } else {
+                fprintf( stderr, "SHARD %d: ERROR malloc() failed\n",
+                        sh->_index );
+            }
         }
+    pthread_rwlock_unlock( &usersLock );
+    return msgLen;
+}
 
-        tcpServer.sin_family = PF_INET;
-        tcpServer.sin_port = htons( tcpPort );
-        (tcpServer.sin_addr).s_addr = htonl( INADDR_ANY );
-        tcpServerLen = sizeof( tcpServer );
 
-        if ( bind( tcpSd, (struct sockaddr *)&tcpServer, tcpServerLen ) < 0 ) {
-            fprintf( stderr, "MAIN: ERROR TCP bind() failed\n" );
-            return EXIT_FAILURE;
+/* LOGIN handler.
+ * @param       see cmdBroadcast().
+ * @return      0; LOGIN has no body.
+ */
+int cmdLogin( Shard * sh, int sd, struct sockaddr_in * client, Parser * p,
+        char * body, int bodyLen ) {
+    (void)body; (void)bodyLen;
+    printf( "SHARD %d: Rcvd LOGIN request for userid %s\n", sh->_index,
+            p->_frame._id );
+    login( sh, sd, client, p->_frame._id );
+    return 0;
+}
+
+
+/* LOGOUT handler.
+ * @param       see cmdBroadcast().
+ * @return      0; LOGOUT has no body.
+ */
+int cmdLogout( Shard * sh, int sd, struct sockaddr_in * client, Parser * p,
+        char * body, int bodyLen ) {
+    (void)p; (void)body; (void)bodyLen;
+    printf( "SHARD %d: Rcvd LOGOUT request\n", sh->_index );
+    pthread_rwlock_wrlock( &usersLock );
+        int i = findSender( sd, client );
+        if ( i >= 0 ) { logout( i ); }
+    pthread_rwlock_unlock( &usersLock );
+    reply( sh, sd, client, "OK\n", 3 );
+    return 0;
+}
+
+
+/* SEND handler; forwards the body to one user, or with --store keeps it
+ * for one who is not logged in.
+ * @param       see cmdBroadcast().
+ * @return      msglen.
+ */
+int cmdSend( Shard * sh, int sd, struct sockaddr_in * client, Parser * p,
+        char * body, int bodyLen ) {
+    (void)bodyLen;
+    const int msgLen = p->_frame._len;
+    printf( "SHARD %d: Rcvd SEND request to userid %s\n", sh->_index,
+            p->_frame._id );
+    pthread_rwlock_rdlock( &usersLock );
+        int from = findSender( sd, client ), to = findUser( p->_frame._id );
+        if ( from < 0 ) {
+            reply( sh, sd, client, "ERROR Not logged in\n", 20 );
+        } else if ( (to < 0) && storeDir && validId( p->_frame._id ) ) {
+            /* offline :: keep it for the recipient's next LOGIN */
+            __atomic_store_n( &users[from]._seen, sh->_tick, __ATOMIC_RELAXED );
+            uint64_t seq;
+            int rc = storePut( sh, users[from]._id, p->_frame._id, body, msgLen,
+                    &seq );
+            if ( rc == 0 ) {
+                storeAck( sh, sd, client, seq );
+            } else if ( rc > 0 ) {
+                reply( sh, sd, client, "ERROR Mailbox full\n", 19 );
+            } else {
+                reply( sh, sd, client, "ERROR Server busy\n", 18 );
+            }
+        } else if ( to < 0 ) {
+            reply( sh, sd, client, "ERROR Unknown userid\n", 21 );
+        } else {
+            /* valid :: forward to recipient */
+            __atomic_store_n( &users[from]._seen, sh->_tick, __ATOMIC_RELAXED );
+            char head[ HEAD_MAX ];
+            int headLen = snprintf( head, sizeof( head ), "FROM %s %d ",
+                    users[from]._id, msgLen );
+            Payload * pl = payloadNew( body, msgLen, "\n" );
+            if ( pl ) {
+                deliver( sh, &users[to], head, headLen, pl );
+                payloadRelease( pl );
+                reply( sh, sd, client, "OK\n", 3 );
+            } else {
+                fprintf( stderr, "SHARD %d: ERROR malloc() failed\n",
+                        sh->_index );
+            }
         }
+    pthread_rwlock_unlock( &usersLock );
+    return msgLen;
+}
 
-        if ( listen( tcpSd, 5 ) < 0 ) {
-            fprintf( stderr, "MAIN: ERROR TCP listen() failed\n" );
-            return EXIT_FAILURE;
+
+
+/* SHARE handler. A TCP client streams the file after the command; a UDP
+ * client must fit the whole file into the command's datagram.
+ * @param       see cmdBroadcast(); body holds whatever part of the file has
+ *                arrived.
+ * @return      bytes of body that belong to the file.
+ * @modifies    conns
+ */
+int cmdShare( Shard * sh, int sd, struct sockaddr_in * client, Parser * p,
+        char * body, int bodyLen ) {
+    const long fileLen = p->_frame._len;
+    const int used = ( (bodyLen < fileLen) ? bodyLen : fileLen );
+    printf( "SHARD %d: Rcvd SHARE request to userid %s\n", sh->_index,
+            p->_frame._id );
+
+    /* A refused TCP SHARE still has to have its file read past. */
+    if ( client == NULL ) { p->_skip = fileLen - used; }
+    pthread_rwlock_rdlock( &usersLock );
+        int from = findSender( sd, client ), to = findUser( p->_frame._id );
+        if ( from < 0 ) {
+            pthread_rwlock_unlock( &usersLock );
+            reply( sh, sd, client, "ERROR Not logged in\n", 20 );
+            return used;
+        } else if ( client && (bodyLen < fileLen) ) {
+            pthread_rwlock_unlock( &usersLock );
+            reply( sh, sd, client, "ERROR Invalid filelen\n", 22 );
+            return used;
+        } else if ( to < 0 ) {
+            pthread_rwlock_unlock( &usersLock );
+            reply( sh, sd, client, "ERROR Unknown userid\n", 21 );
+            return used;
         }
 
-        /* Initialize UDP socket. */
-        if ( ( udpSd = socket(AF_INET, SOCK_DGRAM, 0) ) < 0 ) {
-            fprintf( stderr, "MAIN: ERROR UDP socket() failed\n" );
-            return EXIT_FAILURE;
+        __atomic_store_n( &users[from]._seen, sh->_tick, __ATOMIC_RELAXED );
+        char head[ HEAD_MAX ];
+        int headLen = snprintf( head, sizeof( head ), "SHARE %s %ld\n",
+                users[from]._id, fileLen );
+        if ( client ) {
+            /* UDP :: the file is all here */
+            Payload * pl = payloadNew( body, fileLen, "" );
+            if ( pl ) {
+                reply( sh, sd, client, "OK\n", 3 );
+                deliver( sh, &users[to], head, headLen, pl );
+                payloadRelease( pl );
+            } else {
+                fprintf( stderr, "SHARD %d: ERROR malloc() failed\n", sh->_index );
+            }
+            pthread_rwlock_unlock( &usersLock );
+            return used;
         }
+        /* Field by field :: other shards stamp _seen as they please. */
+        User recipient = { ._connection = users[to]._connection, ._sd =
+                users[to]._sd, ._shard = users[to]._shard, ._conn =
+                users[to]._conn, ._key = users[to]._key, ._seen =
+                __atomic_load_n( &users[to]._seen, __ATOMIC_RELAXED ), ._addr =
+                users[to]._addr };
+    pthread_rwlock_unlock( &usersLock );
 
-        udpServer.sin_family = AF_INET;
-        udpServer.sin_port = htons( udpPort );
-        (udpServer.sin_addr).s_addr = htonl( INADDR_ANY );
-        udpServerLen = sizeof( udpServer );
+    Share * x = calloc( 1, sizeof( Share ) );
+    if ( (x == NULL) || ( (x->_spool = spoolNew()) == NULL ) ) {
+        fprintf( stderr, "SHARD %d: ERROR spool setup failed\n", sh->_index );
+        free( x );
+        reply( sh, sd, client, "ERROR Server busy\n", 18 );
+        return used;
+    }
+    if ( pipe2( x->_pipe, O_NONBLOCK ) < 0 ) {
+        fprintf( stderr, "SHARD %d: ERROR pipe() failed\n", sh->_index );
+        spoolRelease( x->_spool );
+        free( x );
+        reply( sh, sd, client, "ERROR Server busy\n", 18 );
+        return used;
+    }
+    x->_to = recipient;                         x->_left = fileLen;
+    memcpy( x->_head, head, headLen );          x->_headLen = headLen;
+    conns[sd]._share = x;
+    p->_skip = 0;
+    if ( shareTicks ) { timerArm( sh, &conns[sd]._timer, sh->_tick + shareTicks ); }
 
-        if ( bind( udpSd, (struct sockaddr *)&udpServer, udpServerLen ) < 0 ) {
-            fprintf( stderr, "MAIN: ERROR UDP bind() failed\n" );
-            return EXIT_FAILURE;
+    /* Whatever has arrived is the start of the file; share() takes the rest
+     * straight from the socket. */
+    reply( sh, sd, client, "OK\n", 3 );
+    if ( (used > 0) && (share( sh, sd, body, used ) < 0) ) {
+        shareEnd( &conns[sd] );
+    }
+    return used;
+}
+
+
+/* STATS handler; sends every shard's counters summed, one per line, then a
+ * line per command of calls, errors and handler time percentiles.
+ * @param       see cmdBroadcast().
+ * @return      0; STATS has no body.
+ */
+int cmdStats( Shard * sh, int sd, struct sockaddr_in * client, Parser * p,
+        char * body, int bodyLen ) {
+    (void)p; (void)body; (void)bodyLen;
+    printf( "SHARD %d: Rcvd STATS request\n", sh->_index );
+    char buf[ 4096 ];
+    int len = metricsFormat( buf, sizeof( buf ), 0 );
+    if ( len > 0 ) { reply( sh, sd, client, buf, len ); }
+    return 0;
+}
+
+
+/* WHO handler; sends the cached reply.
+ * @param       see cmdBroadcast().
+ * @return      0; WHO has no body.
+ */
+int cmdWho( Shard * sh, int sd, struct sockaddr_in * client, Parser * p,
+        char * body, int bodyLen ) {
+    (void)p; (void)body; (void)bodyLen;
+    printf( "SHARD %d: Rcvd WHO request\n", sh->_index );
+    if ( client && udpTicks ) {
+        /* A UDP client polling WHO is still there. */
+        pthread_rwlock_rdlock( &usersLock );
+            int i = findSender( sd, client );
+            if ( i >= 0 ) {
+                __atomic_store_n( &users[i]._seen, sh->_tick, __ATOMIC_RELAXED );
+            }
+        pthread_rwlock_unlock( &usersLock );
+    }
+    Who * w = whoGet();
+    if ( w ) {
+#ifdef DEBUG_MODE
+        printf( "SHARD %d: WHO version %lu\n", sh->_index, w->_version );
+#endif
+        reply( sh, sd, client, w->_data, w->_len );
+        whoRelease( w );
+    } else {
+        fprintf( stderr, "SHARD %d: ERROR malloc() failed\n", sh->_index );
+    }
+    return 0;
+}
+
+
+/* Parser driver for a TCP client whose read buffer has grown.
+ * @param       sh, shard owning the client.
+ *              sd, client socket.
+ * @modifies    conns
+ */
+void consume( Shard * sh, int sd ) {
+    Parser * p = &conns[sd]._in;
+    int used = handle( sh, sd, NULL, p, p->_buf, p->_len );
+    memmove( p->_buf, p->_buf + used, p->_len - used );
+    p->_len -= used;
+
+    if ( p->_len == IN_MAX ) {
+        /* no command line fits :: drop it */
+        reply( sh, sd, NULL, "ERROR Unknown command\n", 22 );
+        p->_len = p->_scan = 0;                 p->_drop = 1;
+    }
+}
+
+
+/* Delivery helper; hands TCP messages for other shards to their inbox.
+ * @param       sh, calling shard.
+ *              to, recipient, with usersLock held, or a copy.
+ *              head, per-recipient header.
+ *              headLen, length of header, at most HEAD_MAX.
+ *              payload, shared body, or NULL; referenced, not copied.
+ */
+void deliver( Shard * sh, User * to, const char * head, int headLen,
+        Payload * payload ) {
+    if ( (strcmp( to->_connection, UDP ) == 0) && payload && payload->_spool ) {
+        /* Spooled SHARE :: header, then the body in datagrams that fit. */
+        char udpBuffer[ BUFFER_MAX ];
+        if ( headLen > 0 ) {
+            struct iovec iov = { (void *)head, headLen };
+            udpSend( sh, &to->_addr, &iov, 1 );
+        }
+        for ( int off = 0; off < payload->_len; ) {
+            int n = pread( payload->_spool->_fd, udpBuffer, ( (payload->_len -
+                    off < BUFFER_MAX) ? (payload->_len - off) : BUFFER_MAX ),
+                    payload->_off + off );
+            if ( n <= 0 ) {
+                fprintf( stderr, "SHARD %d: ERROR pread() failed\n", sh->_index );
+                return;
+            }
+            struct iovec iov = { udpBuffer, n };
+            udpSend( sh, &to->_addr, &iov, 1 );
+            off += n;
         }
+        return;
+    } else if ( strcmp( to->_connection, UDP ) == 0 ) {
+        struct iovec iov[2] = { { (void *)head, headLen },
+                                { ( payload ? payload->_data : NULL ),
+                                  ( payload ? payload->_len : 0 ) } };
+        udpSend( sh, &to->_addr, iov, 2 );
+        return;
+    }
 
-        if ( getsockname( udpSd, (struct sockaddr *)&udpServer, (socklen_t
-                *)&udpServerLen ) < 0 ) {
-            fprintf( stderr, "MAIN: ERROR UDP getsockname() failed\n" );
-            return EXIT_FAILURE;
+    Msg * m = msgNew( to->_conn, to->_sd, head, headLen, payload );
+    if ( m == NULL ) {
+        fprintf( stderr, "SHARD %d: ERROR malloc() failed\n", sh->_index );
+    } else if ( to->_shard == sh->_index ) {
+        enqueue( sh, m );
+    } else {
+        /* to->_shard != sh->_index :: cross-shard */
+        Shard * owner = &shards[ to->_shard ];
+        METRIC_ADD( sh, METRIC_CROSS, 1 );
+        METRIC_ADD( sh, METRIC_INBOX, 1 );
+        push( &owner->_inbox, m );
+        uint64_t one = 1;
+        if ( !__atomic_exchange_n( &owner->_signalled, 1, __ATOMIC_ACQ_REL ) &&
+                (write( owner->_eventSd, &one, sizeof( one ) ) < 0) ) {
+            fprintf( stderr, "SHARD %d: ERROR eventfd write() failed\n",
+                    sh->_index );
         }
+    }
+}
 
-        printf( "MAIN: Started server\n" );
-        printf( "MAIN: Listening for TCP connections on port: %d\n",
-                ntohs(tcpServer.sin_port) );
-        printf( "MAIN: Listening for UDP datagrams on port: %d\n",
-                ntohs(udpServer.sin_port) );
-        fflush( stdout );
 
-        users = calloc( USER_INC, USER_SIZE );
-
-        char tcpBuffer[ BUFFER_MAX ], udpBuffer[ BUFFER_MAX ];
-        struct sockaddr_in tcpClient, udpClient;
-        int tcpClientLen = sizeof( tcpClient ),
-                udpClientLen = sizeof( udpClient );
-        /* to clear temporary warning */
-        strcat( tcpBuffer, "\0" );
-        tcpClientLen = 0;
-        if ( tcpPort != udpPort ) {
-            int tcpIn = -1, udpIn = -1;
-            while ( 1 ) {
-                if ( ( tcpIn =  ) )
-                if ( ( udpIn = recvfrom(udpSd, udpBuffer, BUFFER_MAX, 0, (struct
-                        sockaddr *)&udpClient, (socklen_t *)&udpClientLen) ) <
-                        0 ) {
-                    fprintf( stderr, "MAIN: ERROR UDP recvfrom() failed\n" );
-                } else {
-                    printf( "MAIN: Rcvd incoming UDP datagram from: %s\n",
-                            inet_ntoa(udpClient.sin_addr) );
-                    udpBuffer[ udpIn ] = '\0';
+/* TCP helper for a client that must go but may still be in use up the stack;
+ * the hangup reaches the reactor, which disconnects it.
+ * @param       c, connection of the client.
+ * @modifies    c
+ * @effects     shuts the socket down; nothing more is queued for it.
+ */
+void cutOff( Conn * c ) {
+    if ( c->_over == 2 ) { return; }
+    shutdown( c->_sd, SHUT_RDWR );
+    c->_over = 2;
+}
 
-                    char * udpRead = strstr( udpBuffer, "LOGIN" );
-                    if ( udpRead == udpBuffer ) {
 
-                    }
+/* TCP disconnect helper.
+ * @param       sh, shard owning the client.
+ *              sd, client socket.
+ * @modifies    users, conns
+ * @effects     logs the client out and closes its socket.
+ */
+void disconnect( Shard * sh, int sd ) {
+    printf( "SHARD %d: Client disconnected\n", sh->_index );
+    METRIC_ADD( sh, METRIC_CLOSED, 1 );
+    if ( captureFd >= 0 ) { trace( sh, TRACE_CLOSE, conns[sd]._id, NULL, 0, 0 ); }
 
-                    udpRead = strstr( udpBuffer, "WHO" );
-                    if ( udpRead == udpBuffer ) {
-                        int tmp = 3 + ( ID_MAX * (numUsers + 1) );
-                        char whoBuffer[ tmp ];
-                        strcat( whoBuffer, "OK\n" );
-                        for ( int i = 0; i < numUsers; ++i ) {
-                            strcat( whoBuffer, strcat( users[i]._id, "\n" ) );
-                        }
-                        strcat( whoBuffer, "\0" );
-
-                        if ( ( sendto(udpSd, whoBuffer, tmp, 0, (struct sockaddr
-                                *)&udpClient, udpClientLen) ) < 0 ) {
-                            fprintf( stderr, "MAIN: ERROR UDP sendto() failed"
-                                    "\n" );
-                        }
-                    }
+    pthread_rwlock_wrlock( &usersLock );
+        int i = findSender( sd, NULL );
+        if ( i >= 0 ) { logout( i ); }
+    pthread_rwlock_unlock( &usersLock );
 
-                    udpRead = strstr( udpBuffer, "LOGOUT" );
-                    if ( udpRead == udpBuffer ) {
+    __atomic_store_n( &conns[sd]._id, 0, __ATOMIC_RELEASE );
+    timerCancel( &conns[sd]._timer );
+    Send * s = conns[sd]._send;
+    if ( s ) {
+        /* The kernel may still be reading these; ringSent() frees them. */
+        Msg * last = conns[sd]._outHead;
+        long cost = last->_cost;
+        for ( int k = 1; k < s->_count; ++k ) {
+            last = last->_next;                 cost += last->_cost;
+        }
+        METRIC_ADD( sh, METRIC_QUEUED, -cost );
+        s->_msgs = conns[sd]._outHead;          s->_conn = 0;
+        conns[sd]._outHead = last->_next;       last->_next = NULL;
+        if ( conns[sd]._outHead == NULL ) { conns[sd]._outTail = NULL; }
+        conns[sd]._send = NULL;
+    }
+    while ( conns[sd]._outHead ) { msgRetire( &conns[sd] ); }
+    if ( conns[sd]._spill ) {
+        spoolRelease( conns[sd]._spill );       conns[sd]._spill = NULL;
+    }
+    if ( conns[sd]._share ) { shareEnd( &conns[sd] ); }
+    poolFree( POOL_CONN, conns[sd]._in._buf );  conns[sd]._in._buf = NULL;
+    if ( sh->_ring ) {
+        while ( conns[sd]._held >= 0 ) {
+            int bid = conns[sd]._held;
+            conns[sd]._held = ( (bid == conns[sd]._heldTail) ? -1 :
+                    sh->_ring->_heldNext[ bid ] );
+            ringBuf( sh->_ring, bid );
+        }
+        shutdown( sd, SHUT_RDWR );              /* ends its requests */
+    }
+    close( sd );                                /* also leaves epoll set */
+}
 
-                    }
 
-                    udpRead = strstr( udpBuffer, "SEND" );
-                    if ( udpRead == udpBuffer ) {
+/* Output queue append; only the shard owning the client may call this.
+ * @param       sh, shard owning the client.
+ *              m, message for the client, dropped if the client has left.
+ * @modifies    conns
+ * @effects     sends at once unless earlier output is still waiting on
+ *                EPOLLOUT, or under io_uring with the next submission; past
+ *                OUT_MAX, applies slowPolicy.
+ */
+void enqueue( Shard * sh, Msg * m ) {
+    Conn * c = &conns[ m->_sd ];
+    if ( (c->_id != m->_conn) || (c->_over == 2) ) {
+        msgFree( m );
+        return;
+    }
 
-                    }
+    /* Spooled SHARE pieces are already on disk and cost no memory. */
+    m->_cost = m->_headLen + ( (m->_payload && !m->_payload->_spool) ?
+            m->_payload->_len : 0 );
+    if ( (m->_cost > 0) && (c->_outBytes + m->_cost > OUT_MAX) &&
+            !overflow( sh, c, m ) ) {
+        return;
+    }
+    c->_outBytes += m->_cost;
+    METRIC_ADD( sh, METRIC_QUEUED, m->_cost );
 
-                    udpRead = strstr( udpBuffer, "BROADCAST" );
-                    if ( udpRead == udpBuffer ) {
+    m->_next = NULL;
+    if ( c->_outTail ) {
+        c->_outTail->_next = m;                 c->_outTail = m;
+    } else if ( sh->_ring ) {
+        c->_outHead = c->_outTail = m;
+        ringDirty( sh, m->_sd );
+    } else {
+        c->_outHead = c->_outTail = m;
+        flush( sh, m->_sd );
+    }
+}
 
-                    }
 
-                    udpRead = strstr( udpBuffer, "SHARE" );
-                    if ( udpRead == udpBuffer ) {
+/* Helper to find the logged in user behind a request; usersLock must be held.
+ * @param       sd, TCP client socket (ignored for UDP).
+ *              client, UDP client address, or NULL for TCP.
+ * @return      index into users, or -1 if not logged in.
+ */
+int findSender( int sd, struct sockaddr_in * client ) {
+    unsigned long key = senderKey( sd, client );
+    return indexFind( &byKey, hashKey( key ), matchKey, &key );
+}
 
-                    }
+
+/* Binary search of sortedUsers; usersLock must be held.
+ * @param       id, userid to find.
+ * @return      position of id in sortedUsers, or where it would be inserted.
+ */
+int findSorted( const char * id ) {
+    int lo = 0, hi = numUsers;
+    while ( lo < hi ) {
+        int mid = ( lo + hi ) / 2;
+        if ( strcmp( users[ sortedUsers[mid] ]._id, id ) < 0 ) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+
+/* Helper to find a logged in user by userid; usersLock must be held.
+ * @param       id, userid to find.
+ * @return      index into users, or -1 if not logged in.
+ */
+int findUser( const char * id ) {
+    return indexFind( &byId, hashId( id ), matchId, id );
+}
+
+
+/* Output queue writer; sends as many queued messages as the socket takes,
+ * gathering headers and shared payloads with one sendmsg() per batch. Under
+ * io_uring the batch is handed to ringSend() instead, and nothing more is
+ * sent until it completes.
+ * @param       sh, shard owning the client.
+ *              sd, client socket.
+ * @modifies    conns
+ * @effects     whatever is left waits for the next EPOLLOUT or POLLOUT, or
+ *                from an OK parked by storeAck() on, for storeAcks(); a
+ *                client the socket has failed is cut off.
+ */
+void flush( Shard * sh, int sd ) {
+    Conn * c = &conns[sd];
+    const uint64_t synced = __atomic_load_n( &storeSynced, __ATOMIC_ACQUIRE );
+    while ( c->_outHead && (c->_send == NULL) && (c->_outHead->_commit <=
+            synced) ) {
+        Msg * head = c->_outHead;
+        if ( head->_payload && head->_payload->_spool ) {
+            /* Spooled SHARE :: send the header, then sendfile() the body. */
+            ssize_t sent;
+            off_t off = head->_payload->_off + ( head->_off - head->_headLen );
+            if ( head->_off < head->_headLen ) {
+                sent = send( sd, head->_head + head->_off, head->_headLen -
+                        head->_off, MSG_NOSIGNAL );
+            } else {
+                sent = sendfile( sd, head->_payload->_spool->_fd, &off,
+                        head->_headLen + head->_payload->_len - head->_off );
+            }
+
+            if ( sent < 0 ) {
+                if ( errno == EINTR ) { continue; }
+                if ( (errno != EAGAIN) && (errno != EWOULDBLOCK) ) {
+                    fprintf( stderr, "SHARD %d: ERROR TCP sendfile() failed\n",
+                            sh->_index );
+                    cutOff( c );
+                } else if ( sh->_ring ) {
+                    ringPollOut( sh, sd );
                 }
+                return;
             }
-        } else {
-            /* need to use select() calls */
-            /* int in = -1; */
-            while ( 1 ) {
-                /* ... */
+
+            METRIC_ADD( sh, METRIC_TCP_OUT, sent );
+            if ( (captureFd >= 0) && (head->_off < head->_headLen) ) {
+                struct iovec iov = { head->_head + head->_off, sent };
+                trace( sh, TRACE_OUT, c->_id, &iov, 1, sent );
+            } else if ( captureFd >= 0 ) {
+                traceSpool( sh, TRACE_OUT, c->_id, head->_payload->_spool->_fd,
+                        off - sent, sent );
+            }
+            head->_off += sent;
+            if ( head->_off == head->_headLen + head->_payload->_len ) {
+                msgRetire( c );
             }
+            continue;
         }
 
-        return EXIT_SUCCESS;
-    } else {
-        /* too few/many arguments */
-        fprintf( stderr, "MAIN: ERROR Invalid argument(s)\n" );
-        fprintf( stderr, "MAIN: USAGE a.out <tcp-port> <udp-port>\n" );
+        struct iovec iov[ 2 * FLUSH_MAX ];
+        int n = 0, k = 0;
+        for ( Msg * m = c->_outHead; m && (k < FLUSH_MAX) && (m->_commit <=
+                synced) && !( m->_payload && m->_payload->_spool ); m =
+                m->_next, ++k ) {
+            int bodyOff = m->_off - m->_headLen;
+            if ( bodyOff < 0 ) {
+                iov[ n++ ] = (struct iovec){ m->_head + m->_off, -bodyOff };
+                bodyOff = 0;
+            }
+            if ( m->_payload && (bodyOff < m->_payload->_len) ) {
+                iov[ n++ ] = (struct iovec){ m->_payload->_data + bodyOff,
+                        m->_payload->_len - bodyOff };
+            }
+        }
+
+        if ( sh->_ring ) {
+            ringSend( sh, sd, iov, n, k );
+            return;
+        }
+
+        struct msghdr hdr = { .msg_iov = iov, .msg_iovlen = n };
+        ssize_t sent = sendmsg( sd, &hdr, MSG_NOSIGNAL );
+        if ( sent < 0 ) {
+            if ( errno == EINTR ) { continue; }
+            if ( (errno != EAGAIN) && (errno != EWOULDBLOCK) ) {
+                fprintf( stderr, "SHARD %d: ERROR TCP sendmsg() failed\n",
+                        sh->_index );
+                cutOff( c );
+            }
+            return;
+        }
+
+        METRIC_ADD( sh, METRIC_TCP_OUT, sent );
+        if ( captureFd >= 0 ) { trace( sh, TRACE_OUT, c->_id, iov, n, sent ); }
+
+        /* Retire whole messages, then note how far into the next we got. */
+        for ( ; k > 0; --k ) {
+            Msg * m = c->_outHead;
+            int left = m->_headLen + ( m->_payload ? m->_payload->_len : 0 ) -
+                    m->_off;
+            if ( sent < left ) {
+                /* partial write :: socket buffer is full */
+                m->_off += sent;
+                return;
+            }
+            sent -= left;
+            msgRetire( c );
+        }
     }
-    return EXIT_FAILURE;
 }
+
+
+/* Command parser shared by TCP and UDP. Each byte is looked at once: a
+ * partial line is remembered as scanned, and a command whose body has not
+ * all arrived is kept in p until it has. Any number of commands may be
+ * pipelined in buf. A UDP datagram holds one command, and its end also ends
+ * the command line.
+ * @param       sh, shard on which the request arrived.
+ *              sd, socket on which the request arrived.
+ *              client, UDP client address, or NULL for TCP.
+ *              p, parser state.
+ *              buf, bytes received, with room for one more.
+ *              len, number of bytes received.
+ * @return      bytes consumed; the rest must be offered again with more.
+ * @modifies    p
+ */
+int handle( Shard * sh, int sd, struct sockaddr_in * client, Parser * p,
+        char * buf, int len ) {
+    int pos = 0;
+    while ( pos < len ) {
+        if ( p->_skip > 0 ) {
+            int n = ( (len - pos < p->_skip) ? (len - pos) : p->_skip );
+            pos += n;                           p->_skip -= n;
+            continue;
+        }
+        if ( p->_drop ) {
+            char * nl = memchr( buf + pos, '\n', len - pos );
+            pos = ( nl ? ((nl - buf) + 1) : len );
+            p->_drop = ( nl == NULL );
+            continue;
+        }
+        if ( (client == NULL) && conns[sd]._share ) { break; }
+
+        Frame * f = &p->_frame;
+        if ( f->_cmd == NULL ) {
+            char * nl = memchr( buf + pos + p->_scan, '\n', len - pos - p->_scan );
+            if ( nl == NULL ) {
+                if ( client == NULL ) {
+                    p->_scan = len - pos;
+                    break;
+                }
+                nl = buf + len;
+            }
+            p->_scan = 0;
+            *nl = '\0';
+
+            char * line = buf + pos;
+            pos = ( (nl - buf) < len ) ? ( (nl - buf) + 1 ) : len;
+
+            int nameLen = strcspn( line, " " );
+            const Command * cmd = ( (nameLen > 0) ? &commands[ CMD_SLOT( line[
+                    nameLen - 1 ], nameLen ) ] : NULL );
+            if ( !cmd || !cmd->_name || (cmd->_nameLen != nameLen) ||
+                    (memcmp( cmd->_name, line, nameLen ) != 0) ) {
+                sh->_running = -1;
+                reply( sh, sd, client, "ERROR Unknown command\n", 22 );
+                continue;
+            }
+            sh->_running = cmd - commands;
+
+            f->_id[0] = '\0';                   f->_len = -1;
+            char * args = line + nameLen;
+            if ( cmd->_args & ARG_ID ) {
+                int off = 0;
+                sscanf( args, " %21s%n", f->_id, &off );
+                args += off;
+            }
+            if ( cmd->_args & ARG_LEN ) { sscanf( args, " %ld", &f->_len ); }
+
+            if ( (cmd->_args & ARG_BODY) && ((f->_len < 1) || (f->_len >
+                    MSG_MAX)) ) {
+                reply( sh, sd, client, "ERROR Invalid msglen\n", 21 );
+                continue;
+            } else if ( (cmd->_args & ARG_LEN) && (f->_len < 1) ) {
+                reply( sh, sd, client, "ERROR Invalid filelen\n", 22 );
+                continue;
+            }
+            f->_cmd = cmd;
+        }
+
+        /* Command line done; wait for a body that has not all arrived. */
+        if ( (f->_cmd->_args & ARG_BODY) && (len - pos < f->_len) ) {
+            if ( client == NULL ) { break; }
+            reply( sh, sd, client, "ERROR Invalid msglen\n", 21 );
+            f->_cmd = NULL;
+            break;
+        }
+        const Command * cmd = f->_cmd;
+        const int slot = cmd - commands;
+        f->_cmd = NULL;                         sh->_running = slot;
+        const uint64_t start = metricClock();
+        pos += cmd->_run( sh, sd, client, p, buf + pos, len - pos );
+
+        Metrics * mx = sh->_metrics;
+        const int b = metricBucket( metricClock() - start );
+        __atomic_store_n( &mx->_calls[ slot ], mx->_calls[ slot ] + 1,
+                __ATOMIC_RELAXED );
+        __atomic_store_n( &mx->_hist[ slot ][b], mx->_hist[ slot ][b] + 1,
+                __ATOMIC_RELAXED );
+        sh->_running = -1;
+    }
+    sh->_running = -1;
+    return pos;
+}
+
+
+/* FNV-1a hash of a userid.
+ * @param       id, userid to hash.
+ * @return      hash of id.
+ */
+unsigned long hashId( const char * id ) {
+    unsigned long h = 14695981039346656037UL;
+    for ( ; *id != '\0'; ++id ) {
+        h = ( h ^ (unsigned char)*id ) * 1099511628211UL;
+    }
+    return h;
+}
+
+
+/* Hash of a sender key (64-bit finalizer from MurmurHash3).
+ * @param       key, sender key to hash.
+ * @return      hash of key.
+ */
+unsigned long hashKey( unsigned long key ) {
+    key ^= key >> 33;                           key *= 0xff51afd7ed558ccdUL;
+    key ^= key >> 33;                           key *= 0xc4ceb9fe1a85ec53UL;
+    return key ^ ( key >> 33 );
+}
+
+
+/* Rehash callback for byId; usersLock must be held.
+ * @param       slot, index into users.
+ * @return      hash of the user's userid.
+ */
+unsigned long idHashOf( int slot ) {
+    return hashId( users[slot]._id );
+}
+
+
+/* Index lookup.
+ * @param       ix, index to search.
+ *              h, hash of key.
+ *              match, returns nonzero if the user in a slot has the key.
+ *              key, key to find.
+ * @return      index into users, or -1 if not found.
+ */
+int indexFind( Index * ix, unsigned long h, int (*match)( int, const void * ),
+        const void * key ) {
+    if ( ix->_cap == 0 ) { return -1; }
+
+    const unsigned int mask = ix->_cap - 1;
+    for ( unsigned int b = ( h & mask ); ix->_buckets[b] != 0; b = ( (b + 1) &
+            mask ) ) {
+        if ( match( ix->_buckets[b] - 1, key ) ) { return ix->_buckets[b] - 1; }
+    }
+    return -1;
+}
+
+
+/* Index insert; doubles the table first if it would pass half full.
+ * @param       ix, index to insert into.
+ *              slot, index into users to insert.
+ *              hashOf, returns the hash of the user in a slot.
+ * @return      0 on success, or -1 if the table could not grow.
+ * @modifies    ix
+ */
+int indexInsert( Index * ix, int slot, unsigned long (*hashOf)( int ) ) {
+    if ( (ix->_count + 1) * 2 > ix->_cap ) {
+        unsigned int cap = ( (ix->_cap > 0) ? (ix->_cap * 2) : 64 );
+        int * buckets = calloc( cap, sizeof( int ) );
+        if ( buckets == NULL ) { return -1; }
+
+        for ( unsigned int b = 0; b < ix->_cap; ++b ) {
+            if ( ix->_buckets[b] == 0 ) { continue; }
+            unsigned int nb = ( hashOf( ix->_buckets[b] - 1 ) & (cap - 1) );
+            while ( buckets[nb] != 0 ) { nb = ( (nb + 1) & (cap - 1) ); }
+            buckets[nb] = ix->_buckets[b];
+        }
+        free( ix->_buckets );
+        ix->_buckets = buckets;                 ix->_cap = cap;
+    }
+
+    const unsigned int mask = ix->_cap - 1;
+    unsigned int b = ( hashOf( slot ) & mask );
+    while ( ix->_buckets[b] != 0 ) { b = ( (b + 1) & mask ); }
+    ix->_buckets[b] = slot + 1;
+    ++ix->_count;
+    return 0;
+}
+
+
+/* Index remove, by backward shift so that no tombstones are needed.
+ * @param       ix, index to remove from.
+ *              slot, index into users to remove.
+ *              hashOf, returns the hash of the user in a slot.
+ * @modifies    ix
+ */
+void indexRemove( Index * ix, int slot, unsigned long (*hashOf)( int ) ) {
+    if ( ix->_cap == 0 ) { return; }
+
+    const unsigned int mask = ix->_cap - 1;
+    unsigned int hole = ( hashOf( slot ) & mask );
+    while ( ix->_buckets[hole] != slot + 1 ) {
+        if ( ix->_buckets[hole] == 0 ) { return; }
+        hole = ( (hole + 1) & mask );
+    }
+
+    /* Pull later entries of the run back over the hole when their home
+     * bucket does not lie cyclically in (hole, b]. */
+    for ( unsigned int b = ( (hole + 1) & mask ); ix->_buckets[b] != 0; b = (
+            (b + 1) & mask ) ) {
+        unsigned int home = ( hashOf( ix->_buckets[b] - 1 ) & mask );
+        if ( ((b - home) & mask) >= ((b - hole) & mask) ) {
+            ix->_buckets[hole] = ix->_buckets[b];
+            hole = b;
+        }
+    }
+    ix->_buckets[hole] = 0;
+    --ix->_count;
+}
+
+
+/* Rehash callback for byKey; usersLock must be held.
+ * @param       slot, index into users.
+ * @return      hash of the user's sender key.
+ */
+unsigned long keyHashOf( int slot ) {
+    return hashKey( users[slot]._key );
+}
+
+
+/* LOGIN helper.
+ * @param       sh, shard on which the request arrived.
+ *              sd, socket on which the request arrived.
+ *              client, UDP client address, or NULL for TCP.
+ *              id, requested userid.
+ * @modifies    users, numUsers, maxUsers, sh
+ * @effects     adds the user if the userid is valid and free; a UDP user's
+ *                login is timed, and messages stored for the user follow
+ *                the OK.
+ */
+void login( Shard * sh, int sd, struct sockaddr_in * client, char * id ) {
+    if ( !validId( id ) ) {
+        reply( sh, sd, client, "ERROR Invalid userid\n", 21 );
+        return;
+    }
+
+    pthread_rwlock_wrlock( &usersLock );
+    if ( (findUser( id ) >= 0) || (findSender( sd, client ) >= 0) ) {
+        pthread_rwlock_unlock( &usersLock );
+        reply( sh, sd, client, "ERROR Already connected\n", 24 );
+        return;
+    }
+
+    if ( (numFree == 0) && (topUsers == maxUsers) ) {
+        unsigned int cap = ( (maxUsers > 0) ? (maxUsers * 2) : USER_INC );
+        User * tmp = realloc( users, (cap * USER_SIZE) );
+        if ( tmp ) { users = tmp; }
+        int * tmpFree = realloc( freeUsers, (cap * sizeof( int )) );
+        if ( tmpFree ) { freeUsers = tmpFree; }
+        int * tmpSorted = realloc( sortedUsers, (cap * sizeof( int )) );
+        if ( tmpSorted ) { sortedUsers = tmpSorted; }
+
+        if ( !tmp || !tmpFree || !tmpSorted ) {
+            pthread_rwlock_unlock( &usersLock );
+            fprintf( stderr, "SHARD %d: ERROR realloc() failed\n", sh->_index );
+            reply( sh, sd, client, "ERROR Server full\n", 18 );
+            return;
+        }
+        maxUsers = cap;
+    }
+
+    int slot = ( (numFree > 0) ? freeUsers[ --numFree ] : (int)topUsers++ );
+    users[ slot ] = (User){ ._id = strdup( id ), ._connection = ( client ?
+            UDP : TCP ), ._sd = sd, ._shard = sh->_index, ._key = senderKey( sd,
+            client ), ._seen = sh->_tick };
+    if ( client ) {
+        users[ slot ]._addr = *client;
+        users[ slot ]._conn = __atomic_fetch_add( &nextConn, 1, __ATOMIC_RELAXED );
+    } else {
+        /* !client :: TCP */
+        users[ slot ]._conn = conns[sd]._id;
+    }
+
+    if ( (users[ slot ]._id == NULL) || (indexInsert( &byId, slot, idHashOf )
+            < 0) ) {
+        free( users[ slot ]._id );              users[ slot ]._id = NULL;
+        freeUsers[ numFree++ ] = slot;
+        pthread_rwlock_unlock( &usersLock );
+        reply( sh, sd, client, "ERROR Server full\n", 18 );
+        return;
+    }
+    if ( indexInsert( &byKey, slot, keyHashOf ) < 0 ) {
+        indexRemove( &byId, slot, idHashOf );
+        free( users[ slot ]._id );              users[ slot ]._id = NULL;
+        freeUsers[ numFree++ ] = slot;
+        pthread_rwlock_unlock( &usersLock );
+        reply( sh, sd, client, "ERROR Server full\n", 18 );
+        return;
+    }
+
+    int pos = findSorted( id );
+    memmove( &sortedUsers[ pos + 1 ], &sortedUsers[ pos ], ((numUsers - pos) *
+            sizeof( int )) );
+    sortedUsers[ pos ] = slot;
+    ++numUsers;
+    whoUpdate( pos, id, 1 );
+    const unsigned long key = users[ slot ]._key, conn = users[ slot ]._conn;
+    reply( sh, sd, client, "OK\n", 3 );
+    if ( storeDir ) { storeDeliver( sh, slot ); }
+    pthread_rwlock_unlock( &usersLock );
+
+    if ( client && udpTicks ) {
+        /* Without one, a UDP login would never end. */
+        Timer * t = malloc( sizeof( Timer ) );
+        if ( t ) {
+            *t = (Timer){ ._sd = TIMER_UDP, ._key = key, ._login = conn };
+            timerArm( sh, t, sh->_tick + udpTicks );
+        } else {
+            fprintf( stderr, "SHARD %d: ERROR malloc() failed\n", sh->_index );
+        }
+    }
+}
+
+
+/* LOGOUT helper; usersLock must be held for writing.
+ * @param       i, index into users of user to remove.
+ * @modifies    users, numUsers
+ * @effects     removes the user from both indexes and the sorted view, and
+ *                frees its slot.
+ */
+void logout( int i ) {
+    indexRemove( &byId, i, idHashOf );
+    indexRemove( &byKey, i, keyHashOf );
+
+    int pos = findSorted( users[i]._id );
+    memmove( &sortedUsers[ pos ], &sortedUsers[ pos + 1 ], ((numUsers - pos - 1)
+            * sizeof( int )) );
+    --numUsers;
+    whoUpdate( pos, users[i]._id, 0 );
+
+    free( users[i]._id );                       users[i]._id = NULL;
+    freeUsers[ numFree++ ] = i;
+}
+
+
+/* byBox match callback; storeLock must be held.
+ * @param       slot, index into boxes.
+ *              id, userid to compare.
+ * @return      nonzero if the mailbox in slot is for userid id.
+ */
+int matchBox( int slot, const void * id ) {
+    return ( strcmp( boxes[slot]._id, (const char *)id ) == 0 );
+}
+
+
+/* byId match callback; usersLock must be held.
+ * @param       slot, index into users.
+ *              id, userid to compare.
+ * @return      nonzero if the user in slot has userid id.
+ */
+int matchId( int slot, const void * id ) {
+    return ( strcmp( users[slot]._id, (const char *)id ) == 0 );
+}
+
+
+/* byKey match callback; usersLock must be held.
+ * @param       slot, index into users.
+ *              key, pointer to sender key to compare.
+ * @return      nonzero if the user in slot has the sender key.
+ */
+int matchKey( int slot, const void * key ) {
+    return ( users[slot]._key == *(const unsigned long *)key );
+}
+
+
+/* Histogram bucket of a handler time: two buckets per power of 2, split at
+ * its midpoint.
+ * @param       t, time in metricClock() units.
+ * @return      bucket, below HIST_BUCKETS.
+ */
+int metricBucket( uint64_t t ) {
+    if ( t < 2 ) { return t; }
+    int top = 63 - __builtin_clzl( t );
+    return ( 2 * top ) + (int)( (t >> (top - 1)) & 1 );
+}
+
+
+/* Cheapest clock that orders a thread's own events: the time stamp counter
+ * where there is one, else CLOCK_MONOTONIC.
+ * @return      ticks since an arbitrary start; see metricsFormat().
+ */
+uint64_t metricClock( void ) {
+#if defined( __x86_64__ ) || defined( __i386__ )
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+
+/* --stats dump; replaces the file whole, so a reader never sees half.
+ * @effects     writes metricsFile.
+ */
+void metricsDump( void ) {
+    const int cap = 65536;
+    char * buf = malloc( cap ), * tmp = malloc( strlen( metricsFile ) + 5 );
+    int len = ( buf ? metricsFormat( buf, cap, 1 ) : 0 ), fd = -1;
+    if ( tmp ) {
+        sprintf( tmp, "%s.tmp", metricsFile );
+        fd = open( tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+    }
+    if ( (fd < 0) || (len <= 0) || (write( fd, buf, len ) != len) ||
+            (close( fd ) < 0) || (rename( tmp, metricsFile ) < 0) ) {
+        fprintf( stderr, "MAIN: ERROR Could not write %s\n", metricsFile );
+        if ( (fd >= 0) && tmp ) { unlink( tmp ); }
+    }
+    free( buf );
+    free( tmp );
+}
+
+
+/* Sums every shard's metrics into text. Counters are read while their
+ * shards go on writing them, so the sums are only as of roughly now.
+ * @param       buf, buffer for the text.
+ *              cap, size of buf.
+ *              full, nonzero to add each command's histogram.
+ * @return      length of the text, or -1 if it did not fit.
+ */
+int metricsFormat( char * buf, int cap, int full ) {
+    unsigned long count[ METRIC_COUNT ] = { 0 }, calls[16] = { 0 },
+            errors[16] = { 0 }, hist[16][ HIST_BUCKETS ] = { { 0 } };
+    for ( unsigned int i = 0; i < numShards; ++i ) {
+        Metrics * mx = shards[i]._metrics;
+        for ( int k = 0; k < METRIC_COUNT; ++k ) {
+            count[k] += __atomic_load_n( &mx->_count[k], __ATOMIC_RELAXED );
+        }
+        for ( int c = 0; c < 16; ++c ) {
+            calls[c] += __atomic_load_n( &mx->_calls[c], __ATOMIC_RELAXED );
+            errors[c] += __atomic_load_n( &mx->_errors[c], __ATOMIC_RELAXED );
+            for ( int b = 0; b < HIST_BUCKETS; ++b ) {
+                hist[c][b] += __atomic_load_n( &mx->_hist[c][b],
+                        __ATOMIC_RELAXED );
+            }
+        }
+    }
+
+    /* metricClock() ticks per microsecond, measured over the uptime. */
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    double uptime = ( now.tv_sec - metricsStart.tv_sec ) + ( now.tv_nsec -
+            metricsStart.tv_nsec ) / 1e9;
+    double perUs = ( (uptime > 0) ? ( (metricClock() - metricsStartClock) /
+            (uptime * 1e6) ) : 1 );
+    if ( perUs <= 0 ) { perUs = 1; }
+
+    double bound[ HIST_BUCKETS ];
+    for ( int b = 0; b < HIST_BUCKETS; ++b ) {
+        int top = b / 2;
+        bound[b] = ( (b < 2) ? (b + 1) : ( (double)(1UL << top) + ((b & 1) + 1) *
+                (double)(1UL << (top - 1)) ) ) / perUs;
+    }
+
+    FILE * out = fmemopen( buf, cap, "w" );
+    if ( out == NULL ) { return -1; }
+    fprintf( out, "OK\nuptime_s %.3f\nusers %u\n", uptime, __atomic_load_n(
+            &numUsers, __ATOMIC_RELAXED ) );
+    for ( int k = 0; k < METRIC_COUNT; ++k ) {
+        fprintf( out, "%s %ld\n", metricNames[k], (long)count[k] );
+    }
+
+    /* Percentiles are the upper bound, in us, of the bucket they fall in. */
+    for ( int c = 0; c < 16; ++c ) {
+        if ( commands[c]._name == NULL ) { continue; }
+        const double qs[3] = { 0.5, 0.99, 0.999 };
+        double at[4] = { 0 };
+        unsigned long seen = 0;
+        for ( int b = 0, q = 0; b < HIST_BUCKETS; ++b ) {
+            if ( hist[c][b] == 0 ) { continue; }
+            seen += hist[c][b];
+            for ( ; (q < 3) && (seen >= qs[q] * calls[c]); ++q ) {
+                at[q] = bound[b];
+            }
+            at[3] = bound[b];
+        }
+        fprintf( out, "command %s calls %lu errors %lu p50_us %.3f p99_us %.3f "
+                "p999_us %.3f max_us %.3f\n", commands[c]._name, calls[c],
+                errors[c], at[0], at[1], at[2], at[3] );
+    }
+
+    for ( int c = 0; full && (c < 16); ++c ) {
+        if ( (commands[c]._name == NULL) || (calls[c] == 0) ) { continue; }
+        fprintf( out, "histogram %s", commands[c]._name );
+        for ( int b = 0; b < HIST_BUCKETS; ++b ) {
+            if ( hist[c][b] > 0 ) {
+                fprintf( out, " %.3f:%lu", bound[b], hist[c][b] );
+            }
+        }
+        fprintf( out, "\n" );
+    }
+
+    fflush( out );
+    long len = ftell( out );
+    fclose( out );
+    return ( (len < cap - 1) ? (int)len : -1 );
+}
+
+
+/* Message constructor.
+ * @param       conn, recipient connection number.
+ *              sd, recipient socket.
+ *              head, per-recipient header, copied.
+ *              headLen, length of header, at most HEAD_MAX.
+ *              payload, shared body, or NULL; a reference is taken.
+ * @return      new message, or NULL if out of memory.
+ */
+Msg * msgNew( unsigned long conn, int sd, const char * head, int headLen,
+        Payload * payload ) {
+    Msg * m = poolAlloc( POOL_MSG );
+    if ( m == NULL ) { return NULL; }
+
+    *m = (Msg){ ._conn = conn, ._sd = sd, ._headLen = headLen, ._payload =
+            payload };
+    memcpy( m->_head, head, headLen );
+    if ( payload ) { __atomic_add_fetch( &payload->_refs, 1, __ATOMIC_RELAXED ); }
+    return m;
+}
+
+
+/* Message destructor; drops the message's payload reference.
+ * @param       m, message to free.
+ */
+void msgFree( Msg * m ) {
+    if ( m->_payload ) { payloadRelease( m->_payload ); }
+    poolFree( POOL_MSG, m );
+}
+
+
+/* Removes the message at the head of an output queue, sent or not.
+ * @param       c, connection whose queue to pop.
+ * @modifies    c
+ * @effects     empties the spill file once nothing queued is in it.
+ */
+void msgRetire( Conn * c ) {
+    Msg * m = c->_outHead;
+    c->_outHead = m->_next;
+    if ( c->_outHead == NULL ) { c->_outTail = NULL; }
+
+    c->_outBytes -= m->_cost;
+    METRIC_ADD( &shards[ c->_shard ], METRIC_QUEUED, -m->_cost );
+    if ( c->_spill && m->_payload && (m->_payload->_spool == c->_spill) ) {
+        c->_spillBytes -= m->_payload->_len;
+        METRIC_ADD( &shards[ c->_shard ], METRIC_SPILLED, -m->_payload->_len );
+        if ( (c->_spillBytes == 0) && (ftruncate( c->_spill->_fd, 0 ) == 0) ) {
+            c->_spillLen = 0;
+        }
+    }
+    msgFree( m );
+
+    if ( (c->_over == 1) && (c->_outBytes <= OUT_LOW) && (c->_spillBytes ==
+            0) ) {
+        c->_over = 0;
+    }
+}
+
+
+/* Helper to open a shard's socket on a port shared with the other shards.
+ * @param       type, SOCK_STREAM or SOCK_DGRAM.
+ *              port, port to bind, or 0 for any.
+ * @return      bound non-blocking socket (listening for TCP), or -1.
+ */
+int openSocket( int type, unsigned short port ) {
+    const char * name = ( (type == SOCK_STREAM) ? "TCP" : "UDP" );
+    int sd = socket( AF_INET, type | SOCK_NONBLOCK, 0 ), on = 1;
+    if ( sd < 0 ) {
+        fprintf( stderr, "MAIN: ERROR %s socket() failed\n", name );
+        return -1;
+    }
+
+    setsockopt( sd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof( on ) );
+    if ( setsockopt( sd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof( on ) ) < 0 ) {
+        fprintf( stderr, "MAIN: ERROR %s SO_REUSEPORT failed\n", name );
+        close( sd );
+        return -1;
+    }
+
+    struct sockaddr_in server = { .sin_family = AF_INET,
+                                  .sin_port = htons( port ),
+                                  .sin_addr.s_addr = htonl( INADDR_ANY ) };
+    if ( bind( sd, (struct sockaddr *)&server, sizeof( server ) ) < 0 ) {
+        fprintf( stderr, "MAIN: ERROR %s bind() failed\n", name );
+        close( sd );
+        return -1;
+    }
+
+    if ( (type == SOCK_STREAM) && (listen( sd, SOMAXCONN ) < 0) ) {
+        fprintf( stderr, "MAIN: ERROR TCP listen() failed\n" );
+        close( sd );
+        return -1;
+    }
+    return sd;
+}
+
+
+/* Applies slowPolicy to a message that would take a client's output queue
+ * past OUT_MAX.
+ * @param       sh, shard owning the client.
+ *              c, connection of the client.
+ *              m, message for the client.
+ * @return      1 if m, now held in the spill file, should still be queued; 0
+ *                if it was dropped.
+ * @modifies    c, m
+ */
+int overflow( Shard * sh, Conn * c, Msg * m ) {
+    if ( c->_over == 0 ) {
+        printf( "SHARD %d: Client output over limit (%s)\n", sh->_index,
+                slowNames[ slowPolicy ] );
+        c->_over = 1;
+    }
+
+    const int len = m->_headLen + ( m->_payload ? m->_payload->_len : 0 );
+    if ( (slowPolicy == SLOW_SPILL) && (c->_spillLen + len <= SPILL_MAX) &&
+            ( c->_spill || (c->_spill = spoolNew()) ) ) {
+        Payload * p = payloadSpooled( c->_spill, c->_spillLen, len );
+        if ( p && (pwrite( c->_spill->_fd, m->_head, m->_headLen, c->_spillLen )
+                == m->_headLen) && ( !m->_payload || (pwrite( c->_spill->_fd,
+                m->_payload->_data, m->_payload->_len, c->_spillLen +
+                m->_headLen ) == m->_payload->_len) ) ) {
+            if ( m->_payload ) { payloadRelease( m->_payload ); }
+            m->_payload = p;                    m->_headLen = 0;
+            m->_cost = 0;
+            c->_spillLen += len;                c->_spillBytes += len;
+            METRIC_ADD( sh, METRIC_SPILLED, len );
+            return 1;
+        }
+        if ( p ) { payloadRelease( p ); }
+        fprintf( stderr, "SHARD %d: ERROR spill failed\n", sh->_index );
+    }
+    msgFree( m );
+    METRIC_ADD( sh, METRIC_DROPPED, 1 );
+
+    if ( slowPolicy != SLOW_DROP ) {
+        printf( "SHARD %d: Disconnecting slow client\n", sh->_index );
+        cutOff( c );
+    }
+    return 0;
+}
+
+
+/* Payload constructor.
+ * @param       data, bytes to copy.
+ *              len, number of bytes to copy.
+ *              tail, NUL-terminated suffix to append, such as "\n".
+ * @return      payload with one reference, or NULL if out of memory.
+ */
+Payload * payloadNew( const char * data, int len, const char * tail ) {
+    int tailLen = strlen( tail );
+    Payload * p = ( (sizeof( Payload ) + len + tailLen <= PAYLOAD_SIZE) ?
+            poolAlloc( POOL_PAYLOAD ) : malloc( sizeof( Payload ) + len +
+            tailLen ) );
+    if ( p == NULL ) { return NULL; }
+
+    p->_refs = 1;                               p->_len = len + tailLen;
+    p->_spool = NULL;                           p->_off = 0;
+    memcpy( p->_data, data, len );
+    memcpy( p->_data + len, tail, tailLen );
+    return p;
+}
+
+
+/* Drops a payload reference, freeing it with the last one.
+ * @param       p, payload to release.
+ */
+void payloadRelease( Payload * p ) {
+    if ( __atomic_sub_fetch( &p->_refs, 1, __ATOMIC_ACQ_REL ) == 0 ) {
+        if ( p->_spool ) {
+            spoolRelease( p->_spool );
+            poolFree( POOL_MSG, p );
+        } else if ( sizeof( Payload ) + p->_len <= PAYLOAD_SIZE ) {
+            poolFree( POOL_PAYLOAD, p );
+        } else {
+            free( p );
+        }
+    }
+}
+
+
+/* Constructor for a payload naming part of a spool.
+ * @param       spool, spool holding the body; a reference is taken.
+ *              off, offset of the body in the spool.
+ *              len, length of the body.
+ * @return      payload with one reference, or NULL if out of memory.
+ */
+Payload * payloadSpooled( Spool * spool, off_t off, int len ) {
+    Payload * p = poolAlloc( POOL_MSG );        /* smaller than a Msg */
+    if ( p == NULL ) { return NULL; }
+
+    *p = (Payload){ ._refs = 1, ._len = len, ._spool = spool, ._off = off };
+    __atomic_add_fetch( &spool->_refs, 1, __ATOMIC_RELAXED );
+    return p;
+}
+
+
+/* Pool allocator; takes from the calling thread's cache, refilling it with
+ * up to POOL_BATCH objects from the pool, and the pool with a new slab.
+ * @param       k, POOL_CONN, POOL_MSG or POOL_PAYLOAD.
+ * @return      object of pools[k]._size bytes, or NULL if out of memory.
+ * @modifies    pools, poolCache
+ */
+void * poolAlloc( int k ) {
+    Pool * pool = &pools[k];
+    PoolCache * cache = &poolCache[k];
+    if ( cache->_free == NULL ) {
+        pthread_mutex_lock( &pool->_lock );
+            if ( pool->_free == NULL ) {
+                char * slab = malloc( POOL_SLAB * pool->_size );
+                if ( slab == NULL ) {
+                    pthread_mutex_unlock( &pool->_lock );
+                    return NULL;
+                }
+                for ( int i = POOL_SLAB - 1; i >= 0; --i ) {
+                    *(void **)( slab + (i * pool->_size) ) = pool->_free;
+                    pool->_free = slab + (i * pool->_size);
+                }
+                pool->_numFree += POOL_SLAB;
+                ++pool->_numSlabs;
+            }
+
+            /* Move a batch over; the cache count is read by poolStats(). */
+            unsigned int moved = 0;
+            while ( pool->_free && (moved < POOL_BATCH) ) {
+                void * obj = pool->_free;
+                pool->_free = *(void **)obj;
+                *(void **)obj = cache->_free;
+                cache->_free = obj;
+                ++moved;
+            }
+            pool->_numFree -= moved;
+        pthread_mutex_unlock( &pool->_lock );
+        __atomic_store_n( &cache->_count, cache->_count + moved,
+                __ATOMIC_RELAXED );
+    }
+
+    void * obj = cache->_free;
+    cache->_free = *(void **)obj;
+    __atomic_store_n( &cache->_count, cache->_count - 1, __ATOMIC_RELAXED );
+    return obj;
+}
+
+
+/* Pool deallocator; returns POOL_BATCH objects to the pool whenever the
+ * calling thread's cache passes twice that.
+ * @param       k, pool obj came from, on any thread.
+ *              obj, object to free.
+ * @modifies    pools, poolCache
+ */
+void poolFree( int k, void * obj ) {
+    PoolCache * cache = &poolCache[k];
+    *(void **)obj = cache->_free;
+    cache->_free = obj;
+    __atomic_store_n( &cache->_count, cache->_count + 1, __ATOMIC_RELAXED );
+    if ( cache->_count <= 2 * POOL_BATCH ) { return; }
+
+    void * first = cache->_free, * last = first;
+    for ( int i = 1; i < POOL_BATCH; ++i ) { last = *(void **)last; }
+    cache->_free = *(void **)last;
+    __atomic_store_n( &cache->_count, cache->_count - POOL_BATCH,
+            __ATOMIC_RELAXED );
+
+    Pool * pool = &pools[k];
+    pthread_mutex_lock( &pool->_lock );
+        *(void **)last = pool->_free;
+        pool->_free = first;
+        pool->_numFree += POOL_BATCH;
+    pthread_mutex_unlock( &pool->_lock );
+}
+
+
+/* Logs each pool's occupancy: objects carved, in use, and free in the pool
+ * and in reactor caches. Cache counts are read without locking, so the
+ * figures are a snapshot, not a consistent cut.
+ */
+void poolStats( void ) {
+    for ( int k = 0; k < POOL_COUNT; ++k ) {
+        Pool * pool = &pools[k];
+        unsigned int cached = 0;
+        for ( unsigned int i = 0; i < numShards; ++i ) {
+            if ( shards[i]._caches ) {
+                cached += __atomic_load_n( &shards[i]._caches[k]._count,
+                        __ATOMIC_RELAXED );
+            }
+        }
+
+        pthread_mutex_lock( &pool->_lock );
+            unsigned int total = pool->_numSlabs * POOL_SLAB,
+                    free = pool->_numFree, slabs = pool->_numSlabs;
+        pthread_mutex_unlock( &pool->_lock );
+
+        /* Other threads may briefly hold a few cached objects too. */
+        unsigned int used = ( (free + cached <= total) ? (total - free -
+                cached) : 0 );
+        printf( "MAIN: Pool %s: %u-byte objects, %u slabs, %u in use, %u free, "
+                "%u cached\n", pool->_name, (unsigned int)pool->_size, slabs,
+                used, free, cached );
+    }
+    fflush( stdout );
+}
+
+
+/* Inbox pop; only the owning shard may call this.
+ * @param       q, inbox to pop from.
+ * @return      oldest message, or NULL if empty (or a push is half done, in
+ *                which case its eventfd write is still to come).
+ */
+Msg * pop( Inbox * q ) {
+    Msg * tail = q->_tail, * next = __atomic_load_n( &tail->_next,
+            __ATOMIC_ACQUIRE );
+    if ( tail == &q->_stub ) {
+        if ( next == NULL ) { return NULL; }
+        q->_tail = next;                        tail = next;
+        next = __atomic_load_n( &tail->_next, __ATOMIC_ACQUIRE );
+    }
+
+    if ( next ) {
+        q->_tail = next;
+        return tail;
+    }
+
+    if ( tail != __atomic_load_n( &q->_head, __ATOMIC_ACQUIRE ) ) {
+        return NULL;
+    }
+
+    push( q, &q->_stub );
+    next = __atomic_load_n( &tail->_next, __ATOMIC_ACQUIRE );
+    if ( next ) {
+        q->_tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+
+/* Inbox push; safe from any thread.
+ * @param       q, inbox to push to.
+ *              m, message to push.
+ */
+void push( Inbox * q, Msg * m ) {
+    __atomic_store_n( &m->_next, NULL, __ATOMIC_RELAXED );
+    Msg * prev = __atomic_exchange_n( &q->_head, m, __ATOMIC_ACQ_REL );
+    __atomic_store_n( &prev->_next, m, __ATOMIC_RELEASE );
+}
+
+
+/* Reactor thread; runs one shard's event loop forever.
+ * @param       ptr, pointer to the Shard to run.
+ */
+void * reactor( void * ptr ) {
+    Shard * sh = (Shard*)ptr;
+    struct epoll_event events[ EVENTS_MAX ];
+    __atomic_store_n( &sh->_caches, poolCache, __ATOMIC_RELEASE );
+    if ( useRing ) {
+        /* The ring is made here, as only its creating thread may submit. */
+        if ( ( sh->_ring = ringInit( sh ) ) != NULL ) {
+            ringReactor( sh );
+            return NULL;
+        }
+        fprintf( stderr, "SHARD %d: ERROR io_uring setup failed, using epoll\n",
+                sh->_index );
+    }
+    while ( 1 ) {
+        int ready = epoll_wait( sh->_epollSd, events, EVENTS_MAX, -1 );
+        if ( ready < 0 ) {
+            if ( errno == EINTR ) { continue; }
+            fprintf( stderr, "SHARD %d: ERROR epoll_wait() failed\n", sh->_index );
+            return NULL;
+        }
+        METRIC_ADD( sh, METRIC_WAKEUPS, 1 );
+
+        for ( int e = 0; e < ready; ++e ) {
+            const int sd = events[e].data.fd;
+            if ( sd == sh->_tcpSd ) {
+                /* Accept every pending connection. */
+                struct sockaddr_in tcpClient;
+                socklen_t tcpClientLen = sizeof( tcpClient );
+                int newSd;
+                while ( ( newSd = accept4(sh->_tcpSd, (struct sockaddr
+                        *)&tcpClient, &tcpClientLen, SOCK_NONBLOCK) ) >= 0 ) {
+                    if ( accepted( sh, newSd, &tcpClient ) == 0 ) {
+                        watch( sh, newSd, EPOLLIN | EPOLLOUT | EPOLLRDHUP );
+                    }
+                    tcpClientLen = sizeof( tcpClient );
+                }
+                if ( (errno != EAGAIN) && (errno != EWOULDBLOCK) &&
+                        (errno != EINTR) ) {
+                    fprintf( stderr, "SHARD %d: ERROR TCP accept() failed\n",
+                            sh->_index );
+                }
+            } else if ( sd == sh->_udpSd ) {
+                serveUdp( sh );
+            } else if ( sd == sh->_eventSd ) {
+                serveInbox( sh );
+            } else if ( sd == sh->_timerSd ) {
+                timerTick( sh );
+            } else if ( sd == statsSd ) {
+                struct signalfd_siginfo info;
+                while ( read( statsSd, &info, sizeof( info ) ) > 0 ) {}
+                poolStats();
+            } else {
+                /* sd :: TCP client */
+                Conn * c = &conns[sd];
+                if ( (c->_over == 2) || (events[e].events & ( EPOLLHUP |
+                        EPOLLERR )) || ( (events[e].events & EPOLLRDHUP) &&
+                        (c->_paused || (c->_outBytes > OUT_HIGH)) ) ) {
+                    /* cut off or gone :: a backed up client is never read
+                     * as far as its EOF */
+                    disconnect( sh, sd );
+                    continue;
+                }
+                int resume = 0;
+                if ( events[e].events & EPOLLOUT ) {
+                    flush( sh, sd );
+                    resume = ( c->_paused && (c->_outBytes <= OUT_LOW) &&
+                            (c->_spillBytes == 0) );
+                }
+                if ( events[e].events & EPOLLRDHUP ) { resume = 1; }
+                if ( resume ) { c->_paused = 0; }
+                if ( resume || (events[e].events & EPOLLIN) ) {
+                    serveTcp( sh, sd );
+                }
+            }
+        }
+        /* Replies and the log go out once per wakeup, not per request. */
+        udpFlush( sh );
+        if ( captureFd >= 0 ) { traceFlush( sh ); }
+        fflush( stdout );
+    }
+    return NULL;
+}
+
+
+/* TCP input handler for io_uring, where the bytes arrive in a provided
+ * buffer rather than in the client's read buffer.
+ * @param       sh, shard owning the client.
+ *              sd, client socket.
+ *              data, bytes received; already captured.
+ *              len, number of bytes received.
+ * @return      bytes used, short of len if the client backed up first.
+ * @modifies    conns
+ */
+int received( Shard * sh, int sd, const char * data, int len ) {
+    const unsigned long id = conns[sd]._id;
+    int used = 0;
+    while ( (used < len) && (conns[sd]._id == id) && (conns[sd]._outBytes <=
+            OUT_HIGH) && (conns[sd]._spillBytes == 0) ) {
+        if ( conns[sd]._share ) {
+            /* SHARE in progress :: bytes belong to the file */
+            int n = share( sh, sd, data + used, len - used );
+            if ( n <= 0 ) {
+                disconnect( sh, sd );
+                break;
+            }
+            used += n;
+            continue;
+        }
+
+        Parser * p = &conns[sd]._in;
+        int n = ( (len - used < IN_MAX - p->_len) ? (len - used) : (IN_MAX -
+                p->_len) );
+        memcpy( p->_buf + p->_len, data + used, n );
+        p->_len += n;                           used += n;
+        consume( sh, sd );
+    }
+    return used;
+}
+
+
+/* Reply helper for either transport.
+ * @param       sh, calling shard.
+ *              sd, TCP client socket (ignored for UDP).
+ *              client, UDP client address, or NULL for TCP.
+ *              msg, bytes to send.
+ *              len, number of bytes to send.
+ */
+void reply( Shard * sh, int sd, struct sockaddr_in * client, const char * msg,
+        int len ) {
+    if ( msg[0] == 'E' ) {
+        /* "ERROR ..." :: charged to the command being handled, if any */
+        Metrics * mx = sh->_metrics;
+        if ( sh->_running >= 0 ) {
+            __atomic_store_n( &mx->_errors[ sh->_running ], mx->_errors[
+                    sh->_running ] + 1, __ATOMIC_RELAXED );
+        } else {
+            METRIC_ADD( sh, METRIC_ERRORS, 1 );
+        }
+    }
+    if ( client == NULL ) {
+        /* Queue behind earlier output, or whatever the socket will not take;
+         * under io_uring, always queue, to go out with the next submission. */
+        int sent = 0;
+        if ( (conns[sd]._outHead == NULL) && (sh->_ring == NULL) ) {
+            sent = send( sd, msg, len, MSG_NOSIGNAL );
+            if ( sent < 0 ) {
+                if ( (errno != EAGAIN) && (errno != EWOULDBLOCK) ) {
+                    fprintf( stderr, "SHARD %d: ERROR TCP send() failed\n",
+                            sh->_index );
+                    return;
+                }
+                sent = 0;
+            }
+        }
+        if ( sent > 0 ) { METRIC_ADD( sh, METRIC_TCP_OUT, sent ); }
+        if ( (captureFd >= 0) && (sent > 0) ) {
+            struct iovec iov = { (void *)msg, sent };
+            trace( sh, TRACE_OUT, conns[sd]._id, &iov, 1, sent );
+        }
+
+        if ( sent < len ) {
+            Payload * p = payloadNew( msg + sent, len - sent, "" );
+            Msg * m = ( p ? msgNew( conns[sd]._id, sd, "", 0, p ) : NULL );
+            if ( p ) { payloadRelease( p ); }
+            if ( m ) {
+                enqueue( sh, m );
+            } else {
+                fprintf( stderr, "SHARD %d: ERROR malloc() failed\n",
+                        sh->_index );
+            }
+        }
+    } else {
+        /* client != NULL :: UDP */
+        struct iovec iov = { (void *)msg, len };
+        udpSend( sh, client, &iov, 1 );
+    }
+}
+
+
+/* Arms one of a shard's standing io_uring requests; the listener, UDP socket,
+ * eventfd and timerfd are registered files 0, 1, 2 and 3.
+ * @param       sh, shard to arm.
+ *              op, RING_ACCEPT, RING_UDP, RING_EVENT, RING_TICK or RING_STATS.
+ */
+void ringArm( Shard * sh, int op ) {
+    struct io_uring_sqe * sqe = ringSqe( sh );
+    if ( sqe == NULL ) { return; }
+    sqe->user_data = RING_UD( 0, 0, op );
+    if ( op == RING_ACCEPT ) {
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = 0;                            sqe->flags = IOSQE_FIXED_FILE;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK;
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = ( (op == RING_UDP) ? 1 : ((op == RING_EVENT) ? 2 : ((op ==
+            RING_TICK) ? 3 : statsSd)) );
+    sqe->flags = ( (op == RING_STATS) ? 0 : IOSQE_FIXED_FILE );
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+}
+
+
+/* Hands a provided buffer back to the kernel.
+ * @param       r, ring owning the buffer.
+ *              bid, buffer id.
+ * @modifies    r
+ */
+void ringBuf( Ring * r, int bid ) {
+    struct io_uring_buf * b = &r->_bufRing->bufs[ r->_bufTail & (RING_BUFS - 1) ];
+    b->addr = (uintptr_t)( r->_bufs + (size_t)bid * RING_BUF_SIZE );
+    b->len = RING_BUF_SIZE;                     b->bid = bid;
+    __atomic_store_n( &r->_bufRing->tail, ++r->_bufTail, __ATOMIC_RELEASE );
+    r->_bufFree += 1;
+}
+
+
+/* io_uring completion handler.
+ * @param       sh, shard whose ring completed the request.
+ *              ud, the request's user_data.
+ *              res, its result.
+ *              flags, its CQE flags.
+ */
+void ringComplete( Shard * sh, uint64_t ud, int res, unsigned flags ) {
+    const int op = ud & 15, more = ( (flags & IORING_CQE_F_MORE) != 0 );
+    if ( op == RING_SEND ) {
+        ringSent( sh, (Send *)(uintptr_t)( ud & ~(uint64_t)15 ), res );
+        return;
+    } else if ( op == RING_CANCEL ) {
+        return;
+    } else if ( op == RING_ACCEPT ) {
+        if ( (res >= 0) && (accepted( sh, res, NULL ) == 0) ) {
+            ringRecv( sh, res );
+        } else if ( (res < 0) && (res != -EAGAIN) && (res != -EINTR) ) {
+            fprintf( stderr, "SHARD %d: ERROR TCP accept() failed\n",
+                    sh->_index );
+        }
+        if ( !more ) { ringArm( sh, RING_ACCEPT ); }
+        return;
+    } else if ( op == RING_UDP ) {
+        serveUdp( sh );
+        if ( !more ) { ringArm( sh, RING_UDP ); }
+        return;
+    } else if ( op == RING_EVENT ) {
+        serveInbox( sh );
+        if ( !more ) { ringArm( sh, RING_EVENT ); }
+        return;
+    } else if ( op == RING_TICK ) {
+        timerTick( sh );
+        if ( !more ) { ringArm( sh, RING_TICK ); }
+        return;
+    } else if ( op == RING_STATS ) {
+        struct signalfd_siginfo info;
+        while ( read( statsSd, &info, sizeof( info ) ) > 0 ) {}
+        poolStats();
+        if ( !more ) { ringArm( sh, RING_STATS ); }
+        return;
+    }
+
+    /* op :: RING_RECV or RING_POLLOUT, for a client that may have left */
+    const int sd = ( ud >> 4 ) & ( CONN_MAX - 1 );
+    Conn * c = &conns[sd];
+    const int live = ( (c->_id != 0) && (c->_shard == sh->_index) &&
+            (RING_UD( c->_id, sd, op ) == ud) );
+    if ( op == RING_POLLOUT ) {
+        if ( !live ) { return; }
+        c->_pollOut = 0;
+        flush( sh, sd );
+        if ( c->_paused && (c->_outBytes <= OUT_LOW) && (c->_spillBytes == 0) ) {
+            c->_paused = 0;
+            ringRead( sh, sd );
+        }
+        return;
+    }
+
+    Ring * r = sh->_ring;
+    if ( flags & IORING_CQE_F_BUFFER ) {
+        /* Queue the bytes behind any the client has not had parsed yet. */
+        const int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        r->_bufFree -= 1;
+        if ( live && (res > 0) ) {
+            c->_seen = sh->_tick;
+            METRIC_ADD( sh, METRIC_TCP_IN, res );
+            if ( captureFd >= 0 ) {
+                struct iovec iov = { r->_bufs + (size_t)bid * RING_BUF_SIZE, res };
+                trace( sh, TRACE_IN, c->_id, &iov, 1, res );
+            }
+            r->_heldLen[ bid ] = res;
+            if ( c->_held < 0 ) {
+                c->_held = bid;                 c->_heldOff = 0;
+            } else {
+                r->_heldNext[ c->_heldTail ] = bid;
+            }
+            c->_heldTail = bid;
+        } else {
+            ringBuf( r, bid );
+        }
+    }
+    if ( !live ) { return; }
+
+    if ( !more ) { c->_armed = 0; }
+    ringRead( sh, sd );
+    if ( (c->_id != 0) && ( (res == 0) || ((res < 0) && (res != -ENOBUFS) &&
+            (res != -ECANCELED)) ) ) {
+        /* client is gone */
+        disconnect( sh, sd );
+    }
+}
+
+
+/* Lists a client for attention before the next submission: output to send,
+ * or a recv to arm once buffers are free.
+ * @param       sh, shard owning the client.
+ *              sd, client socket.
+ * @modifies    sh, conns
+ */
+void ringDirty( Shard * sh, int sd ) {
+    if ( !conns[sd]._dirty ) {
+        conns[sd]._dirty = 1;                   conns[sd]._nextDirty = sh->_dirty;
+        sh->_dirty = sd;
+    }
+}
+
+
+/* io_uring setup for one shard: maps the rings, registers the shard's
+ * sockets and fills the provided buffer ring.
+ * @param       sh, shard to set up; must be called on its reactor thread.
+ * @return      ring, or NULL if the kernel refused any step.
+ */
+Ring * ringInit( Shard * sh ) {
+    struct io_uring_params p = { .flags = IORING_SETUP_CQSIZE |
+            IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER |
+            IORING_SETUP_DEFER_TASKRUN, .cq_entries = 4 * RING_SQ };
+    int fd = syscall( __NR_io_uring_setup, RING_SQ, &p );
+    if ( (fd < 0) && (errno == EINVAL) ) {
+        /* before 6.1 :: no deferred task work */
+        p = (struct io_uring_params){ .flags = IORING_SETUP_CQSIZE |
+                IORING_SETUP_SUBMIT_ALL, .cq_entries = 4 * RING_SQ };
+        fd = syscall( __NR_io_uring_setup, RING_SQ, &p );
+    }
+    Ring * r = ( (fd >= 0) ? calloc( 1, sizeof( Ring ) ) : NULL );
+    if ( r == NULL ) {
+        if ( fd >= 0 ) { close( fd ); }
+        return NULL;
+    }
+
+    const int single = ( (p.features & IORING_FEAT_SINGLE_MMAP) != 0 );
+    size_t sqLen = p.sq_off.array + p.sq_entries * sizeof( unsigned );
+    size_t cqLen = p.cq_off.cqes + p.cq_entries * sizeof( struct io_uring_cqe );
+    if ( single ) { sqLen = cqLen = ( (sqLen > cqLen) ? sqLen : cqLen ); }
+    char * sq = mmap( NULL, sqLen, PROT_READ | PROT_WRITE, MAP_SHARED |
+            MAP_POPULATE, fd, IORING_OFF_SQ_RING );
+    char * cq = ( single ? sq : mmap( NULL, cqLen, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING ) );
+    r->_sqes = mmap( NULL, p.sq_entries * sizeof( struct io_uring_sqe ),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+            IORING_OFF_SQES );
+    r->_bufRing = mmap( NULL, RING_BUFS * sizeof( struct io_uring_buf ),
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    r->_bufs = malloc( (size_t)RING_BUFS * RING_BUF_SIZE );
+
+    int files[4] = { sh->_tcpSd, sh->_udpSd, sh->_eventSd, sh->_timerSd };
+    struct io_uring_buf_reg reg = { .ring_addr = (uintptr_t)r->_bufRing,
+            .ring_entries = RING_BUFS, .bgid = 0 };
+    if ( (sq == MAP_FAILED) || (cq == MAP_FAILED) || (r->_sqes == MAP_FAILED) ||
+            (r->_bufRing == MAP_FAILED) || (r->_bufs == NULL) ||
+            (syscall( __NR_io_uring_register, fd, IORING_REGISTER_FILES, files,
+            4 ) < 0) || (syscall( __NR_io_uring_register, fd,
+            IORING_REGISTER_PBUF_RING, &reg, 1 ) < 0) ) {
+        /* only at startup, so the mappings are left to exit() */
+        close( fd );
+        free( r->_bufs );
+        free( r );
+        return NULL;
+    }
+
+    r->_fd = fd;                                r->_entries = p.sq_entries;
+    r->_sqHead = (unsigned *)( sq + p.sq_off.head );
+    r->_sqTail = (unsigned *)( sq + p.sq_off.tail );
+    r->_sqMask = (unsigned *)( sq + p.sq_off.ring_mask );
+    r->_sqArray = (unsigned *)( sq + p.sq_off.array );
+    r->_cqHead = (unsigned *)( cq + p.cq_off.head );
+    r->_cqTail = (unsigned *)( cq + p.cq_off.tail );
+    r->_cqMask = (unsigned *)( cq + p.cq_off.ring_mask );
+    r->_cqes = (struct io_uring_cqe *)( cq + p.cq_off.cqes );
+    r->_sqLocal = *r->_sqTail;
+    for ( int i = 0; i < RING_BUFS; ++i ) { ringBuf( r, i ); }
+    return r;
+}
+
+
+/* Asks to be told when a client's socket can take more output; needed only
+ * for spooled SHARE pieces, which go out with sendfile().
+ * @param       sh, shard owning the client.
+ *              sd, client socket.
+ * @modifies    conns
+ */
+void ringPollOut( Shard * sh, int sd ) {
+    struct io_uring_sqe * sqe = ( conns[sd]._pollOut ? NULL : ringSqe( sh ) );
+    if ( sqe == NULL ) { return; }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = sd;                               sqe->poll32_events = POLLOUT;
+    sqe->user_data = RING_UD( conns[sd]._id, sd, RING_POLLOUT );
+    conns[sd]._pollOut = 1;
+}
+
+
+/* Checks that the kernel has every io_uring operation ringReactor() uses.
+ * Multishot recv came in the same release as IORING_OP_SEND_ZC, which can
+ * be probed for, unlike the flag.
+ * @return      1 if it does, else 0.
+ */
+int ringProbe( void ) {
+    const int ops[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG,
+            IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL, IORING_OP_SEND_ZC };
+    struct io_uring_params p = { 0 };
+    int fd = syscall( __NR_io_uring_setup, 4, &p ), ok = 0;
+    if ( fd < 0 ) { return 0; }
+
+    struct io_uring_probe * probe = calloc( 1, sizeof( struct io_uring_probe ) +
+            256 * sizeof( struct io_uring_probe_op ) );
+    if ( probe && (syscall( __NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+            probe, 256 ) == 0) ) {
+        ok = 1;
+        for ( int i = 0; i < (int)( sizeof( ops ) / sizeof( ops[0] ) ); ++i ) {
+            ok = ok && ( ops[i] <= probe->last_op ) && ( probe->ops[ ops[i]
+                    ].flags & IO_URING_OP_SUPPORTED );
+        }
+    }
+    free( probe );
+    close( fd );
+    return ok;
+}
+
+
+/* io_uring event loop; runs one shard forever. Sends queued during a pass
+ * are prepared at its end and submitted with the wait for the next.
+ * @param       sh, shard to run, with its ring set up.
+ */
+void ringReactor( Shard * sh ) {
+    Ring * r = sh->_ring;
+    ringArm( sh, RING_ACCEPT );
+    ringArm( sh, RING_UDP );
+    ringArm( sh, RING_EVENT );
+    ringArm( sh, RING_TICK );
+    if ( sh->_index == 0 ) { ringArm( sh, RING_STATS ); }
+
+    while ( 1 ) {
+        /* Clients starved of buffers are listed again until some are free. */
+        int dirty = sh->_dirty;
+        sh->_dirty = -1;
+        while ( dirty >= 0 ) {
+            int sd = dirty;
+            dirty = conns[sd]._nextDirty;       conns[sd]._dirty = 0;
+            if ( conns[sd]._id && (conns[sd]._shard == sh->_index) ) {
+                flush( sh, sd );
+                if ( !conns[sd]._armed ) { ringRead( sh, sd ); }
+            }
+        }
+
+        if ( (ringSubmit( r, 1 ) < 0) && (errno != EINTR) && (errno != EBUSY) &&
+                (errno != EAGAIN) ) {
+            fprintf( stderr, "SHARD %d: ERROR io_uring_enter() failed\n",
+                    sh->_index );
+            return;
+        }
+
+        METRIC_ADD( sh, METRIC_WAKEUPS, 1 );
+        unsigned head = *r->_cqHead;
+        while ( head != __atomic_load_n( r->_cqTail, __ATOMIC_ACQUIRE ) ) {
+            /* Free the slot first; the handler may submit, and so post more. */
+            struct io_uring_cqe cqe = r->_cqes[ head & *r->_cqMask ];
+            __atomic_store_n( r->_cqHead, ++head, __ATOMIC_RELEASE );
+            ringComplete( sh, cqe.user_data, cqe.res, cqe.flags );
+        }
+
+        /* Replies and the log go out once per wakeup, not per request. */
+        udpFlush( sh );
+        if ( captureFd >= 0 ) { traceFlush( sh ); }
+        fflush( stdout );
+    }
+}
+
+
+/* Parses a client's held input until it backs up, then stops its recv; or,
+ * once it has all been parsed, makes sure a recv is armed.
+ * @param       sh, shard owning the client.
+ *              sd, client socket.
+ * @modifies    conns
+ */
+void ringRead( Shard * sh, int sd ) {
+    Conn * c = &conns[sd];
+    Ring * r = sh->_ring;
+    const unsigned long id = c->_id;
+    while ( !c->_paused && (c->_held >= 0) ) {
+        const int bid = c->_held, len = r->_heldLen[ bid ] - c->_heldOff;
+        int used = received( sh, sd, r->_bufs + (size_t)bid * RING_BUF_SIZE +
+                c->_heldOff, len );
+        if ( c->_id != id ) { return; }         /* buffers went with it */
+        if ( used < len ) {
+            /* backed up :: hold the rest until the queue drains */
+            c->_heldOff += used;                c->_paused = 1;
+            break;
+        }
+        c->_held = ( (bid == c->_heldTail) ? -1 : r->_heldNext[ bid ] );
+        c->_heldOff = 0;
+        ringBuf( r, bid );
+    }
+    if ( !c->_paused && ((c->_outBytes > OUT_HIGH) || (c->_spillBytes > 0)) ) {
+        c->_paused = 1;
+    }
+
+    if ( c->_paused && (c->_armed == 1) ) {
+        /* Whatever the recv still delivers is held, not parsed. */
+        struct io_uring_sqe * sqe = ringSqe( sh );
+        if ( sqe ) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = RING_UD( id, sd, RING_RECV );
+            sqe->user_data = RING_CANCEL;
+            c->_armed = 2;
+        }
+    } else if ( !c->_paused && !c->_armed ) {
+        if ( r->_bufFree > 0 ) {
+            ringRecv( sh, sd );
+        } else {
+            ringDirty( sh, sd );
+        }
+    }
+}
+
+
+/* Arms a multishot recv for a TCP client, drawing on the provided buffers.
+ * @param       sh, shard owning the client.
+ *              sd, client socket.
+ * @modifies    conns
+ */
+void ringRecv( Shard * sh, int sd ) {
+    struct io_uring_sqe * sqe = ringSqe( sh );
+    if ( sqe == NULL ) { return; }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sd;                               sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->ioprio = IORING_RECV_MULTISHOT;        sqe->buf_group = 0;
+    sqe->user_data = RING_UD( conns[sd]._id, sd, RING_RECV );
+    conns[sd]._armed = 1;
+}
+
+
+/* Queues a gathered batch of a client's output as one IORING_OP_SENDMSG.
+ * @param       sh, shard owning the client.
+ *              sd, client socket.
+ *              iov, the batch, as flush() gathered it.
+ *              n, number of iovecs.
+ *              k, number of messages, from the head of the queue, it covers.
+ * @modifies    conns
+ */
+void ringSend( Shard * sh, int sd, const struct iovec * iov, int n, int k ) {
+    Send * s = poolAlloc( POOL_SEND );
+    struct io_uring_sqe * sqe = ( s ? ringSqe( sh ) : NULL );
+    if ( sqe == NULL ) {
+        fprintf( stderr, "SHARD %d: ERROR TCP sendmsg() failed\n", sh->_index );
+        if ( s ) { poolFree( POOL_SEND, s ); }
+        return;
+    }
+    s->_conn = conns[sd]._id;                   s->_sd = sd;
+    s->_count = k;                              s->_msgs = NULL;
+    memcpy( s->_iov, iov, n * sizeof( struct iovec ) );
+    s->_hdr = (struct msghdr){ .msg_iov = s->_iov, .msg_iovlen = n };
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = sd;                               sqe->addr = (uintptr_t)&s->_hdr;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t)s | RING_SEND;
+    conns[sd]._send = s;
+}
+
+
+/* Send completion; retires what was sent and queues the rest.
+ * @param       sh, shard owning the client.
+ *              s, completed send.
+ *              res, bytes sent, or -errno.
+ * @modifies    conns
+ */
+void ringSent( Shard * sh, Send * s, int res ) {
+    if ( s->_conn == 0 ) {
+        /* client left first :: the messages are ours to free */
+        while ( s->_msgs ) {
+            Msg * m = s->_msgs;
+            s->_msgs = m->_next;
+            msgFree( m );
+        }
+        poolFree( POOL_SEND, s );
+        return;
+    }
+
+    const int sd = s->_sd;
+    Conn * c = &conns[sd];
+    c->_send = NULL;
+    if ( (res < 0) && (res != -EAGAIN) && (res != -EINTR) ) {
+        /* client is gone, or was cut off by overflow() */
+        poolFree( POOL_SEND, s );
+        disconnect( sh, sd );
+        return;
+    }
+
+    if ( res > 0 ) { METRIC_ADD( sh, METRIC_TCP_OUT, res ); }
+    if ( (captureFd >= 0) && (res > 0) ) {
+        trace( sh, TRACE_OUT, c->_id, s->_iov, s->_hdr.msg_iovlen, res );
+    }
+    /* Retire whole messages, then note how far into the next we got. */
+    for ( int k = s->_count; (k > 0) && (res >= 0); --k ) {
+        Msg * m = c->_outHead;
+        int left = m->_headLen + ( m->_payload ? m->_payload->_len : 0 ) -
+                m->_off;
+        if ( res < left ) {
+            m->_off += res;
+            break;
+        }
+        res -= left;
+        msgRetire( c );
+    }
+    poolFree( POOL_SEND, s );
+
+    flush( sh, sd );
+    if ( c->_paused && (c->_outBytes <= OUT_LOW) && (c->_spillBytes == 0) ) {
+        c->_paused = 0;
+        ringRead( sh, sd );
+    }
+}
+
+
+/* Takes the next free submission queue entry, submitting first if the queue
+ * is full.
+ * @param       sh, shard whose ring to use.
+ * @return      zeroed entry, or NULL if the ring has failed.
+ */
+struct io_uring_sqe * ringSqe( Shard * sh ) {
+    Ring * r = sh->_ring;
+    while ( r->_sqLocal - __atomic_load_n( r->_sqHead, __ATOMIC_ACQUIRE ) ==
+            r->_entries ) {
+        if ( (ringSubmit( r, 0 ) < 0) && (errno != EINTR) && (errno != EBUSY) &&
+                (errno != EAGAIN) ) {
+            fprintf( stderr, "SHARD %d: ERROR io_uring_enter() failed\n",
+                    sh->_index );
+            return NULL;
+        }
+    }
+    unsigned slot = r->_sqLocal++ & *r->_sqMask;
+    r->_sqArray[ slot ] = slot;
+    r->_queued += 1;
+    memset( &r->_sqes[ slot ], 0, sizeof( struct io_uring_sqe ) );
+    return &r->_sqes[ slot ];
+}
+
+
+/* Publishes queued entries and enters the kernel.
+ * @param       r, ring to submit on.
+ *              wait, 1 to wait for a completion, else 0.
+ * @return      entries submitted, or -1 with errno set.
+ * @modifies    r
+ */
+int ringSubmit( Ring * r, int wait ) {
+    __atomic_store_n( r->_sqTail, r->_sqLocal, __ATOMIC_RELEASE );
+    int rc = syscall( __NR_io_uring_enter, r->_fd, r->_queued, wait, ( wait ?
+            IORING_ENTER_GETEVENTS : 0 ), NULL, 0 );
+    if ( rc > 0 ) { r->_queued -= rc; }
+    return rc;
+}
+
+
+/* Helper to key a request's sender. TCP clients are keyed by connection
+ * number, which unlike the descriptor is never reused; UDP clients by address
+ * and port, with the top bit set so the two cannot collide.
+ * @param       sd, TCP client socket (ignored for UDP).
+ *              client, UDP client address, or NULL for TCP.
+ * @return      sender key.
+ */
+unsigned long senderKey( int sd, struct sockaddr_in * client ) {
+    if ( client == NULL ) { return conns[sd]._id; }
+    return ( 1UL << 63 ) | ( (unsigned long)ntohl( client->sin_addr.s_addr ) <<
+            16 ) | ntohs( client->sin_port );
+}
+
+
+/* Inbox handler; sends messages other shards left for this shard's clients.
+ * @param       sh, shard whose eventfd fired.
+ */
+void serveInbox( Shard * sh ) {
+    uint64_t count;
+    __atomic_store_n( &sh->_signalled, 0, __ATOMIC_RELEASE );
+    while ( read( sh->_eventSd, &count, sizeof( count ) ) > 0 ) {}
+
+    /* enqueue() skips clients that left, even if the descriptor was reused. */
+    Msg * m;
+    while ( ( m = pop( &sh->_inbox ) ) != NULL ) {
+        METRIC_ADD( sh, METRIC_INBOX, -1 );
+        enqueue( sh, m );
+    }
+
+    /* The store thread also wakes the shard once its OKs are durable. */
+    if ( sh->_numAcks > 0 ) { storeAcks( sh ); }
+}
+
+
+/* TCP client handler; edge-triggered, so reads until the socket is drained.
+ * @param       sh, shard owning the client.
+ *              sd, client socket with data or a hangup pending.
+ */
+void serveTcp( Shard * sh, int sd ) {
+    while ( 1 ) {
+        if ( conns[sd]._paused || (conns[sd]._outBytes > OUT_HIGH) ||
+                (conns[sd]._spillBytes > 0) ) {
+            /* backed up :: leave input in the socket until EPOLLOUT drains */
+            conns[sd]._paused = 1;
+            return;
+        }
+
+        if ( conns[sd]._share ) {
+            /* SHARE in progress :: socket bytes belong to the file */
+            int n = share( sh, sd, NULL, 0 );
+            if ( n > 0 ) {
+                conns[sd]._seen = sh->_tick;
+                METRIC_ADD( sh, METRIC_TCP_IN, n );
+                continue;
+            }
+            if ( (n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ) {
+                return;
+            }
+            if ( (n < 0) && (errno == EINTR) ) { continue; }
+            disconnect( sh, sd );
+            return;
+        }
+
+        Parser * p = &conns[sd]._in;
+        int tcpIn = recv( sd, p->_buf + p->_len, IN_MAX - p->_len, 0 );
+        if ( tcpIn > 0 ) {
+            conns[sd]._seen = sh->_tick;
+            METRIC_ADD( sh, METRIC_TCP_IN, tcpIn );
+            if ( captureFd >= 0 ) {
+                struct iovec iov = { p->_buf + p->_len, tcpIn };
+                trace( sh, TRACE_IN, conns[sd]._id, &iov, 1, tcpIn );
+            }
+            p->_len += tcpIn;
+            consume( sh, sd );
+        } else if ( (tcpIn < 0) && ((errno == EAGAIN) || (errno ==
+                EWOULDBLOCK)) ) {
+            return;
+        } else if ( (tcpIn < 0) && (errno == EINTR) ) {
+            continue;
+        } else {
+            /* tcpIn == 0 or error :: client is gone */
+            disconnect( sh, sd );
+            return;
+        }
+    }
+}
+
+
+/* UDP handler; edge-triggered, so reads until the socket is drained.
+ * @param       sh, shard whose UDP socket is readable.
+ */
+void serveUdp( Shard * sh ) {
+    Batch * rx = sh->_rx;
+    char addr[ INET_ADDRSTRLEN ];
+    while ( 1 ) {
+        for ( int i = 0; i < UDP_BATCH; ++i ) {
+            rx->_msgs[i].msg_hdr.msg_namelen = sizeof( rx->_addr[i] );
+        }
+        int count = recvmmsg( sh->_udpSd, rx->_msgs, UDP_BATCH, MSG_DONTWAIT,
+                NULL );
+        if ( count < 0 ) {
+            if ( errno == EINTR ) { continue; }
+            if ( (errno != EAGAIN) && (errno != EWOULDBLOCK) ) {
+                fprintf( stderr, "SHARD %d: ERROR UDP recvmmsg() failed\n",
+                        sh->_index );
+            }
+            break;
+        }
+
+        for ( int i = 0; i < count; ++i ) {
+            int udpIn = rx->_msgs[i].msg_len;
+            METRIC_ADD( sh, METRIC_UDP_IN, 1 );
+            METRIC_ADD( sh, METRIC_UDP_IN_BYTES, udpIn );
+            printf( "SHARD %d: Rcvd incoming UDP datagram from: %s\n",
+                    sh->_index, inet_ntop( AF_INET, &rx->_addr[i].sin_addr, addr,
+                    sizeof( addr ) ) );
+            if ( captureFd >= 0 ) {
+                struct iovec iov = { rx->_data[i], udpIn };
+                trace( sh, TRACE_UDP_IN, senderKey( 0, &rx->_addr[i] ), &iov, 1,
+                        udpIn );
+            }
+            rx->_data[i][ udpIn ] = '\0';
+            Parser p = { ._len = udpIn };
+            handle( sh, sh->_udpSd, &rx->_addr[i], &p, rx->_data[i], udpIn );
+        }
+        udpFlush( sh );
+        if ( count < UDP_BATCH ) { break; }
+    }
+}
+
+
+/* SHARE body handler; moves the next piece of the file from the client to
+ * the spool with splice(), through a pipe, and passes it on to the recipient
+ * as it arrives.
+ * @param       sh, shard owning the client.
+ *              sd, client socket.
+ *              data, bytes of the body already read with the command, or NULL
+ *                to splice from the socket.
+ *              len, number of bytes in data.
+ * @return      bytes moved, 0 on EOF, or -1 with errno set.
+ * @modifies    conns
+ */
+int share( Shard * sh, int sd, const char * data, int len ) {
+    Share * x = conns[sd]._share;
+    int n;
+    if ( data ) {
+        n = pwrite( x->_spool->_fd, data, ( (len < x->_left) ? len : x->_left ),
+                x->_len );
+    } else {
+        n = splice( sd, NULL, x->_pipe[1], NULL, ( (x->_left < SHARE_CHUNK) ?
+                x->_left : SHARE_CHUNK ), SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+        for ( int moved = 0; moved < n; ) {
+            loff_t off = x->_len + moved;
+            int m = splice( x->_pipe[0], NULL, x->_spool->_fd, &off, n - moved,
+                    SPLICE_F_MOVE );
+            if ( m <= 0 ) {
+                fprintf( stderr, "SHARD %d: ERROR spool splice() failed\n",
+                        sh->_index );
+                return -1;
+            }
+            moved += m;
+        }
+        if ( (captureFd >= 0) && (n > 0) ) {
+            traceSpool( sh, TRACE_IN, conns[sd]._id, x->_spool->_fd, x->_len, n );
+        }
+    }
+    if ( n <= 0 ) { return n; }
+
+    Payload * p = payloadSpooled( x->_spool, x->_len, n );
+    if ( p ) {
+        deliver( sh, &x->_to, x->_head, x->_headLen, p );
+        payloadRelease( p );
+        x->_headLen = 0;
+    } else {
+        fprintf( stderr, "SHARD %d: ERROR malloc() failed\n", sh->_index );
+    }
+
+    x->_len += n;                               x->_left -= n;
+    if ( x->_left == 0 ) { shareEnd( &conns[sd] ); }
+    return n;
+}
+
+
+/* Ends a SHARE, whether finished or cut short.
+ * @param       c, connection of the sending client.
+ * @modifies    c
+ */
+void shareEnd( Conn * c ) {
+    Share * x = c->_share;
+    close( x->_pipe[0] );                       close( x->_pipe[1] );
+    spoolRelease( x->_spool );
+    free( x );
+    c->_share = NULL;
+}
+
+
+/* Spool constructor; the file is unlinked from the start.
+ * @return      spool with one reference, or NULL on failure.
+ */
+Spool * spoolNew( void ) {
+    Spool * spool = malloc( sizeof( Spool ) );
+    if ( spool == NULL ) { return NULL; }
+
+    spool->_refs = 1;
+    spool->_fd = open( P_tmpdir, O_TMPFILE | O_RDWR, 0600 );
+    if ( spool->_fd < 0 ) {
+        /* no O_TMPFILE support :: make a file and unlink it */
+        char name[] = P_tmpdir "/shareXXXXXX";
+        if ( ( spool->_fd = mkstemp( name ) ) >= 0 ) { unlink( name ); }
+    }
+    if ( spool->_fd < 0 ) {
+        free( spool );
+        return NULL;
+    }
+    return spool;
+}
+
+
+/* Drops a spool reference, closing it with the last one.
+ * @param       spool, spool to release.
+ */
+void spoolRelease( Spool * spool ) {
+    if ( __atomic_sub_fetch( &spool->_refs, 1, __ATOMIC_ACQ_REL ) == 0 ) {
+        close( spool->_fd );
+        free( spool );
+    }
+}
+
+
+/* SEND helper; parks the OK for a stored message until storeSync() has made
+ * it durable. A TCP client's goes into its output queue at once, held there
+ * so that later output cannot pass it; a UDP client's waits on the shard.
+ * @param       sh, shard the SEND arrived on.
+ *              sd, socket the SEND arrived on.
+ *              client, UDP client address, or NULL for TCP.
+ *              seq, the message's _seq.
+ * @modifies    sh, conns
+ */
+void storeAck( Shard * sh, int sd, struct sockaddr_in * client, uint64_t seq ) {
+    if ( sh->_numAcks == sh->_maxAcks ) {
+        int cap = ( (sh->_maxAcks > 0) ? (sh->_maxAcks * 2) : USER_INC );
+        Ack * tmp = realloc( sh->_acks, (cap * sizeof( Ack )) );
+        if ( tmp == NULL ) {
+            /* The message is kept either way; better an early OK than none. */
+            fprintf( stderr, "SHARD %d: ERROR realloc() failed\n", sh->_index );
+            reply( sh, sd, client, "OK\n", 3 );
+            return;
+        }
+        sh->_acks = tmp;                        sh->_maxAcks = cap;
+    }
+
+    Ack * a = &sh->_acks[ sh->_numAcks++ ];
+    *a = (Ack){ ._seq = seq, ._sd = sd };
+    if ( client ) {
+        a->_udp = 1;                            a->_addr = *client;
+        return;
+    }
+
+    a->_conn = conns[sd]._id;
+    Msg * m = msgNew( a->_conn, sd, "OK\n", 3, NULL );
+    if ( m == NULL ) {
+        fprintf( stderr, "SHARD %d: ERROR malloc() failed\n", sh->_index );
+        --sh->_numAcks;
+        return;
+    }
+    m->_commit = seq;
+    enqueue( sh, m );
+}
+
+
+/* Sends the parked OKs whose messages storeSync() has made durable, oldest
+ * first.
+ * @param       sh, shard woken by the store thread.
+ * @modifies    sh, conns
+ */
+void storeAcks( Shard * sh ) {
+    const uint64_t synced = __atomic_load_n( &storeSynced, __ATOMIC_ACQUIRE );
+    int n = 0;
+    for ( ; (n < sh->_numAcks) && (sh->_acks[n]._seq <= synced); ++n ) {
+        Ack * a = &sh->_acks[n];
+        if ( a->_udp ) {
+            reply( sh, a->_sd, &a->_addr, "OK\n", 3 );
+        } else if ( conns[ a->_sd ]._id != a->_conn ) {
+            continue;                           /* client left, OK with it */
+        } else if ( sh->_ring ) {
+            ringDirty( sh, a->_sd );
+        } else {
+            flush( sh, a->_sd );
+        }
+    }
+    memmove( sh->_acks, sh->_acks + n, ((sh->_numAcks - n) * sizeof( Ack )) );
+    sh->_numAcks -= n;
+}
+
+
+/* Offline store append; storeLock must be held. Rolls over to a new segment
+ * when the last one is full.
+ * @param       type, STORE_MSG or STORE_DONE.
+ *              seq, the record's _seq.
+ *              to, from, recipient and sender userids.
+ *              body, bodyLen, message body.
+ *              at, set to where the record went.
+ * @return      0, or -1 if a new segment could not be made.
+ * @modifies    segs, numSegs, maxSegs
+ */
+int storeAppend( int type, uint64_t seq, const char * to, const char * from,
+        const char * body, int bodyLen, StoreRef * at ) {
+    const int toLen = strlen( to ), fromLen = strlen( from );
+    const unsigned int len = ( (sizeof( StoreRec ) + toLen + fromLen + bodyLen +
+            7) & ~7u );
+    Segment * seg = &segs[ numSegs - 1 ];
+    if ( (seg->_tail + len > STORE_SEG) && ( (seg = storeSegment( seg->_num + 1,
+            1 )) == NULL ) ) {
+        return -1;
+    }
+
+    StoreRec * r = (StoreRec *)( seg->_map + seg->_tail );
+    char * data = (char *)( r + 1 );
+    *r = (StoreRec){ ._len = len, ._seq = seq, ._type = type, ._bodyLen =
+            bodyLen, ._toLen = toLen, ._fromLen = fromLen };
+    memcpy( data, to, toLen );
+    memcpy( data + toLen, from, fromLen );
+    memcpy( data + toLen + fromLen, body, bodyLen );
+    memset( data + toLen + fromLen + bodyLen, 0, len - sizeof( StoreRec ) -
+            toLen - fromLen - bodyLen );
+    r->_sum = storeSum( r );
+
+    *at = (StoreRef){ seg->_num, seg->_tail };
+    seg->_tail += len;
+    if ( type == STORE_MSG ) {
+        ++seg->_live;
+        seg->_liveBytes += len;
+    }
+    return 0;
+}
+
+
+/* Mailbox lookup; storeLock must be held, or the store not yet running.
+ * @param       id, recipient userid.
+ *              create, nonzero to add an empty mailbox if there is none.
+ * @return      index into boxes, or -1.
+ * @modifies    boxes, numBoxes, maxBoxes, byBox
+ */
+int storeBox( const char * id, int create ) {
+    int b = indexFind( &byBox, hashId( id ), matchBox, id );
+    if ( (b >= 0) || !create ) { return b; }
+
+    if ( numBoxes == maxBoxes ) {
+        unsigned int cap = ( (maxBoxes > 0) ? (maxBoxes * 2) : USER_INC );
+        Mailbox * tmp = realloc( boxes, (cap * sizeof( Mailbox )) );
+        if ( tmp == NULL ) { return -1; }
+        boxes = tmp;                            maxBoxes = cap;
+    }
+    b = numBoxes;
+    boxes[b] = (Mailbox){ ._refs = NULL };
+    snprintf( boxes[b]._id, sizeof( boxes[b]._id ), "%s", id );
+    if ( indexInsert( &byBox, b, boxHashOf ) < 0 ) { return -1; }
+    ++numBoxes;
+    return b;
+}
+
+
+/* LOGIN helper; usersLock must be held for writing, so that nothing sent to
+ * the user can pass what was kept for it.
+ * @param       sh, shard the user logged in on.
+ *              slot, index into users of the user.
+ * @modifies    boxes, segs
+ * @effects     delivers and forgets the user's stored messages, and logs a
+ *                STORE_DONE record for them.
+ */
+void storeDeliver( Shard * sh, int slot ) {
+    const char * id = users[ slot ]._id;
+    pthread_mutex_lock( &storeLock );
+        int b = storeBox( id, 0 );
+        unsigned int n = ( (b >= 0) ? boxes[b]._count : 0 );
+        uint64_t last = 0;
+        for ( unsigned int i = 0; i < n; ++i ) {
+            Segment * seg = storeSeg( boxes[b]._refs[i]._seg );
+            StoreRec * r = (StoreRec *)( seg->_map + boxes[b]._refs[i]._off );
+            const char * from = (const char *)( r + 1 ) + r->_toLen;
+            char head[ HEAD_MAX ];
+            int headLen = snprintf( head, sizeof( head ), "FROM %.*s %d ",
+                    r->_fromLen, from, r->_bodyLen );
+            Payload * pl = payloadNew( from + r->_fromLen, r->_bodyLen, "\n" );
+            if ( pl ) {
+                deliver( sh, &users[ slot ], head, headLen, pl );
+                payloadRelease( pl );
+            } else {
+                fprintf( stderr, "SHARD %d: ERROR malloc() failed\n", sh->_index );
+            }
+            last = r->_seq;
+            --seg->_live;
+            seg->_liveBytes -= r->_len;
+        }
+
+        /* A lost STORE_DONE means these come again after a restart. */
+        StoreRef at;
+        if ( (n > 0) && (storeAppend( STORE_DONE, last, id, "", "", 0, &at ) <
+                0) ) {
+            fprintf( stderr, "SHARD %d: ERROR Could not log delivery to %s\n",
+                    sh->_index, id );
+        }
+        if ( b >= 0 ) { storeDrop( b ); }
+    pthread_mutex_unlock( &storeLock );
+
+    if ( n > 0 ) {
+        METRIC_ADD( sh, METRIC_STORE_OUT, n );
+        printf( "SHARD %d: Delivered %u stored message%s to userid %s\n",
+                sh->_index, n, ( (n != 1) ? "s" : "" ), id );
+    }
+}
+
+
+/* Mailbox helper; forgets an empty mailbox, moving the last one into its
+ * place. storeLock must be held, or the store not yet running.
+ * @param       b, index into boxes of a mailbox holding nothing.
+ * @modifies    boxes, numBoxes, byBox
+ */
+void storeDrop( int b ) {
+    const int last = ( numBoxes - 1 );
+    free( boxes[b]._refs );
+    indexRemove( &byBox, b, boxHashOf );
+    if ( b != last ) {
+        /* Cannot fail :: the index has just lost an entry. */
+        indexRemove( &byBox, last, boxHashOf );
+        boxes[b] = boxes[ last ];
+        indexInsert( &byBox, b, boxHashOf );
+    }
+    --numBoxes;
+}
+
+
+/* Offline store startup: maps every segment in storeDir, oldest first, and
+ * rebuilds the mailboxes from them.
+ * @return      0, or -1 if the store could not be opened.
+ * @modifies    segs, numSegs, maxSegs, boxes, numBoxes, maxBoxes, storeSeq
+ */
+int storeOpen( void ) {
+    DIR * dir;
+    if ( ( (mkdir( storeDir, 0755 ) < 0) && (errno != EEXIST) ) || ( (dir =
+            opendir( storeDir )) == NULL ) ) {
+        fprintf( stderr, "MAIN: ERROR Could not open %s\n", storeDir );
+        return -1;
+    }
+
+    unsigned int * nums = NULL, count = 0, cap = 0;
+    struct dirent * e;
+    while ( (e = readdir( dir )) != NULL ) {
+        unsigned int num;
+        char extra;
+        if ( (strlen( e->d_name ) != 12) || (sscanf( e->d_name, "%8u.seg%c",
+                &num, &extra ) != 1) ) {
+            continue;
+        }
+        if ( count == cap ) {
+            cap = ( (cap > 0) ? (cap * 2) : 16 );
+            unsigned int * tmp = realloc( nums, (cap * sizeof( unsigned int )) );
+            if ( tmp == NULL ) {
+                fprintf( stderr, "MAIN: ERROR realloc() failed\n" );
+                closedir( dir );
+                free( nums );
+                return -1;
+            }
+            nums = tmp;
+        }
+        /* insertion sort :: segments are few */
+        unsigned int i = count++;
+        for ( ; (i > 0) && (nums[ i - 1 ] > num); --i ) { nums[i] = nums[ i - 1 ]; }
+        nums[i] = num;
+    }
+    closedir( dir );
+
+    for ( unsigned int i = 0; i < count; ++i ) {
+        Segment * seg = storeSegment( nums[i], 0 );
+        if ( seg == NULL ) {
+            free( nums );
+            return -1;
+        }
+        storeScan( seg );
+    }
+    free( nums );
+    if ( (numSegs == 0) && (storeSegment( 1, 1 ) == NULL) ) { return -1; }
+
+    /* A crash may have left part of a record after the last whole one. */
+    Segment * last = &segs[ numSegs - 1 ];
+    unsigned int end = last->_tail;
+    while ( (end < STORE_SEG) && (last->_map[ end ] == '\0') ) { ++end; }
+    if ( end < STORE_SEG ) {
+        memset( last->_map + last->_tail, 0, STORE_SEG - last->_tail );
+        msync( last->_map, STORE_SEG, MS_SYNC );
+    }
+
+    /* Boxes emptied by STORE_DONE records were needed only for the replay. */
+    for ( int b = ( numBoxes - 1 ); b >= 0; --b ) {
+        if ( boxes[b]._count == 0 ) { storeDrop( b ); }
+    }
+
+    unsigned int held = 0, waiting = numBoxes;
+    for ( unsigned int b = 0; b < numBoxes; ++b ) { held += boxes[b]._count; }
+    printf( "MAIN: Store holds %u message%s for %u userid%s in %u segment%s\n",
+            held, ( (held != 1) ? "s" : "" ), waiting, ( (waiting != 1) ? "s" :
+            "" ), numSegs, ( (numSegs != 1) ? "s" : "" ) );
+    return 0;
+}
+
+
+/* SEND helper for a recipient that is not logged in.
+ * @param       sh, shard the SEND arrived on.
+ *              from, to, sender and recipient userids.
+ *              body, bodyLen, message.
+ *              seq, set to the message's _seq if stored.
+ * @return      0 if stored, 1 if the mailbox is full or STORE_BOXES_MAX
+ *                userids already have messages held, or -1 on error.
+ * @modifies    boxes, numBoxes, byBox, segs, storeSeq, sh
+ */
+int storePut( Shard * sh, const char * from, const char * to,
+        const char * body, int bodyLen, uint64_t * seq ) {
+    int rc = -1;
+    pthread_mutex_lock( &storeLock );
+        StoreRef at;
+        int b = storeBox( to, (numBoxes < STORE_BOXES_MAX) );
+        if ( ( (b < 0) && (numBoxes >= STORE_BOXES_MAX) ) || ( (b >= 0) &&
+                (boxes[b]._count >= STORE_BOX_MAX) ) ) {
+            rc = 1;
+        } else if ( (b >= 0) && (storeRoom( b ) == 0) && (storeAppend( STORE_MSG,
+                storeSeq, to, from, body, bodyLen, &at ) == 0) ) {
+            boxes[b]._refs[ boxes[b]._count++ ] = at;
+            /* Under storeLock, so that a storeSync() pass covering seq sees
+             * that this shard waits on it. */
+            *seq = storeSeq++;
+            __atomic_store_n( &sh->_ackWant, *seq, __ATOMIC_RELEASE );
+            rc = 0;
+        }
+        if ( (rc < 0) && (b >= 0) && (boxes[b]._count == 0) ) { storeDrop( b ); }
+    pthread_mutex_unlock( &storeLock );
+
+    if ( rc == 0 ) {
+        METRIC_ADD( sh, METRIC_STORED, 1 );
+    } else if ( rc < 0 ) {
+        fprintf( stderr, "SHARD %d: ERROR Could not store message to %s\n",
+                sh->_index, to );
+    }
+    return rc;
+}
+
+
+/* Mailbox helper; makes room for one more message.
+ * @param       b, index into boxes.
+ * @return      0, or -1 if the mailbox could not grow.
+ * @modifies    boxes
+ */
+int storeRoom( int b ) {
+    if ( boxes[b]._count < boxes[b]._cap ) { return 0; }
+
+    unsigned int cap = ( (boxes[b]._cap > 0) ? (boxes[b]._cap * 2) : 8 );
+    StoreRef * tmp = realloc( boxes[b]._refs, (cap * sizeof( StoreRef )) );
+    if ( tmp == NULL ) { return -1; }
+    boxes[b]._refs = tmp;                       boxes[b]._cap = cap;
+    return 0;
+}
+
+
+/* Startup helper; replays one segment into the mailboxes, stopping at the
+ * first record that is not whole.
+ * @param       seg, segment just mapped.
+ * @modifies    seg, boxes, segs, storeSeq
+ */
+void storeScan( Segment * seg ) {
+    unsigned int off = 8;
+    while ( off + sizeof( StoreRec ) <= STORE_SEG ) {
+        StoreRec * r = (StoreRec *)( seg->_map + off );
+        if ( (r->_len < sizeof( StoreRec )) || (r->_len > STORE_SEG - off) ||
+                (r->_len & 7) || (r->_toLen == 0) || (r->_toLen > ID_MAX) ||
+                (r->_fromLen > ID_MAX) || (sizeof( StoreRec ) + r->_toLen +
+                r->_fromLen + r->_bodyLen > r->_len) || (storeSum( r ) !=
+                r->_sum) ) {
+            break;
+        }
+
+        char to[ ID_MAX + 1 ];
+        memcpy( to, r + 1, r->_toLen );
+        to[ r->_toLen ] = '\0';
+        int b = storeBox( to, (r->_type == STORE_MSG) );
+        if ( (r->_type == STORE_MSG) && (b >= 0) && (storeRoom( b ) == 0) ) {
+            /* Copies made by compaction land after newer messages, and one
+             * may outlive a crash next to its original. */
+            StoreRef * refs = boxes[b]._refs;
+            unsigned int i = boxes[b]._count;
+            uint64_t prev = 0;
+            for ( ; i > 0; --i ) {
+                Segment * at = storeSeg( refs[ i - 1 ]._seg );
+                prev = ( (StoreRec *)( at->_map + refs[ i - 1 ]._off ) )->_seq;
+                if ( prev <= r->_seq ) { break; }
+                refs[i] = refs[ i - 1 ];
+            }
+            if ( (i > 0) && (prev == r->_seq) ) {
+                memmove( &refs[i], &refs[ i + 1 ], ((boxes[b]._count - i) *
+                        sizeof( StoreRef )) );
+            } else {
+                refs[i] = (StoreRef){ seg->_num, off };
+                ++boxes[b]._count;
+                ++seg->_live;
+                seg->_liveBytes += r->_len;
+            }
+        } else if ( (r->_type == STORE_DONE) && (b >= 0) ) {
+            unsigned int keep = 0;
+            for ( unsigned int i = 0; i < boxes[b]._count; ++i ) {
+                Segment * at = storeSeg( boxes[b]._refs[i]._seg );
+                StoreRec * m = (StoreRec *)( at->_map + boxes[b]._refs[i]._off );
+                if ( m->_seq > r->_seq ) {
+                    boxes[b]._refs[ keep++ ] = boxes[b]._refs[i];
+                } else {
+                    --at->_live;
+                    at->_liveBytes -= m->_len;
+                }
+            }
+            boxes[b]._count = keep;
+        }
+
+        if ( r->_seq >= storeSeq ) { storeSeq = r->_seq + 1; }
+        off += r->_len;
+    }
+    seg->_tail = seg->_synced = off;
+}
+
+
+/* Segment lookup; storeLock must be held, or the store not yet running.
+ * @param       num, segment number.
+ * @return      the segment, or NULL if it is gone.
+ */
+Segment * storeSeg( unsigned int num ) {
+    unsigned int i = num - segs[0]._num;
+    if ( (i < numSegs) && (segs[i]._num == num) ) { return &segs[i]; }
+
+    for ( i = 0; i < numSegs; ++i ) {
+        if ( segs[i]._num == num ) { return &segs[i]; }
+    }
+    return NULL;
+}
+
+
+/* Segment setup. The file is reserved at its full size up front, so that
+ * stores through the map cannot fault on a full disk.
+ * @param       num, segment number.
+ *              create, nonzero to make a new segment, or 0 to open one.
+ * @return      the segment, added after the others, or NULL on error. Any
+ *                Segment pointer taken before the call may be stale.
+ * @modifies    segs, numSegs, maxSegs
+ */
+Segment * storeSegment( unsigned int num, int create ) {
+    if ( numSegs == maxSegs ) {
+        unsigned int cap = ( (maxSegs > 0) ? (maxSegs * 2) : 8 );
+        Segment * tmp = realloc( segs, (cap * sizeof( Segment )) );
+        if ( tmp == NULL ) {
+            fprintf( stderr, "STORE: ERROR realloc() failed\n" );
+            return NULL;
+        }
+        segs = tmp;                             maxSegs = cap;
+    }
+
+    char path[ PATH_MAX ];
+    snprintf( path, sizeof( path ), "%s/%08u.seg", storeDir, num );
+    int fd = open( path, O_RDWR | ( create ? (O_CREAT | O_EXCL) : 0 ), 0644 );
+    char * map = MAP_FAILED;
+    if ( (fd >= 0) && (posix_fallocate( fd, 0, STORE_SEG ) == 0) ) {
+        map = mmap( NULL, STORE_SEG, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    }
+    if ( (map != MAP_FAILED) && !create && (memcmp( map, STORE_MAGIC, 8 ) != 0) ) {
+        munmap( map, STORE_SEG );
+        map = MAP_FAILED;
+    }
+    if ( map == MAP_FAILED ) {
+        fprintf( stderr, "STORE: ERROR Could not open %s\n", path );
+        if ( fd >= 0 ) { close( fd ); }
+        if ( (fd >= 0) && create ) { unlink( path ); }
+        return NULL;
+    }
+
+    if ( create ) { memcpy( map, STORE_MAGIC, 8 ); }
+    segs[ numSegs ] = (Segment){ ._num = num, ._fd = fd, ._map = map, ._tail =
+            8, ._synced = 0 };
+    return &segs[ numSegs++ ];
+}
+
+
+/* Offline store checksum, FNV-1a over the record after _sum.
+ * @param       r, record whose _len is in bounds.
+ * @return      checksum.
+ */
+uint32_t storeSum( const StoreRec * r ) {
+    const unsigned char * b = (const unsigned char *)&r->_seq;
+    const unsigned char * end = (const unsigned char *)r + r->_len;
+    uint32_t h = 2166136261u;
+    for ( ; b < end; ++b ) { h = ( (h ^ *b) * 16777619u ); }
+    return h;
+}
+
+
+/* Group commit; makes everything appended since the last call durable, with
+ * one msync() per segment written to, then wakes the shards whose parked OKs
+ * it covers. Only the store thread calls it.
+ * @modifies    segs, storeSynced
+ */
+void storeSync( void ) {
+    const unsigned int page = sysconf( _SC_PAGESIZE );
+    uint64_t upTo = 0;
+    int failed = 0;
+    for ( unsigned int i = 0; ; ++i ) {
+        pthread_mutex_lock( &storeLock );
+            /* Every _seq handed out so far lies before the tails read next. */
+            if ( i == 0 ) { upTo = ( storeSeq - 1 ); }
+            if ( i >= numSegs ) {
+                pthread_mutex_unlock( &storeLock );
+                break;
+            }
+            char * map = segs[i]._map;
+            unsigned int from = ( segs[i]._synced & ~(page - 1) ),
+                    to = segs[i]._tail;
+            const int dirty = ( segs[i]._synced < to );
+            segs[i]._synced = to;
+        pthread_mutex_unlock( &storeLock );
+
+        /* Appends go on while this waits for the disk. */
+        if ( dirty && (msync( map + from, to - from, MS_SYNC ) < 0) ) {
+            /* Tried again next time; the OKs wait until it works. */
+            fprintf( stderr, "STORE: ERROR msync() failed\n" );
+            pthread_mutex_lock( &storeLock );
+                if ( segs[i]._synced > from ) { segs[i]._synced = from; }
+            pthread_mutex_unlock( &storeLock );
+            failed = 1;
+        }
+    }
+    if ( failed ) { return; }
+
+    const uint64_t prev = __atomic_exchange_n( &storeSynced, upTo,
+            __ATOMIC_ACQ_REL );
+    for ( unsigned int i = 0; (upTo > prev) && (i < numShards); ++i ) {
+        Shard * sh = &shards[i];
+        uint64_t one = 1;
+        if ( (__atomic_load_n( &sh->_ackWant, __ATOMIC_ACQUIRE ) > prev) &&
+                !__atomic_exchange_n( &sh->_signalled, 1, __ATOMIC_ACQ_REL ) &&
+                (write( sh->_eventSd, &one, sizeof( one ) ) < 0) ) {
+            fprintf( stderr, "STORE: ERROR eventfd write() failed\n" );
+        }
+    }
+}
+
+
+/* Store thread; commits every STORE_SYNC_MS, then compacts and deletes old
+ * segments.
+ * @param       ptr, unused.
+ * @return      never returns.
+ * @modifies    segs, numSegs, boxes
+ */
+void * storeThread( void * ptr ) {
+    const struct timespec pause = { 0, STORE_SYNC_MS * 1000000L };
+    while ( 1 ) {
+        nanosleep( &pause, NULL );
+
+        /* A sparse oldest segment has its few messages copied forward, with
+         * their _seq, so that it can go. */
+        pthread_mutex_lock( &storeLock );
+        if ( (numSegs > 1) && (segs[0]._live > 0) && (segs[0]._liveBytes <=
+                STORE_SEG / 4) ) {
+            const unsigned int old = segs[0]._num;
+            int failed = 0;
+            for ( unsigned int b = 0; !failed && (b < numBoxes); ++b ) {
+                for ( unsigned int i = 0; !failed && (i < boxes[b]._count); ++i ) {
+                    if ( boxes[b]._refs[i]._seg != old ) { continue; }
+
+                    StoreRec * r = (StoreRec *)( segs[0]._map +
+                            boxes[b]._refs[i]._off );
+                    char from[ ID_MAX + 1 ];
+                    memcpy( from, (char *)( r + 1 ) + r->_toLen, r->_fromLen );
+                    from[ r->_fromLen ] = '\0';
+                    StoreRef at;
+                    failed = ( storeAppend( STORE_MSG, r->_seq, boxes[b]._id,
+                            from, (char *)( r + 1 ) + r->_toLen + r->_fromLen,
+                            r->_bodyLen, &at ) < 0 );
+                    if ( failed ) { break; }
+                    --segs[0]._live;
+                    segs[0]._liveBytes -= r->_len;
+                    boxes[b]._refs[i] = at;
+                }
+            }
+        }
+        pthread_mutex_unlock( &storeLock );
+
+        storeSync();
+
+        /* Copies are durable now, so empty segments can go. */
+        pthread_mutex_lock( &storeLock );
+        while ( (numSegs > 1) && (segs[0]._live == 0) ) {
+            char path[ PATH_MAX ];
+            snprintf( path, sizeof( path ), "%s/%08u.seg", storeDir,
+                    segs[0]._num );
+            munmap( segs[0]._map, STORE_SEG );
+            close( segs[0]._fd );
+            if ( unlink( path ) < 0 ) {
+                fprintf( stderr, "STORE: ERROR Could not remove %s\n", path );
+            }
+            memmove( &segs[0], &segs[1], (--numSegs * sizeof( Segment )) );
+        }
+        pthread_mutex_unlock( &storeLock );
+    }
+    return ptr;
+}
+
+
+/* Clock for the timing wheels.
+ * @return      CLOCK_MONOTONIC in ticks of TICK_MS.
+ */
+unsigned long tickNow( void ) {
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return ( (unsigned long)now.tv_sec * 1000 + now.tv_nsec / 1000000 ) / TICK_MS;
+}
+
+
+/* Timer arm or re-arm; only the shard whose wheel holds it may call this.
+ * @param       sh, shard owning the timer.
+ *              t, timer, armed or not.
+ *              due, tick at which it fires; one already past fires next tick.
+ * @modifies    sh, t
+ */
+void timerArm( Shard * sh, Timer * t, unsigned long due ) {
+    timerCancel( t );
+    if ( due <= sh->_tick ) { due = sh->_tick + 1; }
+    Timer * head = &sh->_wheel[ due & (WHEEL_SLOTS - 1) ];
+    t->_due = due;
+    t->_next = head->_next;                     t->_prev = head;
+    head->_next->_prev = t;                     head->_next = t;
+}
+
+
+/* Timer cancel; a timer not armed is left alone.
+ * @param       t, timer.
+ * @modifies    t
+ */
+void timerCancel( Timer * t ) {
+    if ( t->_next ) {
+        t->_prev->_next = t->_next;             t->_next->_prev = t->_prev;
+        t->_next = t->_prev = NULL;
+    }
+}
+
+
+/* Timer handler. The deadline is checked against when the client was last
+ * seen, and pushed back if it has been seen since the timer was armed.
+ * @param       sh, shard owning the timer.
+ *              t, timer that came due, no longer armed.
+ * @modifies    users, conns
+ * @effects     disconnects an idle or stalled TCP client, logs out a UDP user
+ *                gone quiet, or frees the timer of one that has left; or
+ *                writes the --stats dump.
+ */
+void timerExpire( Shard * sh, Timer * t ) {
+    if ( t->_sd == TIMER_METRICS ) {
+        metricsDump();
+        timerArm( sh, t, sh->_tick + METRICS_SECS * 1000 / TICK_MS );
+        return;
+    } else if ( t->_sd >= 0 ) {
+        /* A backed up client is not read, so it cannot be idle, unless it
+         * has been cut off. */
+        Conn * c = &conns[ t->_sd ];
+        const int sharing = ( c->_share && shareTicks );
+        const long limit = ( sharing ? shareTicks : idleTicks );
+        if ( limit == 0 ) { return; }
+        if ( c->_paused && (c->_over != 2) ) { c->_seen = sh->_tick; }
+        if ( (long)( sh->_tick - c->_seen ) < limit ) {
+            timerArm( sh, t, c->_seen + limit );
+            return;
+        }
+        printf( ( sharing ? "SHARD %d: SHARE timed out\n" :
+                "SHARD %d: Disconnecting idle client\n" ), sh->_index );
+        METRIC_ADD( sh, METRIC_TIMEOUTS, 1 );
+        disconnect( sh, t->_sd );
+        return;
+    }
+
+    /* t->_sd == TIMER_UDP :: UDP login, which may have ended or been replaced; other
+     * shards stamp _seen with ticks of their own, which may run ahead. */
+    pthread_rwlock_rdlock( &usersLock );
+        int i = indexFind( &byKey, hashKey( t->_key ), matchKey, &t->_key );
+        int live = ( (i >= 0) && (users[i]._conn == t->_login) );
+        unsigned long seen = ( live ? __atomic_load_n( &users[i]._seen,
+                __ATOMIC_RELAXED ) : 0 );
+    pthread_rwlock_unlock( &usersLock );
+    if ( live && ((long)( sh->_tick - seen ) < (long)udpTicks) ) {
+        timerArm( sh, t, seen + udpTicks );
+        return;
+    }
+
+    if ( live ) {
+        pthread_rwlock_wrlock( &usersLock );
+            i = indexFind( &byKey, hashKey( t->_key ), matchKey, &t->_key );
+            live = ( (i >= 0) && (users[i]._conn == t->_login) );
+            seen = ( live ? __atomic_load_n( &users[i]._seen,
+                    __ATOMIC_RELAXED ) : 0 );
+            if ( live && ((long)( sh->_tick - seen ) >= (long)udpTicks) ) {
+                printf( "SHARD %d: UDP login for userid %s expired\n", sh->_index,
+                        users[i]._id );
+                logout( i );
+                METRIC_ADD( sh, METRIC_TIMEOUTS, 1 );
+                live = 0;
+            }
+        pthread_rwlock_unlock( &usersLock );
+        if ( live ) {
+            /* seen while we waited for the lock */
+            timerArm( sh, t, seen + udpTicks );
+            return;
+        }
+    }
+    free( t );
+}
+
+
+/* Timerfd handler; runs the wheel up to the present, one slot per tick. A
+ * slot's list is taken whole first, so timers re-armed while it runs wait
+ * for their own tick.
+ * @param       sh, shard whose timerfd fired.
+ * @modifies    sh
+ */
+void timerTick( Shard * sh ) {
+    uint64_t count;
+    if ( (read( sh->_timerSd, &count, sizeof( count ) ) < 0) && (errno !=
+            EAGAIN) ) {
+        fprintf( stderr, "SHARD %d: ERROR timerfd read() failed\n", sh->_index );
+    }
+
+    const unsigned long now = tickNow();
+    while ( sh->_tick < now ) {
+        Timer * head = &sh->_wheel[ ++sh->_tick & (WHEEL_SLOTS - 1) ];
+        if ( head->_next == head ) { continue; }
+        Timer list = { ._next = head->_next, ._prev = head->_prev };
+        list._next->_prev = list._prev->_next = &list;
+        head->_next = head->_prev = head;
+
+        while ( list._next != &list ) {
+            Timer * t = list._next;
+            timerCancel( t );
+            if ( t->_due > sh->_tick ) {
+                /* due on a later lap of the wheel */
+                timerArm( sh, t, t->_due );
+            } else {
+                timerExpire( sh, t );
+            }
+        }
+    }
+}
+
+
+/* Capture helper; appends a record to the shard's trace buffer, or writes
+ * it straight out if it will not fit.
+ * @param       sh, calling shard.
+ *              type, TRACE_OPEN ... TRACE_UDP_OUT.
+ *              conn, connection number or senderKey().
+ *              iov, pieces of the data, or NULL.
+ *              n, number of pieces.
+ *              len, bytes of data to take from iov, which may hold more.
+ * @modifies    sh
+ */
+void trace( Shard * sh, int type, unsigned long conn, const struct iovec * iov,
+        int n, size_t len ) {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    TraceRec rec = { ._ns = ( (ts.tv_sec - captureStart.tv_sec) * 1000000000LL )
+            + (ts.tv_nsec - captureStart.tv_nsec), ._conn = conn, ._len = len,
+            ._type = type, ._shard = sh->_index };
+
+    if ( sh->_traceLen + sizeof( rec ) + len > TRACE_BUF ) { traceFlush( sh ); }
+    if ( sizeof( rec ) + len > TRACE_BUF ) {
+        /* Too big to buffer :: one write, so the record stays whole. */
+        struct iovec out[ 1 + (2 * FLUSH_MAX) ] = { { &rec, sizeof( rec ) } };
+        int k = 1;
+        for ( size_t left = len; (left > 0) && (k <= n); ++k ) {
+            out[k] = iov[ k - 1 ];
+            if ( out[k].iov_len > left ) { out[k].iov_len = left; }
+            left -= out[k].iov_len;
+        }
+        if ( writev( captureFd, out, k ) != (ssize_t)( sizeof( rec ) + len ) ) {
+            fprintf( stderr, "SHARD %d: ERROR capture write() failed\n",
+                    sh->_index );
+        }
+        return;
+    }
+
+    memcpy( sh->_trace + sh->_traceLen, &rec, sizeof( rec ) );
+    sh->_traceLen += sizeof( rec );
+    for ( int i = 0; (len > 0) && (i < n); ++i ) {
+        size_t piece = ( (iov[i].iov_len < len) ? iov[i].iov_len : len );
+        memcpy( sh->_trace + sh->_traceLen, iov[i].iov_base, piece );
+        sh->_traceLen += piece;                 len -= piece;
+    }
+}
+
+
+/* Writes out a shard's buffered capture records. The trace file is opened
+ * O_APPEND, so each write lands whole; replay.c puts the records of
+ * different shards back in time order.
+ * @param       sh, calling shard.
+ * @modifies    sh
+ */
+void traceFlush( Shard * sh ) {
+    if ( (sh->_traceLen > 0) && (write( captureFd, sh->_trace, sh->_traceLen )
+            != sh->_traceLen) ) {
+        fprintf( stderr, "SHARD %d: ERROR capture write() failed\n", sh->_index );
+    }
+    sh->_traceLen = 0;
+}
+
+
+/* Capture helper for SHARE bytes, which never pass through user space on
+ * their way into or out of a spool; they are read back for the trace.
+ * @param       sh, calling shard.
+ *              type, TRACE_IN or TRACE_OUT.
+ *              conn, connection number of the TCP client.
+ *              fd, spool holding the bytes.
+ *              off, offset of the bytes in the spool.
+ *              len, number of bytes.
+ * @modifies    sh
+ */
+void traceSpool( Shard * sh, int type, unsigned long conn, int fd, off_t off,
+        size_t len ) {
+    char buffer[ 8192 ];
+    while ( len > 0 ) {
+        ssize_t n = pread( fd, buffer, ( (len < sizeof( buffer )) ? len :
+                sizeof( buffer ) ), off );
+        if ( n <= 0 ) {
+            fprintf( stderr, "SHARD %d: ERROR capture pread() failed\n",
+                    sh->_index );
+            return;
+        }
+        struct iovec iov = { buffer, n };
+        trace( sh, type, conn, &iov, 1, n );
+        off += n;                               len -= n;
+    }
+}
+
+
+/* Sends every queued UDP reply, as few sendmmsg() calls as it takes.
+ * @param       sh, shard whose replies to send.
+ * @modifies    sh
+ */
+void udpFlush( Shard * sh ) {
+    Batch * tx = sh->_tx;
+    for ( int done = 0; done < tx->_count; ) {
+        int sent = sendmmsg( sh->_udpSd, tx->_msgs + done, tx->_count - done, 0 );
+        if ( sent < 0 ) {
+            if ( errno == EINTR ) { continue; }
+            /* drop the datagram that failed, as sendto() would have */
+            fprintf( stderr, "SHARD %d: ERROR UDP sendmmsg() failed\n",
+                    sh->_index );
+            sent = 1;
+        }
+        done += sent;
+    }
+    tx->_count = 0;
+}
+
+
+/* Queues a UDP datagram for the next udpFlush(). One too large for a slot
+ * goes out at once, after whatever is already queued.
+ * @param       sh, calling shard.
+ *              to, recipient address.
+ *              iov, pieces of the datagram.
+ *              n, number of pieces.
+ * @modifies    sh
+ */
+void udpSend( Shard * sh, struct sockaddr_in * to, const struct iovec * iov,
+        int n ) {
+    Batch * tx = sh->_tx;
+    size_t len = 0;
+    for ( int i = 0; i < n; ++i ) { len += iov[i].iov_len; }
+    METRIC_ADD( sh, METRIC_UDP_OUT, 1 );
+    METRIC_ADD( sh, METRIC_UDP_OUT_BYTES, len );
+    if ( captureFd >= 0 ) {
+        trace( sh, TRACE_UDP_OUT, senderKey( 0, to ), iov, n, len );
+    }
+
+    if ( (len > UDP_SLOT) || (tx->_count == UDP_BATCH) ) { udpFlush( sh ); }
+    if ( len > UDP_SLOT ) {
+        struct msghdr hdr = { .msg_name = to, .msg_namelen = sizeof( *to ),
+                              .msg_iov = (struct iovec *)iov, .msg_iovlen = n };
+        if ( sendmsg( sh->_udpSd, &hdr, 0 ) < 0 ) {
+            fprintf( stderr, "SHARD %d: ERROR UDP sendmsg() failed\n",
+                    sh->_index );
+        }
+        return;
+    }
+
+    int slot = tx->_count++;
+    char * at = tx->_data[ slot ];
+    for ( int i = 0; i < n; ++i ) {
+        memcpy( at, iov[i].iov_base, iov[i].iov_len );
+        at += iov[i].iov_len;
+    }
+    tx->_addr[ slot ] = *to;
+    tx->_iov[ slot ].iov_len = len;
+}
+
+
+/* Userid check, shared by LOGIN and the offline store.
+ * @param       id, userid to check.
+ * @return      nonzero if id is ID_MIN to ID_MAX letters and digits.
+ */
+int validId( const char * id ) {
+    int valid = ( (strlen( id ) >= ID_MIN) && (strlen( id ) <= ID_MAX) );
+    for ( int i = 0; valid && (id[i] != '\0'); ++i ) {
+        valid = isalnum( (unsigned char)id[i] );
+    }
+    return valid;
+}
+
+
+/* Helper to add a socket to a shard's epoll set, edge-triggered.
+ * @param       sh, shard to watch from.
+ *              sd, non-blocking socket to watch.
+ *              events, events to watch for.
+ */
+void watch( Shard * sh, int sd, uint32_t events ) {
+    struct epoll_event ev = { .events = ( events | EPOLLET ), .data.fd = sd };
+    if ( epoll_ctl( sh->_epollSd, EPOLL_CTL_ADD, sd, &ev ) < 0 ) {
+        fprintf( stderr, "SHARD %d: ERROR epoll_ctl() failed\n", sh->_index );
+    }
+}
+
+
+/* WHO reply helper; builds the cached reply if there is none.
+ * @return      referenced reply, to be passed to whoRelease(), or NULL if it
+ *                could not be built.
+ */
+Who * whoGet( void ) {
+    pthread_rwlock_rdlock( &usersLock );
+    Who * w = who;
+    if ( w ) {
+        __atomic_add_fetch( &w->_refs, 1, __ATOMIC_RELAXED );
+        pthread_rwlock_unlock( &usersLock );
+        return w;
+    }
+    pthread_rwlock_unlock( &usersLock );
+
+    pthread_rwlock_wrlock( &usersLock );
+    if ( who == NULL ) {
+        int cap = 3 + ( (ID_MAX + 1) * numUsers ) + 1;
+        if ( ( who = malloc( sizeof( Who ) + cap ) ) != NULL ) {
+            who->_refs = 1;                     who->_cap = cap;
+            who->_version = whoVersion;
+            who->_len = sprintf( who->_data, "OK\n" );
+            for ( unsigned int i = 0; i < numUsers; ++i ) {
+                const char * id = users[ sortedUsers[i] ]._id;
+                int idLen = strlen( id );
+                memcpy( who->_data + who->_len, id, idLen );
+                who->_data[ who->_len + idLen ] = '\n';
+                who->_len += idLen + 1;
+            }
+        }
+    }
+    if ( ( w = who ) != NULL ) {
+        __atomic_add_fetch( &w->_refs, 1, __ATOMIC_RELAXED );
+    }
+    pthread_rwlock_unlock( &usersLock );
+    return w;
+}
+
+
+/* Drops a reference to a WHO reply, freeing it with the last one.
+ * @param       w, reply from whoGet().
+ */
+void whoRelease( Who * w ) {
+    if ( __atomic_sub_fetch( &w->_refs, 1, __ATOMIC_ACQ_REL ) == 0 ) {
+        free( w );
+    }
+}
+
+
+/* Keeps the cached WHO reply in step with the directory; usersLock must be
+ * held for writing. The edit is made in place unless a WHO in flight still
+ * holds the reply, in which case it is copied first. If memory runs out the
+ * cache is dropped, to be rebuilt by the next WHO.
+ * @param       pos, position of id in sortedUsers.
+ *              id, userid added or removed.
+ *              insert, nonzero for LOGIN, zero for LOGOUT.
+ * @modifies    who, whoVersion
+ */
+void whoUpdate( int pos, const char * id, int insert ) {
+    ++whoVersion;
+    if ( who == NULL ) { return; }
+
+    const int idLen = strlen( id ) + 1;
+    int len = who->_len + ( insert ? idLen : -idLen );
+    Who * w = who;
+    /* One load :: a WHO in flight may drop its reference at any time. */
+    const int refs = __atomic_load_n( &w->_refs, __ATOMIC_ACQUIRE );
+    if ( (refs != 1) || (len > w->_cap) ) {
+        int cap = ( (len > w->_cap) ? (w->_cap * 2 + idLen) : w->_cap );
+        if ( refs == 1 ) {
+            w = realloc( w, sizeof( Who ) + cap );
+        } else if ( ( w = malloc( sizeof( Who ) + cap ) ) != NULL ) {
+            __atomic_store_n( &w->_refs, 1, __ATOMIC_RELAXED );
+            w->_len = who->_len;                w->_version = who->_version;
+            memcpy( w->_data, who->_data, who->_len );
+            whoRelease( who );
+        }
+        if ( w == NULL ) {
+            whoRelease( who );
+            who = NULL;
+            return;
+        }
+        w->_cap = cap;
+        who = w;
+    }
+
+    /* Skip "OK\n" and the pos userids ahead of id. */
+    char * at = w->_data + 3;
+    for ( int i = 0; i < pos; ++i ) {
+        at = (char *)memchr( at, '\n', (w->_data + w->_len) - at ) + 1;
+    }
+
+    if ( insert ) {
+        memmove( at + idLen, at, (w->_data + w->_len) - at );
+        memcpy( at, id, idLen - 1 );
+        at[ idLen - 1 ] = '\n';
+    } else {
+        /* !insert :: LOGOUT */
+        memmove( at, at + idLen, (w->_data + w->_len) - (at + idLen) );
+    }
+    w->_len = len;                              w->_version = whoVersion;
+}
+
+/* Main. -------------------------------------------------------------------- */
+
+int main( int argc, char * argv[] ) {
+    if ( (argc >= 3) && (argc <= 16) ) {
+        char * tmp;
+        tcpPort = strtol( argv[1], &tmp, 10 );
+        udpPort = strtol( argv[2], &tmp, 10 );
+        long cores = sysconf( _SC_NPROCESSORS_ONLN );
+        numShards = ( (cores > 0) ? cores : 1 );
+
+        int valid = 1, a = 3;
+        if ( (a < argc) && (strncmp( argv[a], "--", 2 ) != 0) ) {
+            numShards = strtol( argv[ a++ ], &tmp, 10 );
+            valid = ( (numShards >= 1) && (numShards <= 1024) );
+        }
+        const char * capture = NULL;
+        for ( ; valid && (a < argc); a += 2 ) {
+            if ( a + 1 == argc ) {
+                valid = 0;
+            } else if ( strcmp( argv[a], "--slow" ) == 0 ) {
+                for ( slowPolicy = 0; (slowPolicy <= SLOW_SPILL) && (strcmp(
+                        argv[ a + 1 ], slowNames[ slowPolicy ] ) != 0);
+                        ++slowPolicy ) {}
+                valid = ( slowPolicy <= SLOW_SPILL );
+            } else if ( strcmp( argv[a], "--capture" ) == 0 ) {
+                capture = argv[ a + 1 ];
+            } else if ( strcmp( argv[a], "--io" ) == 0 ) {
+                useRing = ( strcmp( argv[ a + 1 ], "uring" ) == 0 );
+                valid = ( useRing || (strcmp( argv[ a + 1 ], "epoll" ) == 0) );
+            } else if ( strcmp( argv[a], "--timeouts" ) == 0 ) {
+                long secs[3];
+                char extra;
+                valid = ( (sscanf( argv[ a + 1 ], "%ld,%ld,%ld%c", &secs[0],
+                        &secs[1], &secs[2], &extra ) == 3) && (secs[0] >= 0) &&
+                        (secs[1] >= 0) && (secs[2] >= 0) );
+                idleTicks = secs[0] * 1000 / TICK_MS;
+                udpTicks = secs[1] * 1000 / TICK_MS;
+                shareTicks = secs[2] * 1000 / TICK_MS;
+            } else if ( strcmp( argv[a], "--stats" ) == 0 ) {
+                metricsFile = argv[ a + 1 ];
+            } else if ( strcmp( argv[a], "--store" ) == 0 ) {
+                storeDir = argv[ a + 1 ];
+            } else {
+                valid = 0;
+            }
+        }
+        if ( !valid ) {
+            fprintf( stderr, "MAIN: ERROR Invalid argument(s)\n" );
+            fprintf( stderr, "MAIN: USAGE a.out <tcp-port> <udp-port> "
+                    "[<reactors>] [--slow drop|disconnect|spill] "
+                    "[--capture <trace-file>] [--io epoll|uring] "
+                    "[--timeouts <idle>,<udp>,<share>] [--stats <dump-file>] "
+                    "[--store <directory>]\n" );
+            return EXIT_FAILURE;
+        }
+
+#ifdef DEBUG_MODE
+        printf( "tcp %u --- udp %u --- reactors %u --- slow %s --- io %s --- "
+                "ticks %lu,%lu,%lu\n", tcpPort, udpPort, numShards, slowNames[
+                slowPolicy ], ( useRing ? "uring" : "epoll" ), idleTicks, udpTicks,
+                shareTicks );
+#endif
+
+        clock_gettime( CLOCK_MONOTONIC, &metricsStart );
+        metricsStartClock = metricClock();
+
+        if ( storeDir && (storeOpen() < 0) ) { return EXIT_FAILURE; }
+
+        if ( useRing && !ringProbe() ) {
+            fprintf( stderr, "MAIN: ERROR io_uring not supported, using epoll\n" );
+            useRing = 0;
+        }
+
+        /* Allow as many clients as the hard descriptor limit does. */
+        struct rlimit lim;
+        if ( getrlimit( RLIMIT_NOFILE, &lim ) == 0 ) {
+            lim.rlim_cur = ( (lim.rlim_max > CONN_MAX) ? CONN_MAX : lim.rlim_max );
+            setrlimit( RLIMIT_NOFILE, &lim );
+        }
+
+        conns = calloc( CONN_MAX, sizeof( Conn ) );
+        shards = calloc( numShards, sizeof( Shard ) );
+        if ( !conns || !shards ) {
+            fprintf( stderr, "MAIN: ERROR calloc() failed\n" );
+            return EXIT_FAILURE;
+        }
+
+        if ( capture ) {
+            captureFd = open( capture, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,
+                    0644 );
+            if ( (captureFd < 0) || (write( captureFd, TRACE_MAGIC, 8 ) != 8) ) {
+                fprintf( stderr, "MAIN: ERROR Could not open %s\n", capture );
+                return EXIT_FAILURE;
+            }
+            clock_gettime( CLOCK_MONOTONIC, &captureStart );
+            for ( unsigned int i = 0; i < numShards; ++i ) {
+                if ( ( shards[i]._trace = malloc( TRACE_BUF ) ) == NULL ) {
+                    fprintf( stderr, "MAIN: ERROR malloc() failed\n" );
+                    return EXIT_FAILURE;
+                }
+            }
+        }
+
+        /* Initialize each shard's sockets; the first fixes any port 0. */
+        for ( unsigned int i = 0; i < numShards; ++i ) {
+            Shard * sh = &shards[i];
+            sh->_index = i;                     sh->_dirty = -1;
+            sh->_inbox._head = sh->_inbox._tail = &sh->_inbox._stub;
+            sh->_rx = calloc( 1, sizeof( Batch ) );
+            sh->_tx = calloc( 1, sizeof( Batch ) );
+            sh->_wheel = malloc( WHEEL_SLOTS * sizeof( Timer ) );
+            sh->_metrics = aligned_alloc( 64, sizeof( Metrics ) );
+            if ( !sh->_rx || !sh->_tx || !sh->_wheel || !sh->_metrics ) {
+                fprintf( stderr, "MAIN: ERROR calloc() failed\n" );
+                return EXIT_FAILURE;
+            }
+            memset( sh->_metrics, 0, sizeof( Metrics ) );
+            sh->_running = -1;
+            for ( int j = 0; j < WHEEL_SLOTS; ++j ) {
+                sh->_wheel[j]._next = sh->_wheel[j]._prev = &sh->_wheel[j];
+            }
+            sh->_tick = tickNow();
+            for ( int j = 0; j < UDP_BATCH; ++j ) {
+                Batch * b[2] = { sh->_rx, sh->_tx };
+                for ( int k = 0; k < 2; ++k ) {
+                    b[k]->_iov[j] = (struct iovec){ b[k]->_data[j], ( (k == 0) ?
+                            BUFFER_MAX : UDP_SLOT ) };
+                    b[k]->_msgs[j].msg_hdr = (struct msghdr){
+                            .msg_name = &b[k]->_addr[j],
+                            .msg_namelen = sizeof( b[k]->_addr[j] ),
+                            .msg_iov = &b[k]->_iov[j], .msg_iovlen = 1 };
+                }
+            }
+
+            if ( ( (sh->_tcpSd = openSocket( SOCK_STREAM, tcpPort )) < 0 ) ||
+                    ( (sh->_udpSd = openSocket( SOCK_DGRAM, udpPort )) < 0 ) ) {
+                return EXIT_FAILURE;
+            }
+
+            struct sockaddr_in server;
+            socklen_t serverLen = sizeof( server );
+            if ( getsockname( sh->_tcpSd, (struct sockaddr *)&server,
+                    &serverLen ) < 0 ) {
+                fprintf( stderr, "MAIN: ERROR TCP getsockname() failed\n" );
+                return EXIT_FAILURE;
+            }
+            tcpPort = ntohs( server.sin_port );
+
+            serverLen = sizeof( server );
+            if ( getsockname( sh->_udpSd, (struct sockaddr *)&server,
+                    &serverLen ) < 0 ) {
+                fprintf( stderr, "MAIN: ERROR UDP getsockname() failed\n" );
+                return EXIT_FAILURE;
+            }
+            udpPort = ntohs( server.sin_port );
+
+            if ( ( (sh->_epollSd = epoll_create1( 0 )) < 0 ) ||
+                    ( (sh->_eventSd = eventfd( 0, EFD_NONBLOCK )) < 0 ) ) {
+                fprintf( stderr, "MAIN: ERROR epoll/eventfd setup failed\n" );
+                return EXIT_FAILURE;
+            }
+
+            /* With every timeout and the dump off, the timerfd never starts. */
+            struct itimerspec tick = { { 0, TICK_MS * 1000000L },
+                                       { 0, TICK_MS * 1000000L } };
+            if ( ( (sh->_timerSd = timerfd_create( CLOCK_MONOTONIC,
+                    TFD_NONBLOCK )) < 0 ) || ( (idleTicks || udpTicks ||
+                    shareTicks || metricsFile) && (timerfd_settime( sh->_timerSd, 0, &tick,
+                    NULL ) < 0) ) ) {
+                fprintf( stderr, "MAIN: ERROR timerfd setup failed\n" );
+                return EXIT_FAILURE;
+            }
+            watch( sh, sh->_tcpSd, EPOLLIN );
+            watch( sh, sh->_udpSd, EPOLLIN );
+            watch( sh, sh->_eventSd, EPOLLIN );
+            watch( sh, sh->_timerSd, EPOLLIN );
+        }
+
+        /* Shard 0 takes SIGUSR1; the mask is inherited by every reactor. */
+        sigset_t mask;
+        sigemptyset( &mask );
+        sigaddset( &mask, SIGUSR1 );
+        if ( ( pthread_sigmask( SIG_BLOCK, &mask, NULL ) != 0 ) || ( (statsSd =
+                signalfd( -1, &mask, SFD_NONBLOCK )) < 0 ) ) {
+            fprintf( stderr, "MAIN: ERROR signalfd setup failed\n" );
+            return EXIT_FAILURE;
+        }
+        watch( &shards[0], statsSd, EPOLLIN );
+        if ( metricsFile ) {
+            timerArm( &shards[0], &metricsTimer, shards[0]._tick + METRICS_SECS *
+                    1000 / TICK_MS );
+        }
+
+        printf( "MAIN: Started server\n" );
+        printf( "MAIN: Listening for TCP connections on port: %d\n", tcpPort );
+        printf( "MAIN: Listening for UDP datagrams on port: %d\n", udpPort );
+        printf( "MAIN: Running %u %s reactor%s\n", numShards, ( useRing ?
+                "io_uring" : "epoll" ), ( (numShards != 1) ? "s" : "" ) );
+        fflush( stdout );
+
+        if ( storeDir ) {
+            pthread_t storeTid;
+            int rc = pthread_create( &storeTid, NULL, storeThread, NULL );
+            if ( rc != 0 ) {
+                fprintf( stderr, "MAIN: ERROR Could not create thread (%d)\n",
+                        rc );
+                return EXIT_FAILURE;
+            }
+        }
+        for ( unsigned int i = 1; i < numShards; ++i ) {
+            int rc = pthread_create( &shards[i]._tid, NULL, reactor, &shards[i] );
+            if ( rc != 0 ) {
+                fprintf( stderr, "MAIN: ERROR Could not create thread (%d)\n", rc );
+                return EXIT_FAILURE;
+            }
+        }
+        reactor( &shards[0] );
+
+        return EXIT_SUCCESS;
+    } else {
+        /* too few/many arguments */
+        fprintf( stderr, "MAIN: ERROR Invalid argument(s)\n" );
+        fprintf( stderr, "MAIN: USAGE a.out <tcp-port> <udp-port> [<reactors>] "
+                "[--slow drop|disconnect|spill] [--capture <trace-file>] "
+                "[--io epoll|uring] [--timeouts <idle>,<udp>,<share>] "
+                "[--stats <dump-file>] [--store <directory>]\n" );
+    }
+    return EXIT_FAILURE;
+}
+
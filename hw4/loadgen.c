@@ -0,0 +1,792 @@
+/* loadgen.c
+ * Griffin Melnick, melnig@rpi.edu
+ *
+ * Load generator for the homework4 chat server. The program is called using
+ *
+ *   bash$ a.out <tcp-port> <udp-port> [--tcp <n>] [--udp <n>] [--threads <t>]
+ *               [--seconds <s>] [--requests <r>] [--mix <w>,<s>,<b>,<h>,<l>]
+ *               [--seed <seed>] [--files <dir>]
+ *
+ * where <tcp-port> and <udp-port> are those of a server on this host. It opens
+ * --tcp TCP clients (1000 by default) and --udp UDP clients (16), spread over
+ * --threads epoll loops, and logs each one in. Every client then keeps one
+ * request in flight, drawn from the --mix weights for WHO, SEND, BROADCAST,
+ * SHARE and LOGOUT (a LOGOUT is followed by a fresh LOGIN), until --seconds
+ * have passed (10) or it has made --requests requests. SEND and BROADCAST
+ * bodies are slices of legend.txt; a TCP SHARE sends all of ospd.txt or
+ * sonny1978.jpg, and a UDP SHARE a slice of sonny1978.jpg that fits in one
+ * datagram. The files are read from --files, "test-files" by default.
+ *
+ * Each client draws its requests, their targets and their bodies from its own
+ * generator seeded from --seed, so the same seed replays the same workload.
+ * Latency is timed from the first byte sent to the "OK" or "ERROR" reply and
+ * kept in log-linear histograms, from which throughput and p50/p99/p999 are
+ * reported per command over the time from the start to the last reply; the
+ * up to DRAIN_NS spent waiting on stragglers afterwards is left out. A UDP
+ * request with no reply after UDP_TIMEOUT counts as a timeout and the client
+ * moves on.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Macro definitions. */
+#define BUFFER_MAX 994                          /* largest datagram */
+#define DRAIN_NS 5000000000ULL                  /* wait for replies at the end */
+#define EVENTS_MAX 256
+#define HEAD_MAX 64
+#define HIST_BUCKETS ( 61 * 16 )
+#define ID_MAX 20
+#define IN_MAX 4096                             /* TCP read buffer */
+#define MSG_MAX 990
+#define UDP_MSG_MAX 900                         /* body that fits a datagram */
+#define UDP_TIMEOUT 1000000000ULL
+#define USAGE "USAGE: a.out <tcp-port> <udp-port> [--tcp <n>] [--udp <n>] " \
+              "[--threads <t>] [--seconds <s>] [--requests <r>] " \
+              "[--mix <w>,<s>,<b>,<h>,<l>] [--seed <seed>] [--files <dir>]\n"
+
+#define CMD_LOGIN 0
+#define CMD_WHO 1
+#define CMD_SEND 2
+#define CMD_BROADCAST 3
+#define CMD_SHARE 4
+#define CMD_LOGOUT 5
+#define CMD_COUNT 6
+
+#define CONNECTING 0
+#define IDLE 1
+#define WAITING 2                               /* request in flight */
+#define DONE 3
+#define FAILED 4
+
+/* Latency histogram in nanoseconds; values under 16 have a bucket each, and
+ * every power of two above that is split into 16 buckets. */
+typedef struct {
+    unsigned long _count, _errors, _timeouts;
+    unsigned long long _sum, _max;
+    unsigned long _buckets[ HIST_BUCKETS ];
+} Hist;
+
+typedef struct {
+    int _sd, _index, _udp, _state;
+    char _id[ ID_MAX + 1 ];
+    unsigned long long _rng;
+    int _loggedIn;
+    long _issued;                               /* requests, not counting LOGIN */
+    int _cmd, _replied;                         /* request in flight */
+    unsigned long long _start;
+    char _head[ HEAD_MAX ];                     /* command line */
+    int _headLen;
+    const char * _body;
+    long _bodyLen, _off;                        /* _off bytes of head + body sent */
+    char _in[ IN_MAX ];
+    int _inLen;
+    long _skip;                                 /* delivery bytes to discard */
+} Client;
+
+typedef struct {
+    int _index, _epollSd;
+    Client ** _clients;
+    int _numClients, _active, _failed;
+    unsigned long long _sent, _rcvd;            /* bytes */
+    unsigned long long _lastReply;              /* now() at latest reply */
+    Hist _hist[ CMD_COUNT ];
+    pthread_t _tid;
+} Worker;
+
+const char * names[ CMD_COUNT ] = { "LOGIN", "WHO", "SEND", "BROADCAST", "SHARE",
+        "LOGOUT" };
+
+unsigned short tcpPort = 0, udpPort = 0;
+int numTcp = 1000, numUdp = 16, numWorkers = 1;
+long seconds = 10, requests = 0;
+unsigned long long seed = 1, stopAt = 0;
+unsigned int mix[5] = { 20, 60, 1, 1, 5 };      /* WHO SEND BROADCAST SHARE LOGOUT */
+unsigned int runTag;                            /* keeps userids apart by run */
+const char * filesDir = "test-files";
+char * legend, * ospd, * sonny;
+long legendLen, ospdLen, sonnyLen;
+Worker * workers;
+
+/* Method declarations. ----------------------------------------------------- */
+
+int bucketOf( unsigned long long ns );
+unsigned long long bucketTop( int b );
+void clientFail( Worker * w, Client * c );
+void clientStart( Worker * w, Client * c );
+void complete( Worker * w, Client * c, int ok );
+void idOf( int index, char * id );
+void issue( Worker * w, Client * c, int cmd );
+char * loadFile( const char * name, long * len );
+void nextOp( Worker * w, Client * c );
+unsigned long long now( void );
+int parseTcp( Worker * w, Client * c );
+unsigned long long percentile( Hist * h, double q );
+unsigned long long randNext( Client * c );
+void readIn( Worker * w, Client * c );
+void report( double elapsed );
+void * worker( void * ptr );
+void writeOut( Worker * w, Client * c );
+
+/* Method definitions. ------------------------------------------------------ */
+
+/* Histogram bucket of a latency.
+ * @param       ns, latency in nanoseconds.
+ * @return      bucket index.
+ */
+int bucketOf( unsigned long long ns ) {
+    if ( ns < 16 ) { return (int)ns; }
+    int e = 63 - __builtin_clzll( ns );
+    return ( (e - 3) * 16 ) + (int)( (ns >> (e - 4)) & 15 );
+}
+
+
+/* Largest latency in a histogram bucket.
+ * @param       b, bucket index.
+ * @return      latency in nanoseconds.
+ */
+unsigned long long bucketTop( int b ) {
+    if ( b < 16 ) { return b; }
+    int e = ( b / 16 ) + 3;
+    return ( (unsigned long long)( 16 + (b % 16) ) << (e - 4) ) + ( (1ULL <<
+            (e - 4)) - 1 );
+}
+
+
+/* Failure helper; drops a client whose connection broke.
+ * @param       w, worker owning the client.
+ *              c, client to drop.
+ * @modifies    w, c
+ */
+void clientFail( Worker * w, Client * c ) {
+    if ( c->_state == FAILED ) { return; }
+    if ( c->_state != DONE ) { --w->_active; }
+    c->_state = FAILED;
+    ++w->_failed;
+    close( c->_sd );                            /* also leaves epoll set */
+}
+
+
+/* Opens a client's socket; a TCP client logs in once connected.
+ * @param       w, worker owning the client.
+ *              c, client to start.
+ * @modifies    w, c
+ */
+void clientStart( Worker * w, Client * c ) {
+    struct sockaddr_in server = { .sin_family = AF_INET, .sin_port = htons(
+            c->_udp ? udpPort : tcpPort ), .sin_addr.s_addr = htonl(
+            INADDR_LOOPBACK ) };
+    c->_state = CONNECTING;
+    c->_sd = socket( AF_INET, ( c->_udp ? SOCK_DGRAM : SOCK_STREAM ) |
+            SOCK_NONBLOCK, 0 );
+    if ( c->_sd < 0 ) {
+        fprintf( stderr, "WORKER %d: ERROR socket() failed\n", w->_index );
+        c->_state = FAILED;
+        ++w->_failed;
+        return;
+    }
+    ++w->_active;
+
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP |
+            EPOLLET, .data.ptr = c };
+    if ( ( (connect( c->_sd, (struct sockaddr *)&server, sizeof( server ) ) < 0)
+            && (errno != EINPROGRESS) ) || (epoll_ctl( w->_epollSd, EPOLL_CTL_ADD,
+            c->_sd, &ev ) < 0) ) {
+        fprintf( stderr, "WORKER %d: ERROR connect() failed\n", w->_index );
+        clientFail( w, c );
+        return;
+    }
+
+    /* UDP :: connected at once */
+    if ( c->_udp ) { issue( w, c, CMD_LOGIN ); }
+}
+
+
+/* Reply handler; times the request in flight.
+ * @param       w, worker owning the client.
+ *              c, client that got "OK" (ok = 1) or "ERROR" (ok = 0).
+ * @modifies    w, c
+ * @effects     moves on to the next request once this one is fully sent.
+ */
+void complete( Worker * w, Client * c, int ok ) {
+    /* A UDP reply may arrive after its request timed out. */
+    if ( (c->_state != WAITING) || c->_replied ) { return; }
+
+    const unsigned long long t = now(), ns = t - c->_start;
+    Hist * h = &w->_hist[ c->_cmd ];
+    w->_lastReply = t;
+    ++h->_count;                                h->_sum += ns;
+    if ( ns > h->_max ) { h->_max = ns; }
+    ++h->_buckets[ bucketOf( ns ) ];
+    if ( !ok ) { ++h->_errors; }
+
+    /* A second LOGIN is refused, but the userid is still ours. */
+    if ( c->_cmd == CMD_LOGIN ) { c->_loggedIn = 1; }
+    if ( c->_cmd == CMD_LOGOUT ) { c->_loggedIn = 0; }
+
+    c->_replied = 1;
+    if ( c->_off >= c->_headLen + c->_bodyLen ) { nextOp( w, c ); }
+}
+
+
+/* Userid helper; TCP clients come first, then UDP clients.
+ * @param       index, client number.
+ *              id, buffer of at least ID_MAX + 1 bytes.
+ * @modifies    id
+ */
+void idOf( int index, char * id ) {
+    snprintf( id, ID_MAX + 1, "%c%05x%06d", ( (index < numTcp) ? 't' : 'u' ),
+            runTag, index );
+}
+
+
+/* Request helper; builds a request and starts sending it.
+ * @param       w, worker owning the client.
+ *              c, idle client.
+ *              cmd, command to send.
+ * @modifies    w, c
+ */
+void issue( Worker * w, Client * c, int cmd ) {
+    char to[ ID_MAX + 1 ];
+    long len = 0;
+    const long bodyMax = ( c->_udp ? UDP_MSG_MAX : MSG_MAX );
+    c->_cmd = cmd;                              c->_replied = 0;
+    c->_body = NULL;                            c->_bodyLen = 0;
+    c->_off = 0;
+
+    switch ( cmd ) {
+        case CMD_LOGIN:
+            c->_headLen = snprintf( c->_head, HEAD_MAX, "LOGIN %s\n", c->_id );
+            break;
+        case CMD_WHO:
+            c->_headLen = snprintf( c->_head, HEAD_MAX, "WHO\n" );
+            break;
+        case CMD_SEND:
+            idOf( randNext( c ) % (numTcp + numUdp), to );
+            len = 1 + ( randNext( c ) % bodyMax );
+            c->_body = legend + ( randNext( c ) % (legendLen - len + 1) );
+            c->_bodyLen = len;
+            c->_headLen = snprintf( c->_head, HEAD_MAX, "SEND %s %ld\n", to, len );
+            break;
+        case CMD_BROADCAST:
+            len = 1 + ( randNext( c ) % bodyMax );
+            c->_body = legend + ( randNext( c ) % (legendLen - len + 1) );
+            c->_bodyLen = len;
+            c->_headLen = snprintf( c->_head, HEAD_MAX, "BROADCAST %ld\n", len );
+            break;
+        case CMD_SHARE:
+            /* Only TCP clients are sent files; see parseTcp(). */
+            idOf( randNext( c ) % numTcp, to );
+            if ( c->_udp ) {
+                len = 1 + ( randNext( c ) % UDP_MSG_MAX );
+                c->_body = sonny + ( randNext( c ) % (sonnyLen - len + 1) );
+            } else if ( randNext( c ) & 1 ) {
+                len = ospdLen;                  c->_body = ospd;
+            } else {
+                len = sonnyLen;                 c->_body = sonny;
+            }
+            c->_bodyLen = len;
+            c->_headLen = snprintf( c->_head, HEAD_MAX, "SHARE %s %ld\n", to, len );
+            break;
+        default:
+            /* cmd == CMD_LOGOUT */
+            c->_headLen = snprintf( c->_head, HEAD_MAX, "LOGOUT\n" );
+            break;
+    }
+
+    if ( cmd != CMD_LOGIN ) { ++c->_issued; }
+    c->_state = WAITING;
+    c->_start = now();
+    writeOut( w, c );
+}
+
+
+/* Reads a whole file into memory.
+ * @param       name, file name within filesDir.
+ *              len, set to the file's length.
+ * @return      file contents, or NULL on error.
+ */
+char * loadFile( const char * name, long * len ) {
+    char path[ 4096 ];
+    struct stat st;
+    snprintf( path, sizeof( path ), "%s/%s", filesDir, name );
+    int fd = open( path, O_RDONLY );
+    if ( (fd < 0) || (fstat( fd, &st ) < 0) || (st.st_size <= MSG_MAX) ) {
+        fprintf( stderr, "MAIN: ERROR Could not load %s\n", path );
+        if ( fd >= 0 ) { close( fd ); }
+        return NULL;
+    }
+
+    char * data = malloc( st.st_size );
+    long got = 0;
+    while ( data && (got < st.st_size) ) {
+        ssize_t n = read( fd, data + got, st.st_size - got );
+        if ( n <= 0 ) {
+            fprintf( stderr, "MAIN: ERROR Could not read %s\n", path );
+            free( data );
+            data = NULL;
+        } else {
+            got += n;
+        }
+    }
+    close( fd );
+    *len = got;
+    return data;
+}
+
+
+/* Picks a client's next request, or retires it once the run is over.
+ * @param       w, worker owning the client.
+ *              c, client whose request finished.
+ * @modifies    w, c
+ */
+void nextOp( Worker * w, Client * c ) {
+    c->_state = IDLE;
+    const int stopping = ( now() >= stopAt );
+    if ( !c->_loggedIn && !stopping ) {
+        issue( w, c, CMD_LOGIN );
+    } else if ( stopping || ( (requests > 0) && (c->_issued >= requests) ) ) {
+        c->_state = DONE;
+        --w->_active;
+    } else {
+        unsigned int total = 0, pick;
+        for ( int i = 0; i < 5; ++i ) { total += mix[i]; }
+        pick = randNext( c ) % total;
+        int cmd = CMD_WHO;
+        while ( pick >= mix[ cmd - CMD_WHO ] ) { pick -= mix[ cmd++ - CMD_WHO ]; }
+        issue( w, c, cmd );
+    }
+}
+
+
+/* Monotonic clock.
+ * @return      nanoseconds.
+ */
+unsigned long long now( void ) {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( (unsigned long long)ts.tv_sec * 1000000000ULL ) + ts.tv_nsec;
+}
+
+
+/* TCP input parser. Replies are one line, "OK" or "ERROR ..."; a WHO reply
+ * goes on with one userid per line, which is skipped. Deliveries are skipped
+ * by their length: "FROM <id> <len> <body>\n" and "SHARE <id> <len>\n<file>".
+ * @param       w, worker owning the client.
+ *              c, client with new bytes in _in.
+ * @return      0, or -1 if the server sent something unparsable.
+ * @modifies    c
+ */
+int parseTcp( Worker * w, Client * c ) {
+    int pos = 0;
+    while ( pos < c->_inLen ) {
+        char * p = c->_in + pos;
+        const int avail = c->_inLen - pos;
+        if ( c->_skip > 0 ) {
+            const int n = ( (c->_skip < avail) ? c->_skip : avail );
+            pos += n;                           c->_skip -= n;
+            continue;
+        }
+
+        /* A FROM header has no newline of its own; the body may. */
+        if ( strncmp( p, "FROM ", (avail < 5) ? avail : 5 ) == 0 ) {
+            char * end = ( (avail > 5) ? memchr( p + 5, ' ', avail - 5 ) : NULL );
+            end = ( end ? memchr( end + 1, ' ', (p + avail) - (end + 1) ) : NULL );
+            if ( end == NULL ) {
+                if ( avail > HEAD_MAX ) { return -1; }
+                break;
+            }
+            c->_skip = strtol( strchr( p + 5, ' ' ) + 1, NULL, 10 ) + 1;
+            pos = ( end + 1 ) - c->_in;
+            continue;
+        }
+
+        char * nl = memchr( p, '\n', avail );
+        if ( nl == NULL ) {
+            if ( avail >= IN_MAX ) { return -1; }
+            break;
+        }
+        *nl = '\0';
+        if ( strcmp( p, "OK" ) == 0 ) {
+            complete( w, c, 1 );
+        } else if ( strncmp( p, "ERROR", 5 ) == 0 ) {
+            complete( w, c, 0 );
+        } else if ( strncmp( p, "SHARE ", 6 ) == 0 ) {
+            char * len = strchr( p + 6, ' ' );
+            if ( len == NULL ) { return -1; }
+            c->_skip = strtol( len + 1, NULL, 10 );
+        }
+        /* else :: userid line of a WHO reply */
+        pos = ( nl + 1 ) - c->_in;
+        if ( c->_state == FAILED ) { return 0; }
+    }
+
+    memmove( c->_in, c->_in + pos, c->_inLen - pos );
+    c->_inLen -= pos;
+    return 0;
+}
+
+
+/* Latency at a quantile of a histogram, rounded up to its bucket's top.
+ * @param       h, histogram.
+ *              q, quantile in (0, 1].
+ * @return      nanoseconds, or 0 for an empty histogram.
+ */
+unsigned long long percentile( Hist * h, double q ) {
+    unsigned long long want = (unsigned long long)( q * h->_count ), seen = 0;
+    if ( want < 1 ) { want = 1; }
+    for ( int b = 0; (b < HIST_BUCKETS) && (h->_count > 0); ++b ) {
+        seen += h->_buckets[b];
+        if ( seen >= want ) {
+            return ( (bucketTop( b ) < h->_max) ? bucketTop( b ) : h->_max );
+        }
+    }
+    return h->_max;
+}
+
+
+/* Client random number generator (xorshift64*).
+ * @param       c, client whose generator to step.
+ * @return      next random number.
+ * @modifies    c
+ */
+unsigned long long randNext( Client * c ) {
+    c->_rng ^= c->_rng >> 12;
+    c->_rng ^= c->_rng << 25;
+    c->_rng ^= c->_rng >> 27;
+    return c->_rng * 0x2545F4914F6CDD1DULL;
+}
+
+
+/* Input handler; edge-triggered, so reads until the socket is drained.
+ * @param       w, worker owning the client.
+ *              c, client whose socket is readable.
+ * @modifies    w, c
+ */
+void readIn( Worker * w, Client * c ) {
+    while ( c->_state != FAILED ) {
+        if ( c->_udp ) {
+            /* Each datagram is a whole reply or delivery. */
+            char buffer[ BUFFER_MAX + HEAD_MAX + 1 ];
+            ssize_t n = recv( c->_sd, buffer, sizeof( buffer ) - 1, 0 );
+            if ( n < 0 ) {
+                if ( errno == EINTR ) { continue; }
+                if ( (errno != EAGAIN) && (errno != EWOULDBLOCK) ) {
+                    /* ICMP unreachable :: server not up yet, or gone */
+                    continue;
+                }
+                return;
+            }
+            w->_rcvd += n;
+            if ( (n >= 3) && (strncmp( buffer, "OK\n", 3 ) == 0) ) {
+                complete( w, c, 1 );
+            } else if ( (n >= 5) && (strncmp( buffer, "ERROR", 5 ) == 0) ) {
+                complete( w, c, 0 );
+            }
+            continue;
+        }
+
+        ssize_t n = recv( c->_sd, c->_in + c->_inLen, IN_MAX - c->_inLen, 0 );
+        if ( n > 0 ) {
+            w->_rcvd += n;                      c->_inLen += n;
+            if ( parseTcp( w, c ) < 0 ) {
+                fprintf( stderr, "WORKER %d: ERROR Bad reply for %s\n",
+                        w->_index, c->_id );
+                clientFail( w, c );
+            }
+        } else if ( (n < 0) && (errno == EINTR) ) {
+            continue;
+        } else if ( (n < 0) && ( (errno == EAGAIN) || (errno == EWOULDBLOCK) ) ) {
+            return;
+        } else {
+            /* n == 0 or n < 0 :: connection closed */
+            clientFail( w, c );
+        }
+    }
+}
+
+
+/* Prints the merged results of every worker.
+ * @param       elapsed, run time in seconds.
+ */
+void report( double elapsed ) {
+    Hist total[ CMD_COUNT ];
+    unsigned long long sent = 0, rcvd = 0, count = 0;
+    int failed = 0;
+    memset( total, 0, sizeof( total ) );
+    for ( int i = 0; i < numWorkers; ++i ) {
+        for ( int k = 0; k < CMD_COUNT; ++k ) {
+            Hist * h = &workers[i]._hist[k];
+            total[k]._count += h->_count;       total[k]._errors += h->_errors;
+            total[k]._timeouts += h->_timeouts; total[k]._sum += h->_sum;
+            if ( h->_max > total[k]._max ) { total[k]._max = h->_max; }
+            for ( int b = 0; b < HIST_BUCKETS; ++b ) {
+                total[k]._buckets[b] += h->_buckets[b];
+            }
+        }
+        sent += workers[i]._sent;               rcvd += workers[i]._rcvd;
+        failed += workers[i]._failed;
+    }
+    for ( int k = 0; k < CMD_COUNT; ++k ) { count += total[k]._count; }
+
+    printf( "MAIN: %d TCP and %d UDP clients, %d thread%s, seed %llu\n", numTcp,
+            numUdp, numWorkers, ( (numWorkers != 1) ? "s" : "" ), seed );
+    printf( "MAIN: %llu replies in %.3f s (%.1f/s), %llu bytes sent, %llu "
+            "received, %d clients failed\n", count, elapsed, count / elapsed,
+            sent, rcvd, failed );
+    printf( "MAIN: %-9s %9s %7s %8s %10s %9s %9s %9s %9s %9s\n", "command",
+            "count", "errors", "timeouts", "ops/s", "mean(us)", "p50(us)",
+            "p99(us)", "p999(us)", "max(us)" );
+    for ( int k = 0; k < CMD_COUNT; ++k ) {
+        Hist * h = &total[k];
+        printf( "MAIN: %-9s %9lu %7lu %8lu %10.1f %9.1f %9.1f %9.1f %9.1f "
+                "%9.1f\n", names[k], h->_count, h->_errors, h->_timeouts,
+                h->_count / elapsed, ( h->_count ? (h->_sum / 1000.0 /
+                h->_count) : 0.0 ), percentile( h, 0.50 ) / 1000.0, percentile(
+                h, 0.99 ) / 1000.0, percentile( h, 0.999 ) / 1000.0, h->_max /
+                1000.0 );
+    }
+}
+
+
+/* Worker thread; runs its clients' event loop until they are all done.
+ * @param       ptr, pointer to the Worker to run.
+ */
+void * worker( void * ptr ) {
+    Worker * w = (Worker*)ptr;
+    struct epoll_event events[ EVENTS_MAX ];
+    for ( int i = 0; i < w->_numClients; ++i ) { clientStart( w, w->_clients[i] ); }
+
+    while ( w->_active > 0 ) {
+        int ready = epoll_wait( w->_epollSd, events, EVENTS_MAX, 50 );
+        if ( (ready < 0) && (errno != EINTR) ) {
+            fprintf( stderr, "WORKER %d: ERROR epoll_wait() failed\n", w->_index );
+            break;
+        }
+
+        for ( int e = 0; e < ready; ++e ) {
+            Client * c = events[e].data.ptr;
+            if ( c->_state == FAILED ) { continue; }
+            if ( (c->_state == CONNECTING) && (events[e].events & EPOLLOUT) ) {
+                int err = 0;
+                socklen_t errLen = sizeof( err );
+                if ( (getsockopt( c->_sd, SOL_SOCKET, SO_ERROR, &err, &errLen )
+                        < 0) || (err != 0) ) {
+                    fprintf( stderr, "WORKER %d: ERROR connect() failed\n",
+                            w->_index );
+                    clientFail( w, c );
+                    continue;
+                }
+                issue( w, c, CMD_LOGIN );
+            } else if ( events[e].events & EPOLLOUT ) {
+                writeOut( w, c );
+            }
+            if ( (c->_state != CONNECTING) && (events[e].events & ~EPOLLOUT) ) {
+                readIn( w, c );
+            }
+        }
+
+        /* Lost datagrams :: give up on the request and go on. */
+        const unsigned long long t = now();
+        for ( int i = 0; i < w->_numClients; ++i ) {
+            Client * c = w->_clients[i];
+            if ( c->_udp && (c->_state == WAITING) && (t - c->_start >
+                    UDP_TIMEOUT) ) {
+                ++w->_hist[ c->_cmd ]._timeouts;
+                nextOp( w, c );
+            }
+        }
+        if ( t >= stopAt + DRAIN_NS ) { break; }
+    }
+
+    /* Whatever is still in flight never got its reply. */
+    for ( int i = 0; i < w->_numClients; ++i ) {
+        Client * c = w->_clients[i];
+        if ( c->_state == WAITING ) { ++w->_hist[ c->_cmd ]._timeouts; }
+        if ( c->_state != FAILED ) { close( c->_sd ); }
+    }
+    return NULL;
+}
+
+
+/* Output handler; sends as much of the request as the socket will take.
+ * @param       w, worker owning the client.
+ *              c, client with a request in flight.
+ * @modifies    w, c
+ * @effects     moves on to the next request if the reply already came.
+ */
+void writeOut( Worker * w, Client * c ) {
+    const long total = c->_headLen + c->_bodyLen;
+    if ( (c->_state != WAITING) || (c->_off >= total) ) { return; }
+
+    if ( c->_udp ) {
+        /* The whole request is one datagram; a loss shows up as a timeout. */
+        char buffer[ BUFFER_MAX + HEAD_MAX ];
+        memcpy( buffer, c->_head, c->_headLen );
+        memcpy( buffer + c->_headLen, c->_body, c->_bodyLen );
+        if ( send( c->_sd, buffer, total, 0 ) == total ) { w->_sent += total; }
+        c->_off = total;
+        return;
+    }
+
+    while ( c->_off < total ) {
+        struct iovec iov[2];
+        int n = 0;
+        if ( c->_off < c->_headLen ) {
+            iov[ n++ ] = (struct iovec){ c->_head + c->_off, c->_headLen -
+                    c->_off };
+        }
+        long bodyOff = ( (c->_off > c->_headLen) ? (c->_off - c->_headLen) : 0 );
+        if ( bodyOff < c->_bodyLen ) {
+            iov[ n++ ] = (struct iovec){ (void *)( c->_body + bodyOff ),
+                    c->_bodyLen - bodyOff };
+        }
+
+        ssize_t sent = writev( c->_sd, iov, n );
+        if ( sent < 0 ) {
+            if ( errno == EINTR ) { continue; }
+            if ( (errno != EAGAIN) && (errno != EWOULDBLOCK) ) {
+                clientFail( w, c );
+            }
+            return;
+        }
+        c->_off += sent;                        w->_sent += sent;
+    }
+    if ( c->_replied ) { nextOp( w, c ); }
+}
+
+
+int main( int argc, char * argv[] ) {
+    if ( argc < 3 ) {
+        fprintf( stderr, "MAIN: ERROR Invalid argument(s)\nMAIN: " USAGE );
+        return EXIT_FAILURE;
+    }
+
+    char * tmp;
+    int valid = 1;
+    tcpPort = strtol( argv[1], &tmp, 10 );      valid = ( *tmp == '\0' );
+    udpPort = strtol( argv[2], &tmp, 10 );      valid = ( valid && (*tmp == '\0') );
+    for ( int a = 3; valid && (a < argc); a += 2 ) {
+        const char * arg = ( (a + 1 < argc) ? argv[ a + 1 ] : NULL );
+        if ( arg == NULL ) {
+            valid = 0;
+        } else if ( strcmp( argv[a], "--tcp" ) == 0 ) {
+            numTcp = strtol( arg, &tmp, 10 );
+        } else if ( strcmp( argv[a], "--udp" ) == 0 ) {
+            numUdp = strtol( arg, &tmp, 10 );
+        } else if ( strcmp( argv[a], "--threads" ) == 0 ) {
+            numWorkers = strtol( arg, &tmp, 10 );
+        } else if ( strcmp( argv[a], "--seconds" ) == 0 ) {
+            seconds = strtol( arg, &tmp, 10 );
+        } else if ( strcmp( argv[a], "--requests" ) == 0 ) {
+            requests = strtol( arg, &tmp, 10 );
+        } else if ( strcmp( argv[a], "--seed" ) == 0 ) {
+            seed = strtoull( arg, &tmp, 10 );
+        } else if ( strcmp( argv[a], "--files" ) == 0 ) {
+            filesDir = arg;                     tmp = "";
+        } else if ( strcmp( argv[a], "--mix" ) == 0 ) {
+            tmp = (char *)arg;
+            for ( int i = 0; valid && (i < 5); ++i ) {
+                mix[i] = strtoul( tmp, &tmp, 10 );
+                valid = ( (i < 4) ? (*tmp++ == ',') : 1 );
+            }
+        } else {
+            valid = 0;
+        }
+        valid = ( valid && (*tmp == '\0') );
+    }
+    valid = ( valid && (numTcp >= 1) && (numUdp >= 0) && (numWorkers >= 1) &&
+            (seconds >= 1) && (requests >= 0) );
+    valid = ( valid && (mix[0] + mix[1] + mix[2] + mix[3] + mix[4] > 0) );
+    if ( !valid ) {
+        fprintf( stderr, "MAIN: ERROR Invalid argument(s)\nMAIN: " USAGE );
+        return EXIT_FAILURE;
+    }
+
+    if ( !( legend = loadFile( "legend.txt", &legendLen ) ) ||
+            !( ospd = loadFile( "ospd.txt", &ospdLen ) ) ||
+            !( sonny = loadFile( "sonny1978.jpg", &sonnyLen ) ) ) {
+        return EXIT_FAILURE;
+    }
+
+    /* A client needs a descriptor; ask for as many as the hard limit allows. */
+    struct rlimit lim;
+    if ( getrlimit( RLIMIT_NOFILE, &lim ) == 0 ) {
+        lim.rlim_cur = lim.rlim_max;
+        setrlimit( RLIMIT_NOFILE, &lim );
+    }
+    signal( SIGPIPE, SIG_IGN );
+
+    /* Clients go round-robin to workers; each seeds its own generator. */
+    const int numClients = numTcp + numUdp;
+    Client * clients = calloc( numClients, sizeof( Client ) );
+    workers = calloc( numWorkers, sizeof( Worker ) );
+    for ( int i = 0; workers && (i < numWorkers); ++i ) {
+        workers[i]._index = i;
+        workers[i]._clients = calloc( (numClients / numWorkers) + 1,
+                sizeof( Client * ) );
+        workers[i]._epollSd = epoll_create1( 0 );
+        if ( !workers[i]._clients || (workers[i]._epollSd < 0) ) {
+            fprintf( stderr, "MAIN: ERROR worker setup failed\n" );
+            return EXIT_FAILURE;
+        }
+    }
+    if ( !clients || !workers ) {
+        fprintf( stderr, "MAIN: ERROR calloc() failed\n" );
+        return EXIT_FAILURE;
+    }
+
+    runTag = getpid() & 0xfffff;
+    for ( int i = 0; i < numClients; ++i ) {
+        Client * c = &clients[i];
+        c->_index = i;                          c->_udp = ( i >= numTcp );
+        idOf( i, c->_id );
+
+        /* splitmix64 of seed and index, never zero */
+        unsigned long long z = seed + ( (i + 1) * 0x9E3779B97F4A7C15ULL );
+        z = ( z ^ (z >> 30) ) * 0xBF58476D1CE4E5B9ULL;
+        z = ( z ^ (z >> 27) ) * 0x94D049BB133111EBULL;
+        c->_rng = ( (z ^ (z >> 31)) ? (z ^ (z >> 31)) : 1 );
+
+        Worker * w = &workers[ i % numWorkers ];
+        w->_clients[ w->_numClients++ ] = c;
+    }
+
+    printf( "MAIN: Started load on TCP port %u and UDP port %u\n", tcpPort,
+            udpPort );
+    fflush( stdout );
+    const unsigned long long start = now();
+    stopAt = start + ( seconds * 1000000000ULL );
+    for ( int i = 0; i < numWorkers; ++i ) {
+        int rc = pthread_create( &workers[i]._tid, NULL, worker, &workers[i] );
+        if ( rc != 0 ) {
+            fprintf( stderr, "MAIN: ERROR Could not create thread (%d)\n", rc );
+            return EXIT_FAILURE;
+        }
+    }
+    for ( int i = 0; i < numWorkers; ++i ) { pthread_join( workers[i]._tid, NULL ); }
+
+    /* Rates cover the time until the last reply, not the drain after it. */
+    unsigned long long last = start;
+    for ( int i = 0; i < numWorkers; ++i ) {
+        if ( workers[i]._lastReply > last ) { last = workers[i]._lastReply; }
+    }
+    report( (last > start) ? ((last - start) / 1e9) : ((now() - start) / 1e9) );
+    return EXIT_SUCCESS;
+}
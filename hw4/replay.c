@@ -0,0 +1,585 @@
+/* replay.c
+ * Griffin Melnick, melnig@rpi.edu
+ *
+ * Replays a homework4 capture against a server on this host. The program is
+ * called using
+ *
+ *   bash$ a.out <trace-file> <tcp-port> <udp-port> [--speed <x> | --max]
+ *               [--verbose]
+ *
+ * where <trace-file> was written by homework4 run with --capture, and
+ * <tcp-port> and <udp-port> are those of the server to replay against,
+ * normally freshly started. Each TCP connection in the trace gets a
+ * connection of its own and each UDP client a socket of its own; their bytes
+ * are sent in the order and at the pace they were captured, <x> times faster
+ * with --speed, or with no waiting at all with --max. Either way, a piece of
+ * input is held back until the server has sent as many bytes as it had by
+ * that point in the capture (or has gone quiet for GATE_NS), so a SEND is not
+ * replayed before the LOGIN it depended on has been answered.
+ *
+ * Whatever the server sends back on each connection is then checked against
+ * what was captured: it is "identical", "reordered" if it holds the same lines
+ * in a different order (as when broadcasts from several clients interleave
+ * differently), or "different". Differences are listed with the first byte
+ * at which they part, or all of them with --verbose. The exit status is
+ * nonzero if any connection differs.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Macro definitions. */
+#define BUFFER_MAX 65536                        /* largest datagram read */
+#define DIFF_MAX 10                             /* differences listed */
+#define DRAIN_NS 10000000000ULL                 /* longest wait for replies */
+#define EVENTS_MAX 256
+#define GATE_NS 20000000ULL                     /* longest wait on a reply */
+#define IDLE_NS 1000000000ULL                   /* quiet time that ends a run */
+#define SNIPPET 40
+#define USAGE "USAGE: a.out <trace-file> <tcp-port> <udp-port> [--speed <x> | " \
+              "--max] [--verbose]\n"
+
+/* Capture format, as written by homework4.c. */
+#define TRACE_MAGIC "H4TRACE1"
+#define TRACE_OPEN 1
+#define TRACE_CLOSE 2
+#define TRACE_IN 3
+#define TRACE_OUT 4
+#define TRACE_UDP_IN 5
+#define TRACE_UDP_OUT 6
+
+typedef struct {
+    uint64_t _ns;
+    uint64_t _conn;
+    uint32_t _len;
+    uint16_t _type, _shard;
+} TraceRec;
+
+/* Record in memory; _seq keeps the file order of records with equal times. */
+typedef struct {
+    TraceRec _rec;
+    const char * _data;
+    size_t _seq;
+} Event;
+
+typedef struct {
+    char * _data;
+    size_t _len, _cap;
+} Buf;
+
+#define PENDING 0                               /* not opened yet */
+#define OPEN 1
+#define CLOSED 2
+
+typedef struct {
+    uint64_t _key;                              /* TCP connection or UDP sender */
+    int _udp, _sd, _state;
+    int _shut;                                  /* write side to close */
+    Buf _expect, _got;                          /* captured and replayed replies */
+    Buf _out;                                   /* bytes still to send */
+    size_t _outOff;
+} Session;
+
+Event * events;
+size_t numEvents = 0;
+Session * sessions;
+size_t numSessions = 0;
+unsigned short tcpPort = 0, udpPort = 0;
+double speed = 1.0;                             /* 0 for --max */
+int verbose = 0, epollSd = -1;
+unsigned long long lastRead = 0;                /* time of the last reply */
+unsigned long long bytesDue = 0, bytesGot = 0;  /* replies so far */
+
+/* Method declarations. ----------------------------------------------------- */
+
+int bufAppend( Buf * b, const char * data, size_t len );
+int compareEvents( const void * a, const void * b );
+int compareKeys( const void * a, const void * b );
+int compareLines( const void * a, const void * b );
+void describe( Session * s );
+Session * find( uint64_t key );
+int linesMatch( Buf * a, Buf * b );
+int load( const char * path );
+unsigned long long now( void );
+void openSession( Session * s );
+void pump( int timeout );
+void readSession( Session * s );
+void snippet( const char * data, size_t len, size_t at );
+void writeSession( Session * s );
+
+/* Method definitions. ------------------------------------------------------ */
+
+/* Growable buffer append.
+ * @param       b, buffer to append to.
+ *              data, bytes to append.
+ *              len, number of bytes.
+ * @return      0, or -1 if out of memory.
+ * @modifies    b
+ */
+int bufAppend( Buf * b, const char * data, size_t len ) {
+    if ( b->_len + len > b->_cap ) {
+        size_t cap = ( (b->_cap > 0) ? (b->_cap * 2) : 4096 );
+        while ( cap < b->_len + len ) { cap *= 2; }
+        char * tmp = realloc( b->_data, cap );
+        if ( tmp == NULL ) { return -1; }
+        b->_data = tmp;                         b->_cap = cap;
+    }
+    memcpy( b->_data + b->_len, data, len );
+    b->_len += len;
+    return 0;
+}
+
+
+/* qsort() comparator putting events in time order, then file order.
+ * @param       a, b, events to compare.
+ * @return      <0, 0 or >0.
+ */
+int compareEvents( const void * a, const void * b ) {
+    const Event * x = a, * y = b;
+    if ( x->_rec._ns != y->_rec._ns ) { return ( (x->_rec._ns < y->_rec._ns) ?
+            -1 : 1 ); }
+    return ( (x->_seq < y->_seq) ? -1 : (x->_seq > y->_seq) );
+}
+
+
+/* qsort() and bsearch() comparator for sessions by key.
+ * @param       a, b, sessions to compare.
+ * @return      <0, 0 or >0.
+ */
+int compareKeys( const void * a, const void * b ) {
+    const Session * x = a, * y = b;
+    return ( (x->_key < y->_key) ? -1 : (x->_key > y->_key) );
+}
+
+
+/* qsort() comparator for lines, given as Buf slices.
+ * @param       a, b, lines to compare.
+ * @return      <0, 0 or >0.
+ */
+int compareLines( const void * a, const void * b ) {
+    const Buf * x = a, * y = b;
+    int c = memcmp( x->_data, y->_data, (x->_len < y->_len) ? x->_len : y->_len );
+    if ( c != 0 ) { return c; }
+    return ( (x->_len < y->_len) ? -1 : (x->_len > y->_len) );
+}
+
+
+/* Prints where a session's replies first differ from the capture.
+ * @param       s, session that differs.
+ */
+void describe( Session * s ) {
+    size_t at = 0;
+    while ( (at < s->_expect._len) && (at < s->_got._len) &&
+            (s->_expect._data[ at ] == s->_got._data[ at ]) ) {
+        ++at;
+    }
+    if ( s->_udp ) {
+        /* senderKey() :: address and port under the top bit */
+        struct in_addr addr = { htonl( (uint32_t)( s->_key >> 16 ) ) };
+        printf( "REPLAY: udp %s:%u", inet_ntoa( addr ), (unsigned int)( s->_key &
+                0xffff ) );
+    } else {
+        printf( "REPLAY: tcp #%llu", (unsigned long long)s->_key );
+    }
+    printf( " differs at byte %zu of %zu (got %zu)\n", at, s->_expect._len,
+            s->_got._len );
+    printf( "REPLAY:   expected " );
+    snippet( s->_expect._data, s->_expect._len, at );
+    printf( "REPLAY:   got      " );
+    snippet( s->_got._data, s->_got._len, at );
+}
+
+
+/* Session lookup.
+ * @param       key, TCP connection number or UDP sender key from the trace.
+ * @return      session, or NULL.
+ */
+Session * find( uint64_t key ) {
+    Session want = { ._key = key };
+    return bsearch( &want, sessions, numSessions, sizeof( Session ), compareKeys );
+}
+
+
+/* Checks whether two byte streams hold the same lines in any order.
+ * @param       a, b, streams to compare.
+ * @return      1 if they do, else 0.
+ */
+int linesMatch( Buf * a, Buf * b ) {
+    Buf * streams[2] = { a, b };
+    Buf * lines[2] = { NULL, NULL };
+    size_t count[2] = { 0, 0 };
+    int match = 0;
+
+    for ( int k = 0; k < 2; ++k ) {
+        size_t n = 1;
+        for ( size_t i = 0; i < streams[k]->_len; ++i ) {
+            n += ( streams[k]->_data[i] == '\n' );
+        }
+        if ( ( lines[k] = malloc( n * sizeof( Buf ) ) ) == NULL ) { goto done; }
+
+        size_t start = 0;
+        for ( size_t i = 0; i <= streams[k]->_len; ++i ) {
+            if ( (i == streams[k]->_len) || (streams[k]->_data[i] == '\n') ) {
+                lines[k][ count[k]++ ] = (Buf){ streams[k]->_data + start,
+                        i - start, 0 };
+                start = i + 1;
+            }
+        }
+        qsort( lines[k], count[k], sizeof( Buf ), compareLines );
+    }
+
+    match = ( count[0] == count[1] );
+    for ( size_t i = 0; match && (i < count[0]); ++i ) {
+        match = ( compareLines( &lines[0][i], &lines[1][i] ) == 0 );
+    }
+
+done:
+    free( lines[0] );
+    free( lines[1] );
+    return match;
+}
+
+
+/* Reads a trace into events and sessions.
+ * @param       path, trace file.
+ * @return      0, or -1 on error.
+ * @modifies    events, numEvents, sessions, numSessions
+ */
+int load( const char * path ) {
+    struct stat st;
+    int fd = open( path, O_RDONLY );
+    if ( (fd < 0) || (fstat( fd, &st ) < 0) ) {
+        fprintf( stderr, "MAIN: ERROR Could not open %s\n", path );
+        return -1;
+    }
+
+    /* The trace stays in memory; events point into it. */
+    char * data = malloc( st.st_size + 1 );
+    size_t got = 0;
+    while ( data && (got < (size_t)st.st_size) ) {
+        ssize_t n = read( fd, data + got, st.st_size - got );
+        if ( n <= 0 ) { break; }
+        got += n;
+    }
+    close( fd );
+    if ( !data || (got != (size_t)st.st_size) || (got < 8) || (memcmp( data,
+            TRACE_MAGIC, 8 ) != 0) ) {
+        fprintf( stderr, "MAIN: ERROR %s is not a trace\n", path );
+        return -1;
+    }
+
+    size_t cap = 1024;
+    events = malloc( cap * sizeof( Event ) );
+    for ( size_t off = 8; events && (off + sizeof( TraceRec ) <= got); ) {
+        Event e = { ._seq = numEvents };
+        memcpy( &e._rec, data + off, sizeof( TraceRec ) );
+        off += sizeof( TraceRec );
+        if ( (off + e._rec._len > got) || (e._rec._type < TRACE_OPEN) ||
+                (e._rec._type > TRACE_UDP_OUT) ) {
+            /* torn last record, as after a kill :: stop there */
+            fprintf( stderr, "MAIN: WARNING trace cut short at byte %zu\n",
+                    off - sizeof( TraceRec ) );
+            break;
+        }
+        e._data = data + off;
+        off += e._rec._len;
+
+        if ( numEvents == cap ) {
+            Event * tmp = realloc( events, (cap *= 2) * sizeof( Event ) );
+            if ( tmp == NULL ) { free( events ); events = NULL; break; }
+            events = tmp;
+        }
+        events[ numEvents++ ] = e;
+    }
+    if ( events == NULL ) {
+        fprintf( stderr, "MAIN: ERROR malloc() failed\n" );
+        return -1;
+    }
+    qsort( events, numEvents, sizeof( Event ), compareEvents );
+
+    /* One session per key; captured replies are known up front. */
+    sessions = calloc( numEvents + 1, sizeof( Session ) );
+    if ( sessions == NULL ) {
+        fprintf( stderr, "MAIN: ERROR calloc() failed\n" );
+        return -1;
+    }
+    for ( size_t i = 0; i < numEvents; ++i ) {
+        sessions[ numSessions++ ] = (Session){ ._key = events[i]._rec._conn,
+                ._udp = ( (events[i]._rec._type == TRACE_UDP_IN) ||
+                (events[i]._rec._type == TRACE_UDP_OUT) ), ._sd = -1 };
+    }
+    qsort( sessions, numSessions, sizeof( Session ), compareKeys );
+    size_t unique = 0;
+    for ( size_t i = 0; i < numSessions; ++i ) {
+        if ( (unique == 0) || (sessions[ unique - 1 ]._key != sessions[i]._key) ) {
+            sessions[ unique++ ] = sessions[i];
+        }
+    }
+    numSessions = unique;
+
+    for ( size_t i = 0; i < numEvents; ++i ) {
+        const TraceRec * r = &events[i]._rec;
+        if ( ( (r->_type == TRACE_OUT) || (r->_type == TRACE_UDP_OUT) ) &&
+                (bufAppend( &find( r->_conn )->_expect, events[i]._data,
+                r->_len ) < 0) ) {
+            fprintf( stderr, "MAIN: ERROR malloc() failed\n" );
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/* Monotonic clock.
+ * @return      nanoseconds.
+ */
+unsigned long long now( void ) {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( (unsigned long long)ts.tv_sec * 1000000000ULL ) + ts.tv_nsec;
+}
+
+
+/* Opens a session's socket, on its first event.
+ * @param       s, session to open.
+ * @modifies    s
+ */
+void openSession( Session * s ) {
+    struct sockaddr_in server = { .sin_family = AF_INET, .sin_port = htons(
+            s->_udp ? udpPort : tcpPort ), .sin_addr.s_addr = htonl(
+            INADDR_LOOPBACK ) };
+    s->_sd = socket( AF_INET, ( s->_udp ? SOCK_DGRAM : SOCK_STREAM ), 0 );
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+            .data.ptr = s };
+
+    /* Connect blocking, so the first bytes need not wait for EPOLLOUT. */
+    if ( (s->_sd < 0) || (connect( s->_sd, (struct sockaddr *)&server, sizeof(
+            server ) ) < 0) || (fcntl( s->_sd, F_SETFL, O_NONBLOCK ) < 0) ||
+            (epoll_ctl( epollSd, EPOLL_CTL_ADD, s->_sd, &ev ) < 0) ) {
+        fprintf( stderr, "MAIN: ERROR Could not connect %s session\n",
+                ( s->_udp ? "UDP" : "TCP" ) );
+        if ( s->_sd >= 0 ) { close( s->_sd ); }
+        s->_sd = -1;
+        s->_state = CLOSED;
+        return;
+    }
+    s->_state = OPEN;
+}
+
+
+/* Services sockets until timeout passes or nothing is ready.
+ * @param       timeout, milliseconds to wait, as for epoll_wait().
+ */
+void pump( int timeout ) {
+    struct epoll_event ready[ EVENTS_MAX ];
+    int n = epoll_wait( epollSd, ready, EVENTS_MAX, timeout );
+    for ( int e = 0; e < n; ++e ) {
+        Session * s = ready[e].data.ptr;
+        if ( s->_state != OPEN ) { continue; }
+        if ( ready[e].events & EPOLLOUT ) { writeSession( s ); }
+        if ( ready[e].events & ~EPOLLOUT ) { readSession( s ); }
+    }
+}
+
+
+/* Reads replies until the socket is drained.
+ * @param       s, open session.
+ * @modifies    s, lastRead
+ */
+void readSession( Session * s ) {
+    char buffer[ BUFFER_MAX ];
+    while ( s->_state == OPEN ) {
+        ssize_t n = recv( s->_sd, buffer, sizeof( buffer ), 0 );
+        if ( n > 0 ) {
+            bufAppend( &s->_got, buffer, n );
+            bytesGot += n;                      lastRead = now();
+        } else if ( (n < 0) && (errno == EINTR) ) {
+            continue;
+        } else if ( (n < 0) && ( (errno == EAGAIN) || (errno == EWOULDBLOCK) ||
+                s->_udp ) ) {
+            return;
+        } else {
+            /* n == 0 or n < 0 :: server closed the connection */
+            close( s->_sd );
+            s->_state = CLOSED;
+        }
+    }
+}
+
+
+/* Prints up to SNIPPET bytes of a stream from an offset, escaped.
+ * @param       data, stream.
+ *              len, length of stream.
+ *              at, offset to start from.
+ */
+void snippet( const char * data, size_t len, size_t at ) {
+    putchar( '"' );
+    for ( size_t i = at; (i < len) && (i < at + SNIPPET); ++i ) {
+        unsigned char c = data[i];
+        if ( c == '\n' ) {
+            printf( "\\n" );
+        } else if ( (c < 32) || (c > 126) || (c == '"') || (c == '\\') ) {
+            printf( "\\x%02x", c );
+        } else {
+            putchar( c );
+        }
+    }
+    printf( "\"%s\n", ( (len > at + SNIPPET) ? "..." : "" ) );
+}
+
+
+/* Sends as much of a session's queued bytes as the socket will take; a TCP
+ * session whose capture ended is shut down for writing once they are gone.
+ * @param       s, open session.
+ * @modifies    s
+ */
+void writeSession( Session * s ) {
+    while ( (s->_state == OPEN) && (s->_outOff < s->_out._len) ) {
+        ssize_t n = send( s->_sd, s->_out._data + s->_outOff, s->_out._len -
+                s->_outOff, MSG_NOSIGNAL );
+        if ( n < 0 ) {
+            if ( errno == EINTR ) { continue; }
+            if ( (errno != EAGAIN) && (errno != EWOULDBLOCK) ) {
+                close( s->_sd );
+                s->_state = CLOSED;
+            }
+            return;
+        }
+        s->_outOff += n;
+    }
+
+    if ( s->_outOff == s->_out._len ) { s->_outOff = s->_out._len = 0; }
+    if ( (s->_state == OPEN) && s->_shut && (s->_out._len == 0) ) {
+        shutdown( s->_sd, SHUT_WR );
+        s->_shut = 0;
+    }
+}
+
+
+int main( int argc, char * argv[] ) {
+    int valid = ( argc >= 4 );
+    char * tmp;
+    if ( valid ) {
+        tcpPort = strtol( argv[2], &tmp, 10 );  valid = ( *tmp == '\0' );
+        udpPort = strtol( argv[3], &tmp, 10 );  valid = ( valid && (*tmp == '\0') );
+    }
+    for ( int a = 4; valid && (a < argc); ++a ) {
+        if ( strcmp( argv[a], "--max" ) == 0 ) {
+            speed = 0;
+        } else if ( strcmp( argv[a], "--verbose" ) == 0 ) {
+            verbose = 1;
+        } else if ( (strcmp( argv[a], "--speed" ) == 0) && (a + 1 < argc) ) {
+            speed = strtod( argv[ ++a ], &tmp );
+            valid = ( (*tmp == '\0') && (speed > 0) );
+        } else {
+            valid = 0;
+        }
+    }
+    if ( !valid ) {
+        fprintf( stderr, "MAIN: ERROR Invalid argument(s)\nMAIN: " USAGE );
+        return EXIT_FAILURE;
+    }
+
+    if ( (load( argv[1] ) < 0) || ( (epollSd = epoll_create1( 0 )) < 0 ) ) {
+        return EXIT_FAILURE;
+    }
+    signal( SIGPIPE, SIG_IGN );
+
+    /* Feed the captured input, each piece at its time. */
+    const unsigned long long start = now();
+    for ( size_t i = 0; i < numEvents; ++i ) {
+        const TraceRec * r = &events[i]._rec;
+        if ( (r->_type == TRACE_OUT) || (r->_type == TRACE_UDP_OUT) ) {
+            bytesDue += r->_len;
+            continue;
+        }
+
+        /* A server that sends less than was captured is waited on once. */
+        const unsigned long long gate = now();
+        while ( bytesGot < bytesDue ) {
+            if ( now() - gate >= GATE_NS ) { bytesGot = bytesDue; }
+            pump( 1 );
+        }
+
+        if ( speed > 0 ) {
+            const unsigned long long due = start + (unsigned long long)(
+                    r->_ns / speed );
+            for ( unsigned long long t = now(); t < due; t = now() ) {
+                pump( (int)( (due - t + 999999) / 1000000 ) );
+            }
+        }
+
+        Session * s = find( r->_conn );
+        if ( s->_state == PENDING ) { openSession( s ); }
+        if ( s->_state != OPEN ) { continue; }
+
+        if ( r->_type == TRACE_UDP_IN ) {
+            if ( send( s->_sd, events[i]._data, r->_len, 0 ) < 0 ) {
+                fprintf( stderr, "MAIN: ERROR UDP send() failed\n" );
+            }
+        } else if ( r->_type == TRACE_IN ) {
+            bufAppend( &s->_out, events[i]._data, r->_len );
+            writeSession( s );
+        } else if ( r->_type == TRACE_CLOSE ) {
+            s->_shut = 1;
+            writeSession( s );
+        }
+        pump( 0 );
+    }
+    const unsigned long long fed = now();
+
+    /* Wait for the replies to stop, or every TCP session to be closed. */
+    lastRead = fed;
+    while ( 1 ) {
+        int busy = 0;
+        for ( size_t i = 0; i < numSessions; ++i ) {
+            busy += ( (sessions[i]._state == OPEN) && !sessions[i]._udp );
+        }
+        const unsigned long long t = now();
+        if ( (busy == 0) || (t - lastRead > IDLE_NS) || (t - fed > DRAIN_NS) ) {
+            break;
+        }
+        pump( 100 );
+    }
+    pump( 0 );
+
+    size_t same = 0, reordered = 0, different = 0, tcp = 0;
+    for ( size_t i = 0; i < numSessions; ++i ) {
+        Session * s = &sessions[i];
+        tcp += !s->_udp;
+        if ( (s->_expect._len == s->_got._len) && ( (s->_got._len == 0) ||
+                (memcmp( s->_expect._data, s->_got._data, s->_got._len ) ==
+                0) ) ) {
+            ++same;
+        } else if ( linesMatch( &s->_expect, &s->_got ) ) {
+            ++reordered;
+        } else {
+            if ( verbose || (different < DIFF_MAX) ) { describe( s ); }
+            ++different;
+        }
+    }
+
+    const double trace = ( (numEvents > 0) ? events[ numEvents - 1 ]._rec._ns /
+            1e9 : 0.0 ), took = ( fed - start ) / 1e9;
+    printf( "REPLAY: %zu records, %zu sessions (%zu TCP, %zu UDP) fed in %.3f s "
+            "(captured over %.3f s, %.1fx)\n", numEvents, numSessions, tcp,
+            numSessions - tcp, took, trace, ( (took > 0) ? (trace / took) :
+            0.0 ) );
+    printf( "REPLAY: %zu identical, %zu reordered, %zu different\n", same,
+            reordered, different );
+    return ( (different == 0) ? EXIT_SUCCESS : EXIT_FAILURE );
+}
@@ -6,28 +6,83 @@ Griffin Melnick, melnig@rpi.edu
 Peter Straub, straup@rpi.edu
 
     CPU scheduling simulation. Performs each of the first-come, first-served
-    (FCFS), shortest remaining time (SRT), and round robin (RR) algorithms and
-    prints significant events in processes thorughout duration of simulation.
-    Writes simulation results summary to an output file. The program is run by
-    calling
+    (FCFS), shortest remaining time (SRT), round robin (RR) and completely
+    fair (CFS) algorithms and prints significant events in processes
+    thorughout duration of simulation. Writes simulation results summary to an
+    output file. Time jumps from one event (arrival, I/O completion, burst
+    completion or slice expiry) to the next rather than passing one
+    millisecond at a time. The program is run by calling
 
-        bash$ python3 project1.py <input-file> <stats-output-file> [<rr-add>]
+        bash$ python3 project1.py <input-file> <stats-output-file> [<rr-add>] \
+                [--cfs]
 
     where <input-file> is the file with formatted process information,
     <stats-output-file> is the file to which to write simulation results summary,
     and the optional <rr-add> determines whether processes are added to the
-    beginning or end of the ready queue in the RR algorithm.
+    beginning or end of the ready queue in the RR algorithm. FCFS, SRT and RR
+    always run; --cfs runs CFS after them. Each line of <input-file> may end in
+    an optional sixth field, the process's nice level (-20 to 19, 0 by
+    default), which weights its share of the CPU under CFS.
+    A parameter sweep is run by calling
+
+        bash$ python3 project1.py --sweep <csv-output-file> <t-cs> <t-slice> \
+                <rr-add> <input-file> [<input-file> ...]
+
+    where <t-cs> and <t-slice> are comma-separated lists of values or lo:hi:step
+    ranges (hi included), and <rr-add> is END, BEGINNING or both. Every
+    simulation runs with its output off, in parallel across the CPUs, and the
+    summary of each becomes one row of <csv-output-file>. FCFS, SRT and CFS
+    depend only on t_cs, so they run once per t_cs, with t_slice and rr_add
+    left blank.
+    A multi-core simulation is run by calling
+
+        bash$ python3 project1.py --cores <n> <policy> <input-file> \
+                <stats-output-file> [<t-cs> [<t-migrate> [<t-balance>]]]
+
+    where <n> is the number of cores and <policy> is global (one shared ready
+    queue), steal (per-core queues; idle cores steal from the longest) or
+    rebalance (per-core queues evened out every <t-balance> ms). A process
+    switching in to a core other than the one it last ran on pays <t-migrate>
+    ms on top of half of <t-cs>. The stats file also gives migrations, load
+    imbalance (busiest core's running time over the mean, less one) and each
+    core's utilization.
 """
 
 from collections import defaultdict as ddict
 from collections import deque
 import copy
+import csv
+import heapq
+import multiprocessing
+import os
 import sys
 
 n = 0
 t_cs = 8
 t_slice = 80
 rr_add = 0
+quiet = 0                                       # no queue contents in output #
+t_migrate = 0                                   # switch-in cost on a new core #
+t_balance = 100                                 # rebalance period #
+cfs_latency = 96                                # CFS target latency #
+cfs_granularity = 12                            # CFS minimum granularity #
+
+# CFS weights by nice level, -20 to 19, as in Linux; each level is ~10% CPU. #
+NICE_0 = 1024
+NICE_WEIGHTS = [ 88761, 71755, 56483, 46273, 36291, 29154, 23254, 18705,
+                 14949, 11916, 9548, 7620, 6100, 4904, 3906, 3121, 2501, 1991,
+                 1586, 1277, 1024, 820, 655, 526, 423, 335, 272, 215, 172, 137,
+                 110, 87, 70, 56, 45, 36, 29, 23, 18, 15 ]
+
+# Multi-core event kinds, in the order handled at equal times. #
+BURST, SLICE, SWITCHED_OUT, SWITCHED_IN, IO_DONE, ARRIVE, BALANCE = range( 7 )
+
+# Multi-core core states. #
+IDLE, SWITCHING_IN, RUNNING, SWITCHING_OUT = range( 4 )
+
+SWEEP_FIELDS = [ "input", "algorithm", "t_cs", "t_slice", "rr_add", "status",
+                 "avg_burst_ms", "avg_wait_ms", "avg_turnaround_ms",
+                 "context_switches", "preemptions" ]
 
 """
 Process helper class to store process details from input file.
@@ -36,13 +91,19 @@ class Process:
 
     """
     Default constructor.
+    :param:     pid, arrival, burst, num, io, details from input file.
+                nice, CFS nice level, -20 to 19.
+                    [defaults to 0]
     """
-    def __init__( self, pid, arrival, burst, num, io ):
+    def __init__( self, pid, arrival, burst, num, io, nice = 0 ):
         # Helper details. #
         self._start = 0                         # most recent start time #
         self._readied = 0                       # original ready time #
         self._last_readied = 0                  # most recent ready time #
         self._remaining = burst                 # remaining time for burst #
+        self._core = -1                         # core last run on, multi-core #
+        self._vruntime = 0.0                    # weighted CPU time, CFS #
+        self._weight = NICE_WEIGHTS[ nice + 20 ]
 
         # Details taken from input file. #
         self._pid = pid
@@ -50,6 +111,7 @@ class Process:
         self._burst = burst
         self._num = num
         self._io = io
+        self._nice = nice
 
     # ------------------------------------------------------------------------ #
     # Overidden methods #
@@ -72,6 +134,177 @@ class Process:
         return "proc. {} @ {}ms ".format( self._pid, self._arrival )
 
 
+"""
+Ready queue for SRT and CFS, an indexed binary heap of processes keyed by
+(remaining, pid) or by another key function, ties going to the earlier push.
+A process's key is taken when it is pushed and changed only by update(), so
+the order is that of a queue re-sorted at each push. Iterating it, for
+printing, yields that order. A process may be queued more than once.
+"""
+class ReadyHeap:
+
+    """
+    Default constructor.
+    :param:     key, function giving a process's key.
+                    [defaults to (remaining, pid)]
+    """
+    def __init__( self, key = None ):
+        self._heap = []                         # [key, seq, proc, index] #
+        self._entries = ddict( list )           # maps process to its entries #
+        self._seq = 0                           # push count, breaks ties #
+        self._key = ( key or (lambda proc : (proc._remaining, proc._pid)) )
+        self._load = 0                          # total weight queued, CFS #
+
+    # ------------------------------------------------------------------------ #
+    # Accessors #
+
+    """
+    Indexes the queue in order.
+    :param:     i, position in the queue.
+    :return:    process at position i; the head is found in O(1).
+    """
+    def __getitem__( self, i ):
+        if ( i == 0 ):
+            return self._heap[0][2]
+
+        return sorted( self._heap )[ i ][ 2 ]
+
+
+    """
+    Iterates over the queue in order.
+    :return:    iterator over processes, head first.
+    """
+    def __iter__( self ):
+        return iter( [ entry[2] for entry in sorted(self._heap) ] )
+
+
+    """
+    Length of the queue.
+    :return:    number of entries.
+    """
+    def __len__( self ):
+        return len( self._heap )
+
+
+    """
+    Membership test, in O(1).
+    :param:     proc, process to look for.
+    :return:    True if proc is queued.
+    """
+    def __contains__( self, proc ):
+        return ( proc in self._entries )
+
+    # ------------------------------------------------------------------------ #
+    # Modifiers #
+
+    """
+    Adds process in O(log n).
+    :param:     proc, readying process.
+    :modifies:  self._heap
+    """
+    def push( self, proc ):
+        entry = [ self._key(proc), self._seq, proc, len(self._heap) ]
+        self._seq += 1
+        self._load += proc._weight
+        (self._heap).append( entry )
+        (self._entries[proc]).append( entry )
+        self.sift_up( entry[3] )
+
+
+    """
+    Removes head of queue in O(log n).
+    :return:    process with the least key.
+    :modifies:  self._heap
+    """
+    def popleft( self ):
+        head = self._heap[0]
+        self.swap( 0, len(self._heap) - 1 )
+        (self._heap).pop()
+        self._load -= (head[2])._weight
+        (self._entries[ head[2] ]).remove( head )
+        if ( not self._entries[ head[2] ] ):
+            del self._entries[ head[2] ]
+        if ( self._heap ):
+            self.sift_down( 0 )
+
+        return head[2]
+
+
+    """
+    Re-keys process in O(log n); for SRT, a decrease in remaining time moves
+    it up, and a burst reset moves it down.
+    :param:     proc, process whose remaining time changed.
+    :modifies:  self._heap
+    """
+    def update( self, proc ):
+        for entry in (self._entries).get( proc, () ):
+            entry[0] = self._key( proc )
+            self.sift_up( entry[3] )
+            self.sift_down( entry[3] )
+
+
+    """
+    Removes tail of queue, the entry with the greatest key, in O(n).
+    :return:    process with the greatest key.
+    :modifies:  self._heap
+    """
+    def pop( self ):
+        tail = max( self._heap )
+        i = tail[3]
+        self.swap( i, len(self._heap) - 1 )
+        (self._heap).pop()
+        self._load -= (tail[2])._weight
+        (self._entries[ tail[2] ]).remove( tail )
+        if ( not self._entries[ tail[2] ] ):
+            del self._entries[ tail[2] ]
+        if ( i < len(self._heap) ):
+            self.sift_up( i )
+            self.sift_down( i )
+
+        return tail[2]
+
+    # ------------------------------------------------------------------------ #
+    # Heap helpers #
+
+    """
+    Moves entry up while it has a lesser key than its parent.
+    :param:     i, index of entry in self._heap.
+    """
+    def sift_up( self, i ):
+        while ( (i > 0) and (self._heap[i] < self._heap[ (i - 1) // 2 ]) ):
+            self.swap( i, (i - 1) // 2 )
+            i = ( (i - 1) // 2 )
+
+
+    """
+    Moves entry down while a child has a lesser key.
+    :param:     i, index of entry in self._heap.
+    """
+    def sift_down( self, i ):
+        while 1:
+            least = i
+            for child in ( 2 * i + 1, 2 * i + 2 ):
+                if ( (child < len(self._heap)) and (self._heap[child] < \
+                        self._heap[least]) ):
+                    least = child
+
+            if ( least == i ):
+                break
+
+            self.swap( i, least )
+            i = least
+
+
+    """
+    Swaps two entries, keeping their indices current.
+    :param:     i, j, indices in self._heap.
+    """
+    def swap( self, i, j ):
+        self._heap[i], self._heap[j] = self._heap[j], self._heap[i]
+        self._heap[i][3] = i
+        self._heap[j][3] = j
+
+
 """
 CPU helper class to better keep track of processes throughout scheduling.
 """
@@ -79,8 +312,13 @@ class CPU:
 
     """
     Default constructor.
+    :param:     procs, processes to schedule.
+                srt, boolean to keep the ready queue in SRT order.
+                    [defaults to false]
+                cfs, boolean to keep the ready queue in vruntime order.
+                    [defaults to false]
     """
-    def __init__( self, procs ):
+    def __init__( self, procs, srt = 0, cfs = 0 ):
         self._procs = procs                     # processes found in input file #
 
         # Helper details. #
@@ -100,19 +338,58 @@ class CPU:
         # Process scheduling details. #
         self._ticker = 0                        # time ticker #
         self._curr = None                       # running process #
-        self._ready = deque()                   # ready queue for processes #
+        self._ready = ( ReadyHeap() if srt else \
+                deque() )                       # ready queue for processes #
+        if ( cfs ):
+            self._ready = ReadyHeap( lambda proc : proc._vruntime )
+        self._ran = set()                       # run since last SRT readying #
         self._finished = ddict( int )           # maps PID to final burst finish #
         self._io = ddict( int )                 # maps PID to I/O finish #
         self._t_slice = t_slice                 # time remaining in the slice #
 
+        # CFS details. #
+        self._cfs = cfs
+        self._min_vruntime = 0.0                # floor for readied vruntimes #
+        self._cfs_from = 0                      # remaining at last charge #
+
+        # Event details. #
+        self._arrivals = ddict( list )          # maps arrival time to processes #
+        for proc in self._procs:
+            self._arrivals[proc._arrival].append( proc )
+        self._io_at = ddict( set )              # maps I/O finish to processes #
+        self._events = list( self._arrivals )   # heap of arrival and I/O times #
+        heapq.heapify( self._events )
+        self._last = 0                          # time of most recent jump #
+
     # ------------------------------------------------------------------------ #
     # Accessors #
 
+    """
+    Processes arriving at a given time.
+    :param:     tick, time to check.
+    :return:    list of processes whose arrival time is tick.
+    """
+    def get_arrivals( self, tick ):
+        return list( (self._arrivals).get(tick, ()) )
+
+
+    """
+    Processes finishing I/O at a given time.
+    :param:     tick, time to check.
+    :return:    list of processes in self._io that finish at tick.
+    """
+    def get_io( self, tick ):
+        return list( (self._io_at).get(tick, ()) )
+
+
     """
     String representation of CPU ready queue.
     :return:    string in the format of '[Q *contents of _ready*]
     """
     def get_queue( self ):
+        if ( quiet ):
+            return ""
+
         contents = "[Q"
         for proc in self._ready:
             contents += ' ' + proc._pid
@@ -122,11 +399,90 @@ class CPU:
 
         return contents
 
+
+    """
+    CFS slice for the running process, its weight's share of the target
+    latency, stretched so each runnable process gets the minimum granularity.
+    :return:    slice length in ms, at least the minimum granularity.
+    """
+    def get_slice( self ):
+        weight = (self._curr)._weight
+        period = max( cfs_latency, cfs_granularity * (len(self._ready) + 1) )
+        share = ( period * weight // (weight + (self._ready)._load) )
+        return max( cfs_granularity, share )
+
     # ------------------------------------------------------------------------ #
     # Modifiers #
 
     """
-    Adds process to ready queue.
+    Blocks process on I/O.
+    :param:     proc, blocking process.
+                tick, time at which I/O finishes.
+    :modifies:  (1) self._io, (2) self._events
+    :effects:   (1) proc finishes I/O at tick, replacing any earlier finish.
+                (2) tick is added to the event heap.
+    """
+    def block( self, proc, tick ):
+        if ( proc in self._io ):
+            (self._io_at[ self._io[proc] ]).discard( proc )
+        self._io[proc] = tick
+        (self._io_at[tick]).add( proc )
+        heapq.heappush( self._events, tick )
+
+
+    """
+    Unblocks process from I/O.
+    :param:     proc, process finished on I/O.
+    :modifies:  self._io
+    """
+    def unblock( self, proc ):
+        tick = (self._io).pop( proc )
+        (self._io_at[tick]).discard( proc )
+        if ( not self._io_at[tick] ):
+            del self._io_at[tick]
+
+
+    """
+    Advances time to the next event. Nothing but the running process's burst
+    and slice changes between events, so the skipped milliseconds are charged
+    to it all at once.
+    :param:     rr, boolean to count down the time slice (RR).
+                    [defaults to false]
+    :modifies:  (1) self._ticker, (2) self._curr, (3) self._events
+    :effects:   (1) self._ticker is moved to the next arrival, I/O
+                    completion, burst completion or slice expiry, or by one
+                    if a process is waiting on an empty CPU.
+                (2) remaining time (and slice) is reduced by the time skipped.
+                (3) past events are dropped from the heap.
+    """
+    def jump( self, rr = 0 ):
+        # SRT preemption may move the ticker back; rebuild what is ahead. #
+        if ( self._ticker < self._last ):
+            self._events = list( set(self._arrivals) | set((self._io).values()) )
+            heapq.heapify( self._events )
+
+        while ( (self._events) and (self._events[0] <= self._ticker) ):
+            heapq.heappop( self._events )
+
+        tick = ( self._events[0] if (self._events) else (self._ticker + 1) )
+        if ( self._curr != None ):
+            tick = min( tick, self._ticker + max((self._curr)._remaining, 0) + 1 )
+            if ( rr ):
+                tick = min( tick, self._ticker + max(self._t_slice, 0) + 1 )
+                self._t_slice -= ( tick - self._ticker - 1 )
+            (self._curr)._remaining -= ( tick - self._ticker - 1 )
+
+        elif ( self._ready ):
+            tick = ( self._ticker + 1 )
+
+        self._ticker = tick
+        self._last = tick
+
+
+    """
+    Adds process to ready queue. In CFS mode, a process arriving or back from
+    I/O is placed no more than half the target latency behind min_vruntime,
+    so sleeping earns a bounded head start rather than a monopoly.
     :param:     proc, readying process.
                 srt, boolean to work in SRT mode (sort by remaining).
                     [defaults to false]
@@ -136,19 +492,39 @@ class CPU:
     def ready( self, proc, srt = 0, side = 0 ):
         proc._readied = self._ticker
         proc._last_readied = self._ticker
+        if ( self._cfs ):
+            proc._vruntime = max( proc._vruntime, self._min_vruntime - \
+                    (cfs_latency / 2) )
+        self.enqueue( proc, srt, side )
+
+
+    """
+    Inserts process into ready queue. In SRT mode, processes that have run
+    since the last insert are re-keyed first, as a full re-sort would.
+    :param:     proc, readying process.
+                srt, boolean to work in SRT mode (sort by remaining).
+                    [defaults to false]
+                side, boolean to determine readying to start or end of queue.
+                    [defaults to false]
+    :modifies:  (1) self._ready, (2) self._ran
+    """
+    def enqueue( self, proc, srt = 0, side = 0 ):
+        if ( self._cfs ):
+            (self._ready).push( proc )
+
+        elif ( srt ):
+            for p in self._ran:
+                (self._ready).update( p )
+            self._ran = ( set([self._curr]) if (self._curr != None) else set() )
+            (self._ready).push( proc )
 
         # Add to start of ready queue if rr_add is true (add to BEGINNING). #
-        if ( not side ):
+        elif ( not side ):
             (self._ready).append( proc )
 
         else:
             (self._ready).appendleft( proc )
 
-        # Sort by remaining time in SRT is simulating. #
-        if ( srt ):
-            self._ready = deque( sorted( self._ready, key = lambda obj : \
-                    (obj._remaining, obj._pid) ) )
-
 
     """
     Adds new process.
@@ -163,17 +539,17 @@ class CPU:
     """
     def add( self, srt = 0, side = 0 ):
         # Check for I/O completion and new arrivals before context switch. #
-        io_done = sorted( [ proc for proc, tick in (self._io).items() \
-                if (tick == self._ticker and proc not in self._ready) ], key = \
+        io_done = sorted( [ proc for proc in self.get_io(self._ticker) \
+                if (proc not in self._ready) ], key = \
                 lambda obj : obj._pid )
         for proc in io_done:
             self.ready( proc, srt, side )
-            del self._io[proc]
+            self.unblock( proc )
             print( ("time {}ms: Process {} completed I/O; added to ready " + \
                     "queue {}").format(self._ticker, proc._pid, self.get_queue()) )
 
-        arrived = sorted( [ proc for proc in self._procs if (proc._arrival == \
-                self._ticker and proc not in self._ready) ], key = \
+        arrived = sorted( [ proc for proc in self.get_arrivals(self._ticker) \
+                if (proc not in self._ready) ], key = \
                 lambda obj : obj._pid )
         for proc in arrived:
             self.ready( proc, srt, side )
@@ -189,31 +565,30 @@ class CPU:
             # Find processes completed with I/O. #
             if ( srt ):
                 # Sort by remaining time then PID. #
-                io_done = sorted( [ proc for proc, tick in (self._io).items() \
-                        if tick == self._ticker ], key = lambda obj : (obj._remaining, \
-                        obj._pid) )
+                io_done = sorted( self.get_io( self._ticker ), \
+                        key = lambda obj : (obj._remaining, obj._pid) )
 
             else:
                 # Sort by PID. #
-                io_done = sorted( [ proc for proc, tick in (self._io).items() \
-                        if tick == self._ticker ], key = lambda obj : obj._pid )
+                io_done = sorted( self.get_io( self._ticker ), \
+                        key = lambda obj : obj._pid )
 
             for proc in io_done:
                 self.ready( proc, srt )
-                del self._io[proc]
-                print( ("time {}ms: Process {} completed I/O; added to ready", \
+                self.unblock( proc )
+                print( ("time {}ms: Process {} completed I/O; added to ready " + \
                         "queue {}").format(self._ticker, proc._pid, self.get_queue()) )
 
             # Find process that have arrived to the CPU. #
             if ( srt ):
                 # Sort by remaining time then PID. #
-                arrived = sorted( [ proc for proc in self._procs if proc._arrival == \
-                        self._ticker ], key = lambda obj : (obj._remaining, obj._pid) )
+                arrived = sorted( self.get_arrivals( self._ticker ), \
+                        key = lambda obj : (obj._remaining, obj._pid) )
 
             else:
                 # Sort by PID. #
-                arrived = sorted( [ proc for proc in self._procs if proc._arrival == \
-                        self._ticker ], key = lambda obj : obj._pid )
+                arrived = sorted( self.get_arrivals( self._ticker ), \
+                        key = lambda obj : obj._pid )
 
             for proc in arrived:
                 self.ready( proc, srt )
@@ -221,6 +596,8 @@ class CPU:
                         "queue {}").format(self._ticker, proc._pid, self.get_queue()) )
 
         self._curr = tmp
+        if ( srt ):
+            (self._ran).add( tmp )
         if ( (srt) and (self._ready) ):
             if ( (self._ready[0])._remaining < tmp._remaining ):
                 preempting = (self._ready).popleft()
@@ -255,17 +632,17 @@ class CPU:
     """
     def remove( self, srt = 0, side = 0 ):
         # Check for I/O completion and new arrivals before context switch. #
-        io_done = sorted( [ proc for proc, tick in (self._io).items() \
-                if (tick == self._ticker and proc not in self._ready) ], key = \
+        io_done = sorted( [ proc for proc in self.get_io(self._ticker) \
+                if (proc not in self._ready) ], key = \
                 lambda obj : obj._pid )
         for proc in io_done:
             self.ready( proc, srt, side )
-            del self._io[proc]
+            self.unblock( proc )
             print( ("time {}ms: Process {} completed I/O; added to ready " + \
                     "queue {}").format(self._ticker, proc._pid, self.get_queue()) )
 
-        arrived = sorted( [ proc for proc in self._procs if (proc._arrival == \
-                self._ticker and proc not in self._ready) ], key = \
+        arrived = sorted( [ proc for proc in self.get_arrivals(self._ticker) \
+                if (proc not in self._ready) ], key = \
                 lambda obj : obj._pid )
         for proc in arrived:
             self.ready( proc, srt, side )
@@ -279,31 +656,30 @@ class CPU:
             # Find processes completed with I/O. #
             if ( srt ):
                 # Sort by remaining time then PID. #
-                io_done = sorted( [ proc for proc, tick in (self._io).items() \
-                        if tick == self._ticker ], key = lambda obj : (obj._remaining, \
-                        obj._pid) )
+                io_done = sorted( self.get_io( self._ticker ), \
+                        key = lambda obj : (obj._remaining, obj._pid) )
 
             else:
                 # Sort by PID. #
-                io_done = sorted( [ proc for proc, tick in (self._io).items() \
-                        if tick == self._ticker ], key = lambda obj : obj._pid )
+                io_done = sorted( self.get_io( self._ticker ), \
+                        key = lambda obj : obj._pid )
 
             for proc in io_done:
                 self.ready( proc, srt )
-                del self._io[proc]
+                self.unblock( proc )
                 print( ("time {}ms: Process {} completed I/O; added to ready " + \
                         "queue {}").format(self._ticker, proc._pid, self.get_queue()) )
 
             # Find process that have arrived to the CPU. #
             if ( srt ):
                 # Sort by remaining time then PID. #
-                arrived = sorted( [ proc for proc in self._procs if proc._arrival == \
-                        self._ticker ], key = lambda obj : (obj._remaining, obj._pid) )
+                arrived = sorted( self.get_arrivals( self._ticker ), \
+                        key = lambda obj : (obj._remaining, obj._pid) )
 
             else:
                 # Sort by PID. #
-                arrived = sorted( [ proc for proc in self._procs if proc._arrival == \
-                        self._ticker ], key = lambda obj : obj._pid )
+                arrived = sorted( self.get_arrivals( self._ticker ), \
+                        key = lambda obj : obj._pid )
 
             for proc in arrived:
                 self.ready( proc, srt )
@@ -326,17 +702,17 @@ class CPU:
     """
     def preempt_srt( self, proc ):
         # Check for I/O completion and new arrivals before context switch. #
-        io_done = sorted( [ p for p, tick in (self._io).items() \
-                if (tick == self._ticker and p not in self._ready and p != proc) ], \
+        io_done = sorted( [ p for p in self.get_io(self._ticker) \
+                if (p not in self._ready and p != proc) ], \
                 key = lambda obj : obj._pid )
         for p in io_done:
             self.ready( p, 1 )
-            del self._io[p]
+            self.unblock( p )
             print( ("time {}ms: Process {} completed I/O; added to ready " + \
                     "queue {}").format(self._ticker, p._pid, self.get_queue()) )
 
-        arrived = sorted( [ p for p in self._procs if (p._arrival == \
-                self._ticker and p not in self._ready and p != proc) ], key = \
+        arrived = sorted( [ p for p in self.get_arrivals(self._ticker) \
+                if (p not in self._ready and p != proc) ], key = \
                 lambda obj : obj._pid )
         for p in arrived:
             self.ready( p, 1 )
@@ -349,27 +725,24 @@ class CPU:
             self._ticker += 1
 
             # Find processes completed with I/O. #
-            io_done = sorted( [ p for p, tick in (self._io).items() \
-                    if tick == self._ticker ], key = lambda obj : (obj._remaining, \
-                    obj._pid) )
+            io_done = sorted( self.get_io( self._ticker ), \
+                    key = lambda obj : (obj._remaining, obj._pid) )
             for p in io_done:
                 self.ready( p, 1 )
-                del self._io[p]
+                self.unblock( p )
                 print( ("time {}ms: Process {} completed I/O; added to ready " + \
                         "queue {}").format(self._ticker, p._pid, self.get_queue()) )
 
             # Find process that have arrived to the CPU. #
-            arrived = sorted( [ p for p in self._procs if p._arrival == \
-                    self._ticker ], key = lambda obj : (obj._remaining, obj._pid) )
+            arrived = sorted( self.get_arrivals( self._ticker ), \
+                    key = lambda obj : (obj._remaining, obj._pid) )
             for p in arrived:
                 self.ready( p, 1 )
                 print( ("time {}ms: Process {} arrived and added to ready " + \
                         "queue {}").format(self._ticker, p._pid, self.get_queue()) )
 
         (self._curr)._last_readied = self._ticker
-        (self._ready).append( self._curr )
-        self._ready = deque( sorted( self._ready, key = lambda obj : \
-                (obj._remaining, obj._pid) ) )
+        self.enqueue( self._curr, 1 )
 
         # Check for I/O completion and new arrivals during context switch. #
         ## Second half of switch. ##
@@ -377,18 +750,17 @@ class CPU:
             self._ticker += 1
 
             # Find processes completed with I/O. #
-            io_done = sorted( [ p for p, tick in (self._io).items() \
-                    if tick == self._ticker ], key = lambda obj : (obj._remaining, \
-                    obj._pid) )
+            io_done = sorted( self.get_io( self._ticker ), \
+                    key = lambda obj : (obj._remaining, obj._pid) )
             for p in io_done:
                 self.ready( p, 1, 1 )
-                del self._io[p]
+                self.unblock( p )
                 print( ("time {}ms: Process {} completed I/O; added to ready " + \
                         "queue {}").format(self._ticker, p._pid, self.get_queue()) )
 
             # Find process that have arrived to the CPU. #
-            arrived = sorted( [ p for p in self._procs if p._arrival == \
-                    self._ticker ], key = lambda obj : (obj._remaining, obj._pid) )
+            arrived = sorted( self.get_arrivals( self._ticker ), \
+                    key = lambda obj : (obj._remaining, obj._pid) )
             for p in arrived:
                 self.ready( p, 1, 1 )
                 print( ("time {}ms: Process {} arrived and added to ready " + \
@@ -396,6 +768,7 @@ class CPU:
 
         # Add new process. #
         self._curr = proc
+        (self._ran).add( proc )
         (self._curr)._remaining -= 1
 
         self._context += 1
@@ -408,21 +781,22 @@ class CPU:
     :effects:   (1) process in self._curr is changed to first in self._ready.
                 (2) self._io is checked for processes finished on I/O.
                 (3) new process arrival is checked and added to self._ready and
-                    process originally in self._curr is appended to the end.
+                    process originally in self._curr is appended to the end
+                    (in CFS mode, queued by vruntime).
     """
     def preempt_rr( self ):
         # Check for I/O completion and new arrivals before context switch. #
-        io_done = sorted( [ proc for proc, tick in (self._io).items() \
-                if (tick == self._ticker and proc not in self._ready) ], key = \
+        io_done = sorted( [ proc for proc in self.get_io(self._ticker) \
+                if (proc not in self._ready) ], key = \
                 lambda obj : obj._pid )
         for proc in io_done:
             self.ready( proc, 0, rr_add )
-            del self._io[proc]
+            self.unblock( proc )
             print( ("time {}ms: Process {} completed I/O; added to ready " + \
                     "queue {}").format(self._ticker, proc._pid, self.get_queue()) )
 
-        arrived = sorted( [ proc for proc in self._procs if (proc._arrival == \
-                self._ticker and proc not in self._ready) ], key = \
+        arrived = sorted( [ proc for proc in self.get_arrivals(self._ticker) \
+                if (proc not in self._ready) ], key = \
                 lambda obj : obj._pid )
         for proc in arrived:
             self.ready( proc, 0, rr_add )
@@ -435,17 +809,17 @@ class CPU:
             self._ticker += 1
 
             # Find processes completed with I/O. #
-            io_done = sorted( [ proc for proc, tick in (self._io).items() \
-                    if tick == self._ticker ], key = lambda obj : obj._pid )
+            io_done = sorted( self.get_io( self._ticker ), \
+                    key = lambda obj : obj._pid )
             for proc in io_done:
                 self.ready( proc, 0, rr_add )
-                del self._io[proc]
+                self.unblock( proc )
                 print( ("time {}ms: Process {} completed I/O; added to ready " + \
                         "queue {}").format(self._ticker, proc._pid, self.get_queue()) )
 
             # Find process that have arrived to the CPU. #
-            arrived = sorted( [ proc for proc in self._procs if proc._arrival == \
-                    self._ticker ], key = lambda obj : obj._pid )
+            arrived = sorted( self.get_arrivals( self._ticker ), \
+                    key = lambda obj : obj._pid )
             for proc in arrived:
                 self.ready( proc, 0, rr_add )
                 print( ("time {}ms: Process {} arrived and added to ready " + \
@@ -455,7 +829,7 @@ class CPU:
         tmp = (self._ready).popleft()
 
         (self._curr)._last_readied = self._ticker
-        (self._ready).append( self._curr )
+        self.enqueue( self._curr )
 
         # Check for I/O completion and new arrivals during context switch. #
         ## Second half of switch. ##
@@ -463,17 +837,17 @@ class CPU:
             self._ticker += 1
 
             # Find processes completed with I/O. #
-            io_done = sorted( [ proc for proc, tick in (self._io).items() \
-                    if tick == self._ticker ], key = lambda obj : obj._pid )
+            io_done = sorted( self.get_io( self._ticker ), \
+                    key = lambda obj : obj._pid )
             for proc in io_done:
                 self.ready( proc, 0, rr_add )
-                del self._io[proc]
+                self.unblock( proc )
                 print( ("time {}ms: Process {} completed I/O; added to ready " + \
                         "queue {}").format(self._ticker, proc._pid, self.get_queue()) )
 
             # Find process that have arrived to the CPU. #
-            arrived = sorted( [ proc for proc in self._procs if proc._arrival == \
-                    self._ticker ], key = lambda obj : obj._pid )
+            arrived = sorted( self.get_arrivals( self._ticker ), \
+                    key = lambda obj : obj._pid )
             for proc in arrived:
                 self.ready( proc, 0, rr_add )
                 print( ("time {}ms: Process {} arrived and added to ready " + \
@@ -482,10 +856,33 @@ class CPU:
         self._curr = tmp
         (self._curr)._remaining -= 1
         # self._total_wait += ( self._ticker - (self._curr)._last_readied )
+        # CFS alone, as RR's wait matches the reference output without it. #
+        if ( self._cfs ):
+            self._total_wait += ( self._ticker - \
+                    (self._curr)._last_readied - (t_cs // 2) )
 
         self._context += 1
         self._preempt += 1
 
+
+    """
+    Charges the running process's CPU time since its last charge to its
+    vruntime, scaled by NICE_0 over its weight.
+    :modifies:  (1) self._curr, (2) self._min_vruntime
+    :effects:   (1) vruntime grows slower the heavier the process.
+                (2) min_vruntime moves up to the least vruntime runnable,
+                    never back.
+    """
+    def charge_cfs( self ):
+        ran = ( self._cfs_from - (self._curr)._remaining )
+        self._cfs_from = (self._curr)._remaining
+        (self._curr)._vruntime += ( ran * NICE_0 / (self._curr)._weight )
+
+        least = (self._curr)._vruntime
+        if ( self._ready ):
+            least = min( least, (self._ready[0])._vruntime )
+        self._min_vruntime = max( self._min_vruntime, least )
+
     # ------------------------------------------------------------------------ #
     # Overridden methods #
 
@@ -510,6 +907,397 @@ class CPU:
         return "{}ms: running {}, ready {}".format( self._ticker, self._curr._id, \
                 self.get_queue() )
 
+
+"""
+Core of a multi-core CPU; see MultiCPU.
+"""
+class Core:
+
+    """
+    Default constructor.
+    :param:     index, core number.
+                srt, boolean to keep the ready queue in SRT order.
+    """
+    def __init__( self, index, srt ):
+        self._index = index
+        self._ready = ( ReadyHeap() if srt else \
+                deque() )                       # ready queue for core #
+        self._curr = None                       # process switching or running #
+        self._state = IDLE                      # core state below #
+        self._token = 0                         # invalidates stale run events #
+        self._requeue = False                   # switching out a preempted process #
+        self._run_start = 0                     # most recent start of running #
+
+        # Per-core output details. #
+        self._busy = 0                          # time spent running bursts #
+        self._switching = 0                     # time spent switching #
+        self._bursts = 0                        # bursts completed #
+        self._migrations = 0                    # processes migrated in #
+
+    """
+    Load of core, for placement and balancing.
+    :return:    processes queued on or held by the core.
+    """
+    def load( self ):
+        return ( len(self._ready) + (self._curr != None) )
+
+
+"""
+Multi-core CPU. Unlike CPU, time moves from event to event on a heap of
+(time, kind, pid, sequence) entries; every event at one time is handled before
+idle cores take work and SRT preemptions are checked, so cores act in order
+of their index. A process switching in to a core other than the one it last
+ran on pays t_migrate on top of half of t_cs.
+
+Migration policies:
+    global      one shared ready queue that every core takes from.
+    steal       per-core ready queues; arrivals go to the least loaded core
+                and I/O completions to the core last run on; an idle core
+                with an empty queue steals from the tail of the longest.
+    rebalance   per-core ready queues placed as for steal; every t_balance
+                the longest queue's tail moves to the shortest until they
+                differ by at most one.
+"""
+class MultiCPU:
+
+    """
+    Default constructor.
+    :param:     procs, processes to schedule.
+                algo, "FCFS", "SRT" or "RR".
+                cores, number of cores.
+                policy, "global", "steal" or "rebalance".
+    """
+    def __init__( self, procs, algo, cores, policy ):
+        self._procs = procs                     # processes found in input file #
+        self._algo = algo
+        self._policy = policy
+        self._cores = [ Core(i, algo == "SRT") for i in range(cores) ]
+        self._global = ( ReadyHeap() if (algo == "SRT") else \
+                deque() )                       # ready queue for global policy #
+
+        # Helper details. #
+        self._total_burst = float( sum( [(proc._burst * proc._num) \
+                for proc in self._procs] ) )    # total burst time, calculated #
+        self._total_wait = float( 0 )           # total wait time #
+        self._total_turnaround = float( 0 )     # total turnaround time #
+        self._total_num = float( sum( [proc._num for proc in self._procs] ) )
+        self._done = 0                          # processes terminated #
+
+        # Simple output details. #
+        self._context = 0
+        self._preempt = 0
+        self._migrate = 0
+
+        # Event details. #
+        self._ticker = 0                        # time ticker #
+        self._events = []                       # heap of event tuples #
+        self._seq = 0                           # post count, breaks ties #
+        for proc in self._procs:
+            self.post( proc._arrival, ARRIVE, proc )
+        if ( policy == "rebalance" ):
+            self.post( t_balance, BALANCE, None )
+
+    # ------------------------------------------------------------------------ #
+    # Accessors #
+
+    """
+    Ready queue a core takes from.
+    :param:     core, Core to check.
+    :return:    the global queue, or core's own.
+    """
+    def get_queue( self, core ):
+        return ( self._global if (self._policy == "global") else core._ready )
+
+
+    """
+    Per-core and balance results.
+    :return:    two-tuple of list of (utilization, bursts, migrations in) per
+                core and load imbalance, the busiest core's running time over
+                the mean less one.
+    """
+    def get_balance( self ):
+        end = float( max(self._ticker, 1) )
+        busy = [ core._busy for core in self._cores ]
+        mean = ( sum(busy) / len(busy) )
+        return ( [ (core._busy / end, core._bursts, core._migrations) for core \
+                in self._cores ], ((max(busy) / mean - 1) if mean else 0.0) )
+
+    # ------------------------------------------------------------------------ #
+    # Modifiers #
+
+    """
+    Schedules an event.
+    :param:     tick, time of event.
+                kind, event kind; lower kinds go first at equal times.
+                data, process or (Core, token) for the event.
+    :modifies:  self._events
+    """
+    def post( self, tick, kind, data ):
+        tie = ( data._pid if (kind in (ARRIVE, IO_DONE)) else "" )
+        heapq.heappush( self._events, (tick, kind, tie, self._seq, data) )
+        self._seq += 1
+
+
+    """
+    Adds process to a ready queue.
+    :param:     proc, readying process.
+                core, Core last run on, or None to place on the least loaded.
+    :modifies:  self._global or a core's ready queue.
+    """
+    def ready( self, proc, core = None ):
+        proc._last_readied = self._ticker
+        if ( self._policy != "global" ):
+            if ( core == None ):
+                core = min( self._cores, key = lambda c : (c.load(), c._index) )
+            queue = core._ready
+
+        else:
+            queue = self._global
+
+        if ( self._algo == "SRT" ):
+            queue.push( proc )
+
+        elif ( (self._algo == "RR") and (rr_add) ):
+            queue.appendleft( proc )
+
+        else:
+            queue.append( proc )
+
+
+    """
+    Starts switching a process in to each idle core that can find one.
+    :modifies:  self._cores, self._events
+    """
+    def dispatch( self ):
+        for core in self._cores:
+            if ( core._state != IDLE ):
+                continue
+
+            proc = None
+            queue = self.get_queue( core )
+            if ( queue ):
+                proc = queue.popleft()
+
+            elif ( self._policy == "steal" ):
+                victim = max( self._cores, key = lambda c : (len(c._ready), \
+                        -c._index) )
+                if ( victim._ready ):
+                    proc = (victim._ready).pop()
+                    if ( not quiet ):
+                        print( ("time {}ms: Core {} stole process {} from " + \
+                                "core {}").format(self._ticker, core._index, \
+                                proc._pid, victim._index) )
+
+            if ( proc == None ):
+                continue
+
+            cost = ( t_cs // 2 )
+            if ( (proc._core >= 0) and (proc._core != core._index) ):
+                cost += t_migrate
+                core._migrations += 1
+                self._migrate += 1
+
+            self._total_wait += ( self._ticker - proc._last_readied )
+            self._context += 1
+            proc._core = core._index
+            core._curr = proc
+            core._state = SWITCHING_IN
+            core._token += 1
+            core._switching += cost
+            self.post( self._ticker + cost, SWITCHED_IN, (core, core._token) )
+
+
+    """
+    Starts switching the running process out of a core.
+    :param:     core, Core to switch out of.
+                requeue, boolean to ready the process again once out.
+    :modifies:  core, self._events
+    """
+    def switch_out( self, core, requeue ):
+        core._state = SWITCHING_OUT
+        core._requeue = requeue
+        core._token += 1
+        core._switching += ( t_cs // 2 )
+        self.post( self._ticker + (t_cs // 2), SWITCHED_OUT, (core, core._token) )
+
+
+    """
+    Runs the process a core holds until its burst or slice ends.
+    :param:     core, Core running.
+    :modifies:  self._events
+    """
+    def run_slice( self, core ):
+        core._run_start = self._ticker
+        left = (core._curr)._remaining
+        if ( (self._algo == "RR") and (t_slice < left) ):
+            self.post( self._ticker + t_slice, SLICE, (core, core._token) )
+
+        else:
+            self.post( self._ticker + left, BURST, (core, core._token) )
+
+
+    """
+    Charges a core for the time its process has run since it last started.
+    :param:     core, Core running.
+    :modifies:  core, core._curr
+    """
+    def charge( self, core ):
+        ran = ( self._ticker - core._run_start )
+        core._busy += ran
+        (core._curr)._remaining -= ran
+        core._run_start = self._ticker
+
+
+    """
+    SRT preemption check after each event time. With per-core queues, each
+    running core is preempted by its own queue's head if that has less time
+    left; with the global queue, the core with the most time left is, at most
+    once per event time.
+    :modifies:  self._cores, self._events
+    """
+    def preempt_srt( self ):
+        running = [ core for core in self._cores if (core._state == RUNNING) ]
+        if ( self._policy == "global" ):
+            running = sorted( running, key = lambda c : (-((c._curr)._remaining - \
+                    (self._ticker - c._run_start)), c._index) )[ :1 ]
+
+        for core in running:
+            queue = self.get_queue( core )
+            left = ( (core._curr)._remaining - (self._ticker - core._run_start) )
+            if ( (queue) and (queue[0]._remaining < left) ):
+                if ( not quiet ):
+                    print( ("time {}ms: Core {}: Process {} will preempt " + \
+                            "{}").format(self._ticker, core._index, \
+                            queue[0]._pid, (core._curr)._pid) )
+                self.charge( core )
+                self._preempt += 1
+                self.switch_out( core, True )
+
+
+    """
+    Moves processes from the longest ready queues to the shortest.
+    :modifies:  self._cores
+    """
+    def rebalance( self ):
+        while 1:
+            longest = max( self._cores, key = lambda c : (len(c._ready), -c._index) )
+            shortest = min( self._cores, key = lambda c : (len(c._ready), c._index) )
+            if ( len(longest._ready) - len(shortest._ready) <= 1 ):
+                break
+
+            proc = (longest._ready).pop()
+            if ( self._algo == "SRT" ):
+                (shortest._ready).push( proc )
+            else:
+                (shortest._ready).append( proc )
+            if ( not quiet ):
+                print( ("time {}ms: Process {} moved from core {} to " + \
+                        "core {}").format(self._ticker, proc._pid, \
+                        longest._index, shortest._index) )
+
+
+    """
+    Handles one event.
+    :param:     kind, event kind.
+                data, process or (Core, token) for the event.
+    :modifies:  self._cores, self._events, simple output details.
+    """
+    def handle( self, kind, data ):
+        if ( kind in (ARRIVE, IO_DONE) ):
+            data._readied = self._ticker
+            if ( kind == ARRIVE ):
+                self.ready( data )
+                msg = "arrived and added to ready queue"
+
+            else:
+                self.ready( data, (None if (data._core < 0) else \
+                        self._cores[data._core]) )
+                msg = "completed I/O; added to ready queue"
+            if ( not quiet ):
+                print( "time {}ms: Process {} {}".format(self._ticker, \
+                        data._pid, msg) )
+            return
+
+        if ( kind == BALANCE ):
+            self.rebalance()
+            if ( self._done < len(self._procs) ):
+                self.post( self._ticker + t_balance, BALANCE, None )
+            return
+
+        core, token = data
+        if ( token != core._token ):
+            return
+
+        proc = core._curr
+        if ( kind == SWITCHED_IN ):
+            core._state = RUNNING
+            if ( not quiet ):
+                print( ("time {}ms: Core {}: Process {} started using the CPU" + \
+                        "{}").format(self._ticker, core._index, proc._pid, \
+                        ("" if (proc._remaining == proc._burst) else \
+                        " with {}ms remaining".format(proc._remaining))) )
+            self.run_slice( core )
+
+        elif ( kind == SLICE ):
+            self.charge( core )
+            if ( self.get_queue(core) ):
+                if ( not quiet ):
+                    print( ("time {}ms: Core {}: Time slice expired; process {} " + \
+                            "preempted with {}ms to go").format(self._ticker, \
+                            core._index, proc._pid, proc._remaining) )
+                self._preempt += 1
+                self.switch_out( core, True )
+
+            else:
+                if ( not quiet ):
+                    print( ("time {}ms: Core {}: Time slice expired; no " + \
+                            "preemption because ready queue is empty").format( \
+                            self._ticker, core._index) )
+                self.run_slice( core )
+
+        elif ( kind == BURST ):
+            self.charge( core )
+            core._bursts += 1
+            proc._num -= 1
+            self._total_turnaround += ( self._ticker + (t_cs // 2) - proc._readied )
+            if ( proc._num > 0 ):
+                proc._remaining = proc._burst
+                self.post( self._ticker + (t_cs // 2) + proc._io, IO_DONE, proc )
+                if ( not quiet ):
+                    print( ("time {}ms: Core {}: Process {} completed a CPU " + \
+                            "burst; {} burst{} to go").format(self._ticker, \
+                            core._index, proc._pid, proc._num, ('s' if \
+                            proc._num != 1 else '')) )
+
+            elif ( not quiet ):
+                print( "time {}ms: Core {}: Process {} terminated".format( \
+                        self._ticker, core._index, proc._pid) )
+            self.switch_out( core, False )
+
+        elif ( kind == SWITCHED_OUT ):
+            core._curr = None
+            core._state = IDLE
+            if ( core._requeue ):
+                self.ready( proc, core )
+            elif ( proc._num == 0 ):
+                self._done += 1
+
+
+    """
+    Runs the simulation to the end.
+    :modifies:  everything.
+    """
+    def run( self ):
+        while ( (self._done < len(self._procs)) and (self._events) ):
+            self._ticker = self._events[0][0]
+            while ( (self._events) and (self._events[0][0] == self._ticker) ):
+                _, kind, _, _, data = heapq.heappop( self._events )
+                self.handle( kind, data )
+
+            self.dispatch()
+            if ( self._algo == "SRT" ):
+                self.preempt_srt()
+
 # ---------------------------------------------------------------------------- #
 
 """
@@ -534,7 +1322,8 @@ def run_fcfs( procs ):
                             (cpu._curr)._pid, (cpu._curr)._num, \
                             ('s' if (cpu._curr)._num != 1 else ''), cpu.get_queue() ) )
 
-                    cpu._io[cpu._curr] = ( cpu._ticker + (cpu._curr)._io + (t_cs // 2) )
+                    cpu.block( cpu._curr, cpu._ticker + (cpu._curr)._io + \
+                            (t_cs // 2) )
                     print( ("time {}ms: Process {} switching out of CPU; will " + \
                             "block on I/O until time {}ms {}").format(cpu._ticker, \
                             (cpu._curr)._pid, cpu._io[cpu._curr], cpu.get_queue()) )
@@ -551,16 +1340,15 @@ def run_fcfs( procs ):
                 # (cpu._curr)._remaining > 0 #
                 (cpu._curr)._remaining -= 1
 
-        io_done = sorted( [ proc for proc, tick in (cpu._io).items() if tick == \
-                cpu._ticker ], key = lambda obj : obj._pid )
+        io_done = sorted( cpu.get_io( cpu._ticker ), key = lambda obj : obj._pid )
         for proc in io_done:
             cpu.ready( proc )
-            del cpu._io[proc]
+            cpu.unblock( proc )
             print( ("time {}ms: Process {} completed I/O; added to ready queue " + \
                     "{}").format(cpu._ticker, proc._pid, cpu.get_queue()) )
 
-        arrived = sorted( [ proc for proc in cpu._procs if proc._arrival == \
-                cpu._ticker ], key = lambda obj : obj._pid )
+        arrived = sorted( cpu.get_arrivals( cpu._ticker ), \
+                key = lambda obj : obj._pid )
         for proc in arrived:
             proc._last_arrival = cpu._ticker
             cpu.ready( proc )
@@ -581,7 +1369,7 @@ def run_fcfs( procs ):
         if ( len(cpu._finished) == n ):
             break
 
-        cpu._ticker += 1
+        cpu.jump()
 
     print( "time {}ms: Simulator ended for FCFS\n".format(cpu._ticker) )
     cpu._avg_wait = cpu._total_wait / cpu._total_num
@@ -596,7 +1384,7 @@ Shortest remaining time simulation.
 :return:    five-tuple with simple output tracking variables.
 """
 def run_srt( procs ):
-    cpu = CPU( copy.deepcopy(procs) )
+    cpu = CPU( copy.deepcopy(procs), 1 )
     print( "time {}ms: Simulator started for SRT {}".format(cpu._ticker, \
         cpu.get_queue()) )
 
@@ -613,7 +1401,8 @@ def run_srt( procs ):
                             ('s' if (cpu._curr)._num != 1 else ''), cpu.get_queue() ) )
 
                     (cpu._curr)._remaining = (cpu._curr)._burst
-                    cpu._io[cpu._curr] = ( cpu._ticker + (cpu._curr)._io + (t_cs // 2) )
+                    cpu.block( cpu._curr, cpu._ticker + (cpu._curr)._io + \
+                            (t_cs // 2) )
                     print( ("time {}ms: Process {} switching out of CPU; will " + \
                             "block on I/O until time {}ms {}").format(cpu._ticker, \
                             (cpu._curr)._pid, cpu._io[cpu._curr], cpu.get_queue()) )
@@ -630,8 +1419,8 @@ def run_srt( procs ):
                 # (cpu._curr)._remaining > 0 #
                 (cpu._curr)._remaining -= 1
 
-        io_done = sorted( [ proc for proc, tick in (cpu._io).items() if tick == \
-                cpu._ticker ], key = lambda obj : (obj._remaining, obj._pid) )
+        io_done = sorted( cpu.get_io( cpu._ticker ), \
+                key = lambda obj : (obj._remaining, obj._pid) )
         if ( io_done ):
             if ( (cpu._curr) and (not removed) ):
                 if ( io_done[0]._remaining < (cpu._curr)._remaining ):
@@ -648,7 +1437,7 @@ def run_srt( procs ):
                 print( ("time {}ms: Process {} completed I/O; added to ready " + \
                         "queue {}").format(cpu._ticker, proc._pid, cpu.get_queue()) )
 
-        arrived = sorted( [ proc for proc in cpu._procs if proc._arrival == cpu._ticker ],
+        arrived = sorted( cpu.get_arrivals( cpu._ticker ),
                 key = lambda obj : (obj._remaining, obj._pid) )
         if ( arrived ):
             if ( (cpu._curr) and (not removed) ):
@@ -688,7 +1477,7 @@ def run_srt( procs ):
         if ( len(cpu._finished) == n ):
             break
 
-        cpu._ticker += 1
+        cpu.jump()
 
     print( "time {}ms: Simulator ended for SRT\n".format(cpu._ticker) )
     cpu._avg_wait = cpu._total_wait / cpu._total_num
@@ -728,7 +1517,8 @@ def run_rr( procs ):
                             (cpu._curr)._pid, (cpu._curr)._num, \
                             ('s' if (cpu._curr)._num != 1 else ''), cpu.get_queue() ) )
 
-                    cpu._io[cpu._curr] = ( cpu._ticker + (cpu._curr)._io + (t_cs // 2) )
+                    cpu.block( cpu._curr, cpu._ticker + (cpu._curr)._io + \
+                            (t_cs // 2) )
                     (cpu._curr)._remaining = (cpu._curr)._burst
                     print( ("time {}ms: Process {} switching out of CPU; will " + \
                             "block on I/O until time {}ms {}").format( cpu._ticker, \
@@ -774,16 +1564,15 @@ def run_rr( procs ):
                 (cpu._curr)._remaining -= 1
                 cpu._t_slice -= 1
 
-        io_done = sorted( [ proc for proc, tick in (cpu._io).items() if tick <= \
-                cpu._ticker ], key = lambda obj : obj._pid )
+        io_done = sorted( cpu.get_io( cpu._ticker ), key = lambda obj : obj._pid )
         for proc in io_done:
             cpu.ready( proc, 0, rr_add )
-            del cpu._io[proc]
+            cpu.unblock( proc )
             print( ("time {}ms: Process {} completed I/O; added to ready queue " + \
                     "{}").format(cpu._ticker, proc._pid, cpu.get_queue()) )
 
-        arrived = sorted( [ proc for proc in cpu._procs if proc._arrival == \
-                cpu._ticker ], key = lambda obj : obj._pid )
+        arrived = sorted( cpu.get_arrivals( cpu._ticker ), \
+                key = lambda obj : obj._pid )
         for proc in arrived:
             cpu.ready( proc, 0, rr_add )
             print( ("time {}ms: Process {} arrived and added to ready queue " + \
@@ -811,7 +1600,7 @@ def run_rr( procs ):
         if ( len(cpu._finished) == n ):
             break
 
-        cpu._ticker += 1
+        cpu.jump( 1 )
 
     print( "time {}ms: Simulator ended for RR".format(cpu._ticker) )
     cpu._avg_wait = cpu._total_wait / cpu._total_num
@@ -819,37 +1608,376 @@ def run_rr( procs ):
     return ( cpu._avg_burst, cpu._avg_wait, cpu._avg_turnaround, \
             cpu._context, cpu._preempt )
 
+
+"""
+Completely fair simulation, after Linux's CFS. The ready queue is ordered by
+vruntime, CPU time weighted by nice level. A running process gets a slice of
+the target latency in proportion to its weight, and at the end of the slice
+gives the CPU up only if a queued process has run less; see CPU.get_slice,
+CPU.ready and CPU.charge_cfs.
+:param:     procs, list of Process objects to simulate.
+:return:    five-tuple with simple output tracking variables.
+"""
+def run_cfs( procs ):
+    cpu = CPU( copy.deepcopy(procs), 0, 1 )
+    print( "time {}ms: Simulator started for CFS {}".format(cpu._ticker, \
+            cpu.get_queue()) )
+
+    while 1:
+        removed = False
+        if ( cpu._curr != None ):
+            # Check for finished process. #
+            if ( (cpu._curr)._remaining <= 0 ):
+                cpu.charge_cfs()
+                (cpu._curr)._num -= 1
+                if ( (cpu._curr)._num > 0 ):
+                    print( ("time {}ms: Process {} completed a CPU burst; {} " + \
+                            "burst{} to go {}").format( cpu._ticker, \
+                            (cpu._curr)._pid, (cpu._curr)._num, \
+                            ('s' if (cpu._curr)._num != 1 else ''), cpu.get_queue() ) )
+
+                    cpu.block( cpu._curr, cpu._ticker + (cpu._curr)._io + \
+                            (t_cs // 2) )
+                    (cpu._curr)._remaining = (cpu._curr)._burst
+                    print( ("time {}ms: Process {} switching out of CPU; will " + \
+                            "block on I/O until time {}ms {}").format( cpu._ticker, \
+                            (cpu._curr)._pid, cpu._io[cpu._curr], cpu.get_queue() ) )
+
+                else:
+                    # (cpu._curr)._num <= 0 #
+                    print( "time {}ms: Process {} terminated {}".format(cpu._ticker, \
+                            (cpu._curr)._pid, cpu.get_queue()) )
+                    cpu._finished[cpu._curr] = cpu._ticker
+
+                removed = True
+
+            elif ( cpu._t_slice <= 0 ):
+                cpu.charge_cfs()
+                if ( (not cpu._ready) or ((cpu._ready[0])._vruntime >= \
+                        (cpu._curr)._vruntime) ):
+                    cpu._t_slice = ( cpu.get_slice() - 1 )
+                    (cpu._curr)._remaining -= 1
+                    print( ("time {}ms: Time slice expired; no preemption " + \
+                            "because process {} has run least {}").format( \
+                            cpu._ticker, (cpu._curr)._pid, cpu.get_queue()) )
+
+                else:
+                    print( ("time {}ms: Time slice expired; process {} preempted " + \
+                            "with {}ms to go {}").format(cpu._ticker, \
+                            (cpu._curr)._pid, cpu._curr._remaining, cpu.get_queue()) )
+                    cpu.preempt_rr()
+                    cpu._t_slice = ( cpu.get_slice() - 1 )
+                    if ( (cpu._curr)._remaining >= ((cpu._curr)._burst - 1) ):
+                        (cpu._curr)._remaining = ( (cpu._curr)._burst - 1 )
+                        print( ("time {}ms: Process {} started using the " + \
+                                "CPU {}").format(cpu._ticker, (cpu._curr)._pid, \
+                                cpu.get_queue()) )
+
+                    else:
+                        # (cpu._curr)._remaining != (cpu._curr)._burst #
+                        print( ("time {}ms: Process {} started using the " + \
+                                "CPU with {}ms remaining {}").format( \
+                                cpu._ticker, (cpu._curr)._pid, \
+                                ((cpu._curr)._remaining + 1), cpu.get_queue() ) )
+                    cpu._cfs_from = ( (cpu._curr)._remaining + 1 )
+
+            else:
+                # (cpu._curr)._remaining > 0 #
+                (cpu._curr)._remaining -= 1
+                cpu._t_slice -= 1
+
+        io_done = sorted( cpu.get_io( cpu._ticker ), key = lambda obj : obj._pid )
+        for proc in io_done:
+            cpu.ready( proc )
+            cpu.unblock( proc )
+            print( ("time {}ms: Process {} completed I/O; added to ready queue " + \
+                    "{}").format(cpu._ticker, proc._pid, cpu.get_queue()) )
+
+        arrived = sorted( cpu.get_arrivals( cpu._ticker ), \
+                key = lambda obj : obj._pid )
+        for proc in arrived:
+            cpu.ready( proc )
+            print( ("time {}ms: Process {} arrived and added to ready queue " + \
+                    "{}").format(cpu._ticker, proc._pid, cpu.get_queue()) )
+
+        if ( removed ):
+            cpu.remove()
+
+        if ( cpu._curr == None ):
+            if ( cpu._ready ):
+                cpu.add()
+                cpu._t_slice = ( cpu.get_slice() - 1 )
+                if ( (cpu._curr)._remaining == (cpu._curr)._burst ):
+                    (cpu._curr)._remaining = ( (cpu._curr)._burst - 1 )
+                    print( "time {}ms: Process {} started using the CPU {}".format(\
+                        cpu._ticker, (cpu._curr)._pid, cpu.get_queue()) )
+
+                else:
+                    (cpu._curr)._remaining -= 1
+                    print( ("time {}ms: Process {} started using the CPU with " + \
+                            "{}ms remaining {}").format( cpu._ticker, \
+                            (cpu._curr)._pid, ((cpu._curr)._remaining + 1), \
+                            cpu.get_queue() ) )
+                cpu._cfs_from = ( (cpu._curr)._remaining + 1 )
+
+        if ( len(cpu._finished) == n ):
+            break
+
+        cpu.jump( 1 )
+
+    print( "time {}ms: Simulator ended for CFS".format(cpu._ticker) )
+    cpu._avg_wait = cpu._total_wait / cpu._total_num
+    cpu._avg_turnaround = cpu._total_turnaround / cpu._total_num
+    return ( cpu._avg_burst, cpu._avg_wait, cpu._avg_turnaround, \
+            cpu._context, cpu._preempt )
+
+
+"""
+Multi-core simulation.
+:param:     procs, list of Process objects to simulate.
+            algo, "FCFS", "SRT" or "RR".
+            cores, number of cores.
+            policy, "global", "steal" or "rebalance".
+:return:    eight-tuple of the five simple output tracking variables, the
+            number of migrations, a list of (utilization, bursts, migrations
+            in) per core, and load imbalance.
+"""
+def run_multi( procs, algo, cores, policy ):
+    cpu = MultiCPU( copy.deepcopy(procs), algo, cores, policy )
+    if ( not quiet ):
+        print( "time {}ms: Simulator started for {} on {} cores ({})".format( \
+                cpu._ticker, algo, cores, policy) )
+
+    cpu.run()
+
+    if ( not quiet ):
+        print( "time {}ms: Simulator ended for {}\n".format(cpu._ticker, algo) )
+    per_core, imbalance = cpu.get_balance()
+    return ( cpu._total_burst / cpu._total_num, cpu._total_wait / cpu._total_num, \
+            cpu._total_turnaround / cpu._total_num, cpu._context, cpu._preempt, \
+            cpu._migrate, per_core, imbalance )
+
+
+"""
+Reads processes from input file.
+:param:     path, input file.
+:return:    list of Process objects, or None if the file is missing or invalid.
+"""
+def read_procs( path ):
+    try:
+        f_in = open( path, 'r' )
+    except:
+        return None
+
+    procs = []
+    for line in f_in:
+        if ( (line[0] != '#') and (line[0] != '\n') ):
+            line = line.strip().split('|')
+            try:
+                tmp = [ int(line[i]) for i in range(1, 5) ]
+                nice = ( int(line[5]) if (len(line) > 5) else 0 )
+                if ( (nice < -20) or (nice > 19) ):
+                    raise ValueError
+                procs.append( Process(line[0], tmp[0], tmp[1], tmp[2], tmp[3], \
+                        nice) )
+            except:
+                f_in.close()
+                return None
+
+    f_in.close()
+    return procs
+
+
+"""
+Parses a sweep parameter.
+:param:     text, comma-separated list of values or lo:hi:step ranges.
+            least, smallest value allowed.
+:return:    sorted list of distinct values.
+:raises:    ValueError if text is malformed or a value is below least.
+"""
+def parse_values( text, least ):
+    values = set()
+    for part in text.split( ',' ):
+        bounds = [ int(b) for b in part.split(':') ]
+        if ( len(bounds) == 1 ):
+            values.add( bounds[0] )
+        elif ( (len(bounds) == 3) and (bounds[2] > 0) ):
+            values.update( range(bounds[0], bounds[1] + 1, bounds[2]) )
+        else:
+            raise ValueError
+
+    if ( (not values) or (min(values) < least) ):
+        raise ValueError
+
+    return sorted( values )
+
+
+"""
+Sweep worker setup; output goes nowhere.
+"""
+def sweep_init():
+    global quiet
+    quiet = 1
+    sys.stdout = open( os.devnull, 'w' )
+
+
+"""
+Sweep worker; runs one simulation.
+:param:     task, six-tuple of input file, processes, algorithm, t_cs, t_slice
+                and rr_add (None where the algorithm does not use it).
+:return:    CSV row for the simulation.
+"""
+def sweep_run( task ):
+    global n, t_cs, t_slice, rr_add
+    path, procs, algo, t_cs, slice_, add = task
+    n = len( procs )
+    t_slice = ( slice_ if (slice_ is not None) else 80 )
+    rr_add = bool( add )
+
+    row = { "input" : path, "algorithm" : algo, "t_cs" : t_cs,
+            "t_slice" : ("" if slice_ is None else slice_),
+            "rr_add" : ("" if add is None else ("BEGINNING" if add else "END")) }
+    try:
+        res = { "FCFS" : run_fcfs, "SRT" : run_srt, "RR" : run_rr,
+                "CFS" : run_cfs }[ algo ]( procs )
+    except Exception as e:
+        row["status"] = type( e ).__name__
+        return row
+
+    row.update( { "status" : "ok",
+                  "avg_burst_ms" : "{0:.2f}".format(res[0]),
+                  "avg_wait_ms" : "{0:.2f}".format(res[1]),
+                  "avg_turnaround_ms" : "{0:.2f}".format(res[2]),
+                  "context_switches" : res[3], "preemptions" : res[4] } )
+    return row
+
+
+"""
+Parameter sweep across every CPU.
+:param:     out, path of CSV file to write.
+            cs_values, slice_values, add_values, lists of t_cs, t_slice and
+                rr_add to try.
+            paths, input files.
+:return:    number of simulations run.
+"""
+def sweep( out, cs_values, slice_values, add_values, paths ):
+    tasks = []
+    for path in paths:
+        procs = read_procs( path )
+        if ( procs is None ):
+            sys.exit( "ERROR: Invalid input file format" )
+
+        for cs in cs_values:
+            tasks.append( (path, procs, "FCFS", cs, None, None) )
+            tasks.append( (path, procs, "SRT", cs, None, None) )
+            tasks += [ (path, procs, "RR", cs, s, a) for s in slice_values \
+                    for a in add_values ]
+            tasks.append( (path, procs, "CFS", cs, None, None) )
+
+    try:
+        f_out = open( out, 'w', newline = '' )
+    except:
+        sys.exit( "ERROR: Invalid output file" )
+
+    # Longest first, so one big simulation does not finish the sweep alone. #
+    order = sorted( range(len(tasks)), key = lambda i : -sum( [proc._burst * \
+            proc._num + proc._io * (proc._num - 1) for proc in tasks[i][1]] ) )
+    with multiprocessing.Pool( initializer = sweep_init ) as pool:
+        rows = pool.map( sweep_run, [ tasks[i] for i in order ], chunksize = 1 )
+
+    rows = [ row for _, row in sorted( zip(order, rows) ) ]
+    writer = csv.DictWriter( f_out, fieldnames = SWEEP_FIELDS )
+    writer.writeheader()
+    writer.writerows( rows )
+    f_out.close()
+    return len( rows )
+
 # ---------------------------------------------------------------------------- #
 
 if ( __name__ == "__main__" ):
-    if ( ( len(sys.argv) == 3 ) or ( len(sys.argv) == 4 ) ):
-        # Set rr_add according to optional third argument. #
-        if ( len(sys.argv) == 4 ):
-            rr_add = ( sys.argv[3] == "BEGINNING" )
+    # A trailing --cfs adds CFS to a plain run. #
+    cfs = ( (len(sys.argv) > 3) and (sys.argv[-1] == "--cfs") )
+    args = ( sys.argv[ :-1 ] if (cfs) else sys.argv )
 
-        # Check for valid input file and read in processes. #
+    if ( (len(sys.argv) > 1) and (sys.argv[1] == "--sweep") ):
         try:
-            f_in = open( sys.argv[1], 'r' )
-        except:
+            if ( len(sys.argv) < 7 ):
+                raise ValueError
+
+            cs_values = parse_values( sys.argv[3], 0 )
+            slice_values = parse_values( sys.argv[4], 1 )
+            add_values = sorted( set( [ {"END" : 0, "BEGINNING" : 1}[a] \
+                    for a in sys.argv[5].split(',') ] ) )
+        except ( ValueError, KeyError ):
+            sys.exit( "ERROR: Invalid arguments\nUSAGE: ./a.out --sweep " + \
+                    "<csv-output-file> <t-cs> <t-slice> <rr-add> <input-file> " + \
+                    "[<input-file> ...]" )
+
+        count = sweep( sys.argv[2], cs_values, slice_values, add_values,
+                sys.argv[6:] )
+        print( "Wrote {} simulations to {}".format(count, sys.argv[2]) )
+        sys.exit()
+
+    elif ( (len(sys.argv) > 1) and (sys.argv[1] == "--cores") ):
+        try:
+            if ( (len(sys.argv) < 6) or (len(sys.argv) > 9) ):
+                raise ValueError
+
+            cores = int( sys.argv[2] )
+            policy = sys.argv[3]
+            extra = [ int(a) for a in sys.argv[6:] ]
+            if ( (cores < 1) or (policy not in ("global", "steal", "rebalance")) \
+                    or (min(extra + [1]) < 0) or (extra[2:] and (extra[2] < 1)) ):
+                raise ValueError
+
+            t_cs, t_migrate, t_balance = ( extra + [t_cs, t_migrate, \
+                    t_balance][len(extra):] )
+        except ValueError:
+            sys.exit( "ERROR: Invalid arguments\nUSAGE: ./a.out --cores <n> " + \
+                    "<policy> <input-file> <stats-output-file> [<t-cs> " + \
+                    "[<t-migrate> [<t-balance>]]]" )
+
+        procs = read_procs( sys.argv[4] )
+        if ( procs is None ):
             sys.exit( "ERROR: Invalid input file format" )
+        n = len( procs )
 
-        procs = []
-        for line in f_in:
-            if ( (line[0] != '#') and (line[0] != '\n') ):
-                line = line.strip().split('|')
-                try:
-                    tmp = [ int(line[i]) for i in range(1, 5) ]
-                    procs.append( Process(line[0], tmp[0], tmp[1], tmp[2], tmp[3]) )
-                    n += 1
-                except:
-                    f_in.close()
-                    sys.exit( "ERROR: Invalid input file format" )
+        try:
+            f_out = open( sys.argv[5], 'w' )
+        except:
+            sys.exit( "ERROR: Invalid output file" )
 
-        f_in.close()
+        for algo in ( "FCFS", "SRT", "RR" ):
+            res = run_multi( procs, algo, cores, policy )
+            f_out.write( "Algorithm {}\n".format(algo) )
+            f_out.write( "-- average CPU burst time: {0:.2f} ms\n".format(res[0]) )
+            f_out.write( "-- average wait time: {0:.2f} ms\n".format(res[1]) )
+            f_out.write( "-- average turnaround time: {0:.2f} ms\n".format(res[2]) )
+            f_out.write( "-- total number of context switches: {}\n".format(res[3]) )
+            f_out.write( "-- total number of preemptions: {}\n".format(res[4]) )
+            f_out.write( "-- total number of migrations: {}\n".format(res[5]) )
+            f_out.write( "-- load imbalance: {0:.2f}\n".format(res[7]) )
+            f_out.write( "-- core utilization: {}\n".format(" ".join( [ \
+                    "{0:.1f}%".format(100 * util) for util, _, _ in res[6] ] )) )
+
+        f_out.close()
+
+        sys.exit()
+
+    elif ( ( len(args) == 3 ) or ( len(args) == 4 ) ):
+        # Set rr_add according to optional third argument. #
+        if ( len(args) == 4 ):
+            rr_add = ( args[3] == "BEGINNING" )
+
+        # Check for valid input file and read in processes. #
+        procs = read_procs( args[1] )
+        if ( procs is None ):
+            sys.exit( "ERROR: Invalid input file format" )
+        n = len( procs )
 
         # Check for valid output file. #
         try:
-            f_out = open( sys.argv[2], 'w' )
+            f_out = open( args[2], 'w' )
         except:
             sys.exit( "ERROR: Invalid output file" )
 
@@ -857,6 +1985,9 @@ if ( __name__ == "__main__" ):
         simout["FCFS"] = run_fcfs( procs )
         simout["SRT"] = run_srt( procs )
         simout["RR"] = run_rr( procs )
+        if ( cfs ):
+            print()
+            simout["CFS"] = run_cfs( procs )
 
         # Write results to simple output file. #
         for algo, res in sorted( simout.items(), key = lambda t : (not len(t[0])) ):
@@ -872,6 +2003,10 @@ if ( __name__ == "__main__" ):
         sys.exit()
 
     else:
-        # (len(sys.argv) != 3) and (len(sys.argv) != 4) #
+        # (len(args) != 3) and (len(args) != 4) #
         sys.exit( "ERROR: Invalid arguments\nUSAGE: ./a.out <input-file> " + \
-                "<stats-output-file> [<rr-add>]" )
+                "<stats-output-file> [<rr-add>] [--cfs]\n       ./a.out --sweep " + \
+                "<csv-output-file> <t-cs> <t-slice> <rr-add> <input-file> " + \
+                "[<input-file> ...]\n       ./a.out --cores <n> <policy> " + \
+                "<input-file> <stats-output-file> [<t-cs> [<t-migrate> " + \
+                "[<t-balance>]]]" )
@@ -9,9 +9,15 @@
    localhost; and the port number must match what
    the server reports.
 
+   Datagrams are read and echoed in batches of up to
+   BATCH with recvmmsg() and sendmmsg(), so a burst
+   costs two system calls rather than two per datagram.
+
 */
    
 
+#define _GNU_SOURCE   /* recvmmsg() and sendmmsg() */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -20,6 +26,7 @@
 #include <arpa/inet.h>
 
 #define MAXBUFFER 8192
+#define BATCH 32
 
 int main()
 {
@@ -64,33 +71,66 @@ int main()
 
 
   /* the code below implements the application protocol */
-  int n;
-  char buffer[ MAXBUFFER ];
-  struct sockaddr_in client;
-  int len = sizeof( client );
+  int n, i, sent;
+  static char buffer[ BATCH ][ MAXBUFFER + 1 ];
+  struct sockaddr_in client[ BATCH ];
+  struct iovec iov[ BATCH ];
+  struct mmsghdr msgs[ BATCH ];
+
+  /* one preallocated slot per datagram in a batch; replies reuse
+     the same slots, since each echo goes back where it came from */
+  for ( i = 0 ; i < BATCH ; i++ )
+  {
+    iov[i].iov_base = buffer[i];
+    msgs[i].msg_hdr.msg_name = &client[i];
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_control = NULL;
+    msgs[i].msg_hdr.msg_controllen = 0;
+    msgs[i].msg_hdr.msg_flags = 0;
+  }
 
   while ( 1 )
   {
-    /* read a datagram from the remote client side (BLOCKING) */
-    n = recvfrom( sd, buffer, MAXBUFFER, 0, (struct sockaddr *) &client,
-                  (socklen_t *) &len );
+    for ( i = 0 ; i < BATCH ; i++ )
+    {
+      iov[i].iov_len = MAXBUFFER;
+      msgs[i].msg_hdr.msg_namelen = sizeof( client[i] );
+    }
+
+    /* block for the first datagram, then take whatever else
+       is already waiting, up to BATCH */
+    n = recvmmsg( sd, msgs, BATCH, MSG_WAITFORONE, NULL );
 
     if ( n < 0 )
     {
-      perror( "recvfrom() failed" );
+      perror( "recvmmsg() failed" );
+      continue;
     }
-    else
+
+    for ( i = 0 ; i < n ; i++ )
     {
       printf( "Rcvd datagram from %s port %d\n",
-              inet_ntoa( client.sin_addr ), ntohs( client.sin_port ) );
+              inet_ntoa( client[i].sin_addr ), ntohs( client[i].sin_port ) );
 
-      printf( "RCVD %d bytes\n", n );
-      buffer[n] = '\0';
-      printf( "RCVD: [%s]\n", buffer );
+      printf( "RCVD %d bytes\n", msgs[i].msg_len );
+      buffer[i][ msgs[i].msg_len ] = '\0';
+      printf( "RCVD: [%s]\n", buffer[i] );
 
       /* echo the data back to the sender/client */
-      sendto( sd, buffer, n, 0, (struct sockaddr *) &client, len );
-        /* to do: check the return code of sendto() */
+      iov[i].iov_len = msgs[i].msg_len;
+    }
+
+    sent = 0;
+    while ( sent < n )
+    {
+      int rc = sendmmsg( sd, msgs + sent, n - sent, 0 );
+      if ( rc < 0 )
+      {
+        perror( "sendmmsg() failed" );
+        rc = 1;   /* skip the datagram that failed */
+      }
+      sent += rc;
     }
   }
 